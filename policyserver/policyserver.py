@@ -16,9 +16,19 @@
 # along with this program; if not, write to the Free Software
 # Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
+import os
 import time
+import socket
 import BaseHTTPServer
+import SocketServer
 import base64
+import gzip
+import StringIO
+
+try:
+	import zstandard
+except ImportError:
+	zstandard = None
 
 
 HOST_NAME = '127.0.0.1'
@@ -30,26 +40,60 @@ PORT_NUMBER = 9000 # Maybe set this to 9000.
 # of policies (each policy is a JSON object).
 users = {"someuser": "password"}
 
+# Clients listening at /events get a "policies" event as soon as the policy
+# file of their user changes, e.g. after "touch someuser.policies". The file
+# is checked every EVENTS_POLL_INTERVAL seconds, and a comment is sent every
+# EVENTS_KEEPALIVE seconds so that broken connections are noticed.
+EVENTS_PATH = "/events"
+EVENTS_POLL_INTERVAL = 1
+EVENTS_KEEPALIVE = 15
+
+# Policies are compressed with the first of these encodings the client
+# accepts. zstd needs the zstandard module.
+ENCODINGS = ["zstd", "gzip"] if zstandard else ["gzip"]
+
+
+def accepted_encodings(header):
+	if header == None:
+		return []
+	return [e.split(";")[0].strip() for e in header.split(",")]
+
+
+def compress(data, encoding):
+	if encoding == "zstd":
+		return zstandard.ZstdCompressor().compress(data)
+
+	buf = StringIO.StringIO()
+	f = gzip.GzipFile(fileobj=buf, mode="wb")
+	f.write(data)
+	f.close()
+	return buf.getvalue()
+
 
 class MyHandler(BaseHTTPServer.BaseHTTPRequestHandler):
+	# Keeps connections open between requests, so every response but the
+	# event stream needs a Content-Length
+	protocol_version = "HTTP/1.1"
+
 	def do_HEAD(self):
 		self.send_response(200)
 #		self.send_header("Content-type", "application/json")
 		self.send_header("Content-type", "text/html")
 		self.end_headers()
 
-	def do_AUTHHEAD(self):
+	def do_AUTHHEAD(self, message):
 		self.send_response(401)
 		self.send_header('WWW-Authenticate', 'Basic realm=\"Policies\"')
 		self.send_header("Content-type", "text/html")
+		self.send_header("Content-Length", len(message))
 		self.end_headers()
+		self.wfile.write(message)
 
 	def do_GET(self):
 		global user
 
 		if self.headers.getheader("Authorization") == None:
-			self.do_AUTHHEAD()
-			self.wfile.write("No authorization header received")
+			self.do_AUTHHEAD("No authorization header received")
 			return
 		elif self.headers.getheader("Authorization").startswith("Basic "):
 			split = self.headers.getheader("Authorization").split(" ")
@@ -61,19 +105,74 @@ class MyHandler(BaseHTTPServer.BaseHTTPRequestHandler):
 			user = userpwd[0]
 			pwd = userpwd[1]
 
-			if (users[user] == pwd):
-				self.do_HEAD()
-				filename = "{}.policies".format(user)
-				print "Reading policies from file {}".format(filename)
-				with open(filename, 'r') as f:
-					self.wfile.write(f.read())
+			if (users[user] == pwd and self.path == EVENTS_PATH):
+				self.do_EVENTS(user)
+			elif (users[user] == pwd):
+				self.do_POLICIES(user)
 			else:
-				self.do_AUTHHEAD()
-				self.wfile.write("Wrong username/password")
+				self.do_AUTHHEAD("Wrong username/password")
 				return
 
+	def do_POLICIES(self, user):
+		filename = "{}.policies".format(user)
+		print "Reading policies from file {}".format(filename)
+		with open(filename, 'r') as f:
+			body = f.read()
+
+		accepted = accepted_encodings(
+				self.headers.getheader("Accept-Encoding"))
+		encoding = next((e for e in ENCODINGS if e in accepted), None)
+		if encoding:
+			body = compress(body, encoding)
+			print "Sending policies {} encoded".format(encoding)
+
+		self.send_response(200)
+		self.send_header("Content-type", "application/json")
+		if encoding:
+			self.send_header("Content-Encoding", encoding)
+		self.send_header("Content-Length", len(body))
+		self.end_headers()
+		self.wfile.write(body)
+
+	def do_EVENTS(self, user):
+		self.send_response(200)
+		self.send_header("Content-type", "text/event-stream")
+		self.send_header("Cache-Control", "no-cache")
+		# The stream ends with the connection
+		self.send_header("Connection", "close")
+		self.end_headers()
+
+		filename = "{}.policies".format(user)
+		print "Sending events for file {}".format(filename)
+		last_change = os.path.getmtime(filename)
+		quiet = 0
+
+		try:
+			while True:
+				time.sleep(EVENTS_POLL_INTERVAL)
+				quiet += EVENTS_POLL_INTERVAL
+
+				change = os.path.getmtime(filename)
+				if change != last_change:
+					last_change = change
+					quiet = 0
+					self.wfile.write("event: policies\n")
+					self.wfile.write("data: {}\n\n".format(filename))
+				elif quiet >= EVENTS_KEEPALIVE:
+					quiet = 0
+					self.wfile.write(": keep-alive\n\n")
+
+				self.wfile.flush()
+		except socket.error:
+			print "Event stream for file {} closed".format(filename)
+
+# Event streams stay open, so each request is served by its own thread
+class ThreadedHTTPServer(SocketServer.ThreadingMixIn,
+		BaseHTTPServer.HTTPServer):
+	daemon_threads = True
+
 if __name__ == '__main__':
-    server_class = BaseHTTPServer.HTTPServer
+    server_class = ThreadedHTTPServer
     httpd = server_class((HOST_NAME, PORT_NUMBER), MyHandler)
     print time.asctime(), "Server Starts - %s:%s" % (HOST_NAME, PORT_NUMBER)
     try:
@@ -0,0 +1,161 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <glib.h>
+#include "atom.h"
+
+struct atom {
+	gint refcount;
+	char string[];
+};
+
+/*
+ * Maps the string of an atom to the atom itself
+ */
+static GHashTable *atoms;
+
+static GMutex atoms_lock;
+
+static inline struct atom *to_atom(const char *string)
+{
+	return (struct atom *) (string - offsetof(struct atom, string));
+}
+
+/*
+ * Must be called with atoms_lock held
+ */
+static const char *intern_locked(const char *string)
+{
+	struct atom *atom;
+	size_t length;
+
+	if (!atoms)
+		atoms = g_hash_table_new(g_str_hash, g_str_equal);
+
+	atom = g_hash_table_lookup(atoms, string);
+	if (atom) {
+		g_atomic_int_inc(&atom->refcount);
+		return atom->string;
+	}
+
+	length = strlen(string);
+	atom = g_malloc(sizeof(struct atom) + length + 1);
+	atom->refcount = 1;
+	memcpy(atom->string, string, length + 1);
+
+	g_hash_table_insert(atoms, atom->string, atom);
+
+	return atom->string;
+}
+
+const char *pold_atom_intern(const char *string)
+{
+	const char *atom;
+
+	if (!string)
+		return NULL;
+
+	g_mutex_lock(&atoms_lock);
+	atom = intern_locked(string);
+	g_mutex_unlock(&atoms_lock);
+
+	return atom;
+}
+
+const char *pold_atom_printf(const char *format, ...)
+{
+	const char *atom;
+	char *string;
+	va_list ap;
+
+	va_start(ap, format);
+	string = g_strdup_vprintf(format, ap);
+	va_end(ap);
+
+	atom = pold_atom_intern(string);
+	g_free(string);
+
+	return atom;
+}
+
+const char *pold_atom_lookup(const char *string)
+{
+	struct atom *atom = NULL;
+
+	if (!string)
+		return NULL;
+
+	g_mutex_lock(&atoms_lock);
+	if (atoms)
+		atom = g_hash_table_lookup(atoms, string);
+	g_mutex_unlock(&atoms_lock);
+
+	return atom ? atom->string : NULL;
+}
+
+const char *pold_atom_ref(const char *string)
+{
+	if (string)
+		g_atomic_int_inc(&to_atom(string)->refcount);
+
+	return string;
+}
+
+void pold_atom_unref(const char *string)
+{
+	struct atom *atom;
+
+	if (!string)
+		return;
+
+	atom = to_atom(string);
+
+	/*
+	 * The lock keeps pold_atom_intern() from handing out the atom again
+	 * while it is being removed
+	 */
+	g_mutex_lock(&atoms_lock);
+	if (g_atomic_int_dec_and_test(&atom->refcount)) {
+		g_hash_table_remove(atoms, atom->string);
+		g_free(atom);
+	}
+	g_mutex_unlock(&atoms_lock);
+}
+
+void pold_atom_free(gpointer atom)
+{
+	pold_atom_unref(atom);
+}
+
+unsigned int pold_atom_count(void)
+{
+	unsigned int count = 0;
+
+	g_mutex_lock(&atoms_lock);
+	if (atoms)
+		count = g_hash_table_size(atoms);
+	g_mutex_unlock(&atoms_lock);
+
+	return count;
+}
@@ -0,0 +1,68 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef ATOM_H
+#define ATOM_H
+
+#include <glib.h>
+
+/*
+ * Atoms are interned, immutable strings. Interning the same string twice
+ * yields the same pointer, so atoms can be compared with == and used as
+ * keys of g_direct_hash tables without hashing the string again. Unlike
+ * GQuarks, atoms are reference counted and freed once unused, bus names
+ * come and go all the time.
+ *
+ * All functions may be called from any thread.
+ */
+
+/*
+ * Returns the atom of the string with a new reference, NULL for NULL
+ */
+const char *pold_atom_intern(const char *string);
+
+/*
+ * Like pold_atom_intern() for a formatted string
+ */
+const char *pold_atom_printf(const char *format, ...) G_GNUC_PRINTF(1, 2);
+
+/*
+ * Returns the atom of the string without taking a reference, NULL if the
+ * string is not interned. The result may only be compared, it is not
+ * guaranteed to stay valid.
+ */
+const char *pold_atom_lookup(const char *string);
+
+const char *pold_atom_ref(const char *atom);
+
+void pold_atom_unref(const char *atom);
+
+/*
+ * Matches the signature of a GDestroyNotify
+ */
+void pold_atom_free(gpointer atom);
+
+/*
+ * Returns the number of distinct atoms alive
+ */
+unsigned int pold_atom_count(void);
+
+#endif
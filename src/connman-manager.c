@@ -32,6 +32,8 @@
 #include "connman-manager.h"
 #include "session.h"
 
+#define POLD_LOG_CATEGORY POLD_LOG_CONNMAN
+
 static DBusConnection *connection;
 
 static void create_session_cb(DBusPendingCall *call, void *user_data)
@@ -60,7 +62,7 @@ out:
 	dbus_pending_call_unref(call);
 }
 
-void pold_connman_manager_create_session(void)
+void pold_connman_manager_create_session(int timeout)
 {
 	DBusPendingCall *call;
 	DBusMessage *message = NULL;
@@ -101,7 +103,8 @@ void pold_connman_manager_create_session(void)
 	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH,
 			&notification_path);
 
-	if (!dbus_connection_send_with_reply(connection, message, &call, -1)) {
+	if (!dbus_connection_send_with_reply(connection, message, &call,
+			timeout)) {
 		pold_log_debug("Failed to execute method call");
 		goto out;
 	}
@@ -24,7 +24,10 @@
 
 #include <dbus/dbus.h>
 
-void pold_connman_manager_create_session(void);
+/*
+ * Creates pold's ConnMan session, giving up after timeout milliseconds
+ */
+void pold_connman_manager_create_session(int timeout);
 
 void pold_connman_manager_init(DBusConnection *conn);
 
@@ -31,6 +31,8 @@
 #include "dbus.h"
 #include "session.h"
 
+#define POLD_LOG_CATEGORY POLD_LOG_CONNMAN
+
 static DBusMessage *release(DBusConnection *conn, DBusMessage *message,
 		void *user_data)
 {
@@ -54,6 +56,7 @@ static DBusMessage *update(DBusConnection *conn, DBusMessage *message,
 	DBusMessageIter dict, entry, value;
 	const char *key;
 	const char *state;
+	const char *bearer;
 
 	reply = dbus_message_new_method_return(message);
 
@@ -73,6 +76,9 @@ static DBusMessage *update(DBusConnection *conn, DBusMessage *message,
 		if (g_strcmp0(key, "State") == 0) {
 			dbus_message_iter_get_basic(&value, &state);
 			pold_session_set_state(state);
+		} else if (g_strcmp0(key, "Bearer") == 0) {
+			dbus_message_iter_get_basic(&value, &bearer);
+			pold_session_set_bearer(bearer);
 		}
 
 		dbus_message_iter_next(&dict);
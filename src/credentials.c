@@ -0,0 +1,593 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+#include <glib.h>
+#include <gdbus.h>
+#include "log.h"
+#include "fdo-dbus.h"
+#include "stats.h"
+#include "atom.h"
+#include "credentials.h"
+
+#define POLD_LOG_CATEGORY POLD_LOG_DBUS
+
+/*
+ * Initial buffer size for the reentrant NSS functions, doubled as long as
+ * they report ERANGE
+ */
+#define NSS_BUFFER_SIZE 1024
+
+/*
+ * Initial number of groups asked from getgrouplist()
+ */
+#define GROUP_LIST_SIZE 32
+
+/*
+ * Group memberships may change while the daemon runs, so users are looked
+ * up again after this long
+ */
+#define USER_TTL_IN_SECONDS 300
+
+/*
+ * Prefetches are speculative, so they neither wait long for the bus daemon
+ * nor pile up when many connections appear at once
+ */
+#define PREFETCH_TIMEOUT_IN_MILLISECONDS 1000
+#define MAX_PREFETCHES 64
+
+/*
+ * Credentials of a new connection being retrieved
+ */
+struct prefetch {
+	char *owner;
+
+	struct pold_credentials credentials;
+
+	/* The connection disappeared in the meantime */
+	bool cancelled;
+};
+
+static DBusConnection *connection;
+
+static guint name_owner_watch;
+
+/*
+ * Maps the unique bus name to its pold_credentials
+ */
+static GHashTable *cache;
+
+/*
+ * Maps the unique bus name to its prefetch in progress
+ */
+static GHashTable *prefetches;
+
+/*
+ * Looks up user and group names, one prefetch at a time so that requests
+ * are not slowed down by speculative work
+ */
+static GThreadPool *resolver;
+
+/*
+ * Prefetches the resolver is done with, handed back to the main thread
+ */
+static GAsyncQueue *resolved;
+
+static GRegex *filter_regex;
+
+/*
+ * A resolved user id
+ */
+struct user_entry {
+	const char *user;
+	gid_t gid;
+	gid_t *gids;
+	unsigned int n_gids;
+
+	/* Monotonic time after which the entry is looked up again */
+	gint64 expires;
+};
+
+/*
+ * Map user ids to user_entry and group ids to their "group:name" atom.
+ * NSS failures are not cached, they are retried with the next request.
+ */
+static GHashTable *users;
+static GHashTable *group_names;
+
+static GMutex names_lock;
+
+/*
+ * Returns all groups of a user, including the primary group
+ */
+static gid_t *get_groups(const char *name, gid_t gid, unsigned int *n_gids)
+{
+	int size = GROUP_LIST_SIZE, count;
+	gid_t *gids;
+
+	for (;;) {
+		gids = g_new(gid_t, size);
+		count = size;
+		if (getgrouplist(name, gid, gids, &count) >= 0)
+			break;
+
+		g_free(gids);
+		size = count > size ? count : size * 2;
+	}
+
+	*n_gids = count;
+
+	return gids;
+}
+
+static char *get_user_name(uid_t uid, gid_t *gid, gid_t **gids,
+		unsigned int *n_gids)
+{
+	struct passwd pwd, *result;
+	size_t size = NSS_BUFFER_SIZE;
+	char *buffer, *name = NULL;
+	int err;
+
+	for (;;) {
+		buffer = g_malloc(size);
+		err = getpwuid_r(uid, &pwd, buffer, size, &result);
+		if (err != ERANGE)
+			break;
+
+		g_free(buffer);
+		size *= 2;
+	}
+
+	if (result) {
+		name = g_strdup(pwd.pw_name);
+		*gid = pwd.pw_gid;
+		*gids = get_groups(pwd.pw_name, pwd.pw_gid, n_gids);
+	} else {
+		pold_log_error("getpwuid_r for %u failed with error code %d",
+				uid, err);
+	}
+
+	g_free(buffer);
+
+	return name;
+}
+
+static char *get_group_name(gid_t gid)
+{
+	struct group grp, *result;
+	size_t size = NSS_BUFFER_SIZE;
+	char *buffer, *name = NULL;
+	int err;
+
+	for (;;) {
+		buffer = g_malloc(size);
+		err = getgrgid_r(gid, &grp, buffer, size, &result);
+		if (err != ERANGE)
+			break;
+
+		g_free(buffer);
+		size *= 2;
+	}
+
+	if (result)
+		name = g_strdup(grp.gr_name);
+	else
+		pold_log_error("getgrgid_r for %u failed with error code %d",
+				gid, err);
+
+	g_free(buffer);
+
+	return name;
+}
+
+static void free_user_entry(gpointer pointer)
+{
+	struct user_entry *entry = pointer;
+
+	pold_atom_unref(entry->user);
+	g_free(entry->gids);
+	g_free(entry);
+}
+
+const char *pold_credentials_user(uid_t uid, gid_t *gid, gid_t **gids,
+		unsigned int *n_gids)
+{
+	struct user_entry *entry;
+	const char *user = NULL;
+	gint64 now = g_get_monotonic_time();
+	char *name;
+
+	g_mutex_lock(&names_lock);
+	if (!users)
+		users = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				NULL, free_user_entry);
+
+	entry = g_hash_table_lookup(users, GUINT_TO_POINTER(uid));
+	if (entry && now < entry->expires) {
+		user = pold_atom_ref(entry->user);
+		*gid = entry->gid;
+		*gids = g_memdup(entry->gids, entry->n_gids * sizeof(gid_t));
+		*n_gids = entry->n_gids;
+	}
+	g_mutex_unlock(&names_lock);
+
+	if (user)
+		return user;
+
+	/* NSS may be slow, so it is asked without holding the lock */
+	name = get_user_name(uid, gid, gids, n_gids);
+	if (!name)
+		return NULL;
+
+	user = pold_atom_printf("user:%s", name);
+	g_free(name);
+
+	entry = g_new0(struct user_entry, 1);
+	entry->user = pold_atom_ref(user);
+	entry->gid = *gid;
+	entry->gids = g_memdup(*gids, *n_gids * sizeof(gid_t));
+	entry->n_gids = *n_gids;
+	entry->expires = now + USER_TTL_IN_SECONDS * G_USEC_PER_SEC;
+
+	g_mutex_lock(&names_lock);
+	g_hash_table_replace(users, GUINT_TO_POINTER(uid), entry);
+	g_mutex_unlock(&names_lock);
+
+	return user;
+}
+
+const char *pold_credentials_group(gid_t gid)
+{
+	const char *group;
+	char *name;
+
+	g_mutex_lock(&names_lock);
+	if (!group_names)
+		group_names = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, pold_atom_free);
+
+	group = pold_atom_ref(g_hash_table_lookup(group_names,
+				GUINT_TO_POINTER(gid)));
+	g_mutex_unlock(&names_lock);
+
+	if (group)
+		return group;
+
+	name = get_group_name(gid);
+	if (!name)
+		return NULL;
+
+	group = pold_atom_printf("group:%s", name);
+	g_free(name);
+
+	g_mutex_lock(&names_lock);
+	if (!g_hash_table_contains(group_names, GUINT_TO_POINTER(gid)))
+		g_hash_table_insert(group_names, GUINT_TO_POINTER(gid),
+				(gpointer) pold_atom_ref(group));
+	g_mutex_unlock(&names_lock);
+
+	return group;
+}
+
+const char *pold_credentials_parse_selinux(const char *context)
+{
+	const char *ident;
+	char **tokens;
+
+	/*
+	 * SELinux combines Role-Based Access Control (RBAC), Type
+	 * Enforcment (TE) and optionally Multi-Level Security (MLS).
+	 *
+	 * When SELinux is enabled all processes and files are labeled
+	 * with a contex that contains information such as user, role
+	 * type (and optionally a level). E.g.
+	 *
+	 * $ ls -Z
+	 * -rwxrwxr-x. wagi wagi unconfined_u:object_r:haifux_exec_t:s0 session_ui.py
+	 *
+	 * For identifyng application we (ab)using the type
+	 * information. In the above example the haifux_exec_t type
+	 * will be transfered to haifux_t as defined in the domain
+	 * transition and thus we are able to identify the application
+	 * as haifux_t.
+	 */
+
+	tokens = g_strsplit(context, ":", 0);
+	if (g_strv_length(tokens) < 3) {
+		g_strfreev(tokens);
+		return NULL;
+	}
+
+	/* Use the SELinux type as identification token. */
+	ident = pold_atom_printf("selinux:%s", tokens[2]);
+
+	g_strfreev(tokens);
+
+	return ident;
+}
+
+static void clear_credentials(struct pold_credentials *credentials)
+{
+	pold_atom_unref(credentials->selinux);
+	pold_atom_unref(credentials->user);
+	pold_atom_unref(credentials->group);
+	g_free(credentials->gids);
+}
+
+static void free_credentials(gpointer pointer)
+{
+	struct pold_credentials *credentials = pointer;
+
+	clear_credentials(credentials);
+	g_free(credentials);
+}
+
+const struct pold_credentials *pold_credentials_lookup(const char *owner)
+{
+	struct pold_credentials *credentials;
+
+	if (!cache)
+		return NULL;
+
+	credentials = g_hash_table_lookup(cache, owner);
+	if (credentials)
+		pold_stats_inc(POLD_STATS_CREDENTIAL_CACHE_HITS);
+	else
+		pold_stats_inc(POLD_STATS_CREDENTIAL_CACHE_MISSES);
+
+	return credentials;
+}
+
+static void free_prefetch(struct prefetch *prefetch)
+{
+	if (!prefetch->cancelled)
+		g_hash_table_remove(prefetches, prefetch->owner);
+
+	clear_credentials(&prefetch->credentials);
+	g_free(prefetch->owner);
+	g_free(prefetch);
+}
+
+static bool matches_filter(const char *id)
+{
+	return id && g_regex_match(filter_regex, id, 0, NULL);
+}
+
+static void prefetch_done(struct prefetch *prefetch)
+{
+	struct pold_credentials *credentials;
+
+	if (prefetch->cancelled)
+		goto out;
+
+	if (filter_regex && !matches_filter(prefetch->credentials.selinux) &&
+			!matches_filter(prefetch->credentials.user) &&
+			!matches_filter(prefetch->credentials.group))
+		goto out;
+
+	credentials = g_new0(struct pold_credentials, 1);
+	*credentials = prefetch->credentials;
+	memset(&prefetch->credentials, 0, sizeof(prefetch->credentials));
+
+	g_hash_table_replace(cache, g_strdup(prefetch->owner), credentials);
+	pold_stats_set(POLD_STATS_CREDENTIALS, g_hash_table_size(cache));
+
+	pold_log_debug("Prefetched credentials of %s (%s, %s, %s)",
+			prefetch->owner, credentials->selinux,
+			credentials->user, credentials->group);
+
+out:
+	free_prefetch(prefetch);
+}
+
+static gboolean deliver_prefetches(gpointer user_data)
+{
+	struct prefetch *prefetch;
+
+	if (!resolved)
+		return FALSE;
+
+	while ((prefetch = g_async_queue_try_pop(resolved)))
+		prefetch_done(prefetch);
+
+	return FALSE;
+}
+
+/*
+ * Runs on the resolver thread
+ */
+static void resolve_names(gpointer data, gpointer user_data)
+{
+	struct prefetch *prefetch = data;
+	struct pold_credentials *credentials = &prefetch->credentials;
+
+	credentials->user = pold_credentials_user(credentials->uid,
+			&credentials->gid, &credentials->gids,
+			&credentials->n_gids);
+	if (credentials->user)
+		credentials->group = pold_credentials_group(credentials->gid);
+
+	g_async_queue_push(resolved, prefetch);
+	g_idle_add(deliver_prefetches, NULL);
+}
+
+static void user_cb(unsigned int uid, void *user_data, int err)
+{
+	struct prefetch *prefetch = user_data;
+
+	if (err < 0 || prefetch->cancelled) {
+		free_prefetch(prefetch);
+		return;
+	}
+
+	prefetch->credentials.uid = uid;
+
+	g_thread_pool_push(resolver, prefetch, NULL);
+}
+
+static void selinux_cb(const unsigned char *selinux, void *user_data,
+		int err)
+{
+	struct prefetch *prefetch = user_data;
+
+	if (prefetch->cancelled) {
+		free_prefetch(prefetch);
+		return;
+	}
+
+	if (err == 0)
+		prefetch->credentials.selinux = pold_credentials_parse_selinux(
+				(const char *) selinux);
+
+	if (pold_fdo_dbus_get_connection_unix_user(connection,
+			prefetch->owner, user_cb, prefetch,
+			PREFETCH_TIMEOUT_IN_MILLISECONDS) < 0)
+		free_prefetch(prefetch);
+}
+
+static void start_prefetch(const char *owner)
+{
+	struct prefetch *prefetch;
+
+	if (g_hash_table_size(prefetches) >= MAX_PREFETCHES) {
+		pold_log_debug("Too many prefetches, skipping %s", owner);
+		return;
+	}
+
+	prefetch = g_new0(struct prefetch, 1);
+	prefetch->owner = g_strdup(owner);
+	g_hash_table_insert(prefetches, prefetch->owner, prefetch);
+	pold_stats_inc(POLD_STATS_PREFETCHES);
+
+	if (pold_fdo_dbus_get_connection_selinux_context(connection, owner,
+			selinux_cb, prefetch,
+			PREFETCH_TIMEOUT_IN_MILLISECONDS) < 0)
+		free_prefetch(prefetch);
+}
+
+static gboolean name_owner_changed(DBusConnection *dbus_connection,
+		DBusMessage *message, void *user_data)
+{
+	const char *name, *old_owner, *new_owner;
+	struct prefetch *prefetch;
+
+	if (!dbus_message_get_args(message, NULL,
+			DBUS_TYPE_STRING, &name,
+			DBUS_TYPE_STRING, &old_owner,
+			DBUS_TYPE_STRING, &new_owner,
+			DBUS_TYPE_INVALID))
+		return TRUE;
+
+	/* Only unique names carry credentials of their own */
+	if (name[0] != ':')
+		return TRUE;
+
+	if (new_owner[0] != '\0') {
+		start_prefetch(name);
+		return TRUE;
+	}
+
+	prefetch = g_hash_table_lookup(prefetches, name);
+	if (prefetch) {
+		prefetch->cancelled = true;
+		g_hash_table_remove(prefetches, name);
+	}
+
+	if (g_hash_table_remove(cache, name))
+		pold_stats_set(POLD_STATS_CREDENTIALS,
+				g_hash_table_size(cache));
+
+	return TRUE;
+}
+
+bool pold_credentials_init(DBusConnection *dbus_connection, bool prefetch,
+		const char *filter)
+{
+	GError *error = NULL;
+
+	connection = dbus_connection;
+
+	if (!prefetch)
+		return true;
+
+	if (filter) {
+		filter_regex = g_regex_new(filter, G_REGEX_OPTIMIZE, 0,
+				&error);
+		if (!filter_regex) {
+			pold_log_error("Invalid prefetch filter: %s",
+					error->message);
+			g_error_free(error);
+			return false;
+		}
+	}
+
+	resolver = g_thread_pool_new(resolve_names, NULL, 1, FALSE, NULL);
+	resolved = g_async_queue_new();
+	cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			free_credentials);
+	prefetches = g_hash_table_new(g_str_hash, g_str_equal);
+
+	name_owner_watch = g_dbus_add_signal_watch(connection,
+			DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+			"NameOwnerChanged", name_owner_changed, NULL, NULL);
+
+	pold_log_info("Prefetching credentials of new connections");
+
+	return true;
+}
+
+void pold_credentials_final(void)
+{
+	struct prefetch *prefetch;
+
+	if (cache) {
+		g_dbus_remove_watch(connection, name_owner_watch);
+
+		/*
+		 * Queued lookups still run, so that no prefetch is lost
+		 * in the queue, but their results are dropped
+		 */
+		g_thread_pool_free(resolver, FALSE, TRUE);
+		while ((prefetch = g_async_queue_try_pop(resolved)))
+			free_prefetch(prefetch);
+		g_async_queue_unref(resolved);
+		resolved = NULL;
+
+		g_hash_table_destroy(prefetches);
+		g_hash_table_destroy(cache);
+		cache = NULL;
+
+		if (filter_regex)
+			g_regex_unref(filter_regex);
+	}
+
+	g_mutex_lock(&names_lock);
+	if (users)
+		g_hash_table_destroy(users);
+	if (group_names)
+		g_hash_table_destroy(group_names);
+	users = group_names = NULL;
+	g_mutex_unlock(&names_lock);
+}
@@ -0,0 +1,93 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <dbus/dbus.h>
+
+/*
+ * The identity of a D-Bus connection as far as policies are concerned
+ */
+struct pold_credentials {
+	/*
+	 * The policy ids "selinux:type", "user:name" and "group:name" as
+	 * atoms, NULL if unknown
+	 */
+	const char *selinux;
+	const char *user;
+	const char *group;
+
+	uid_t uid;
+	gid_t gid;
+
+	/* All groups of the user, NULL if unknown */
+	gid_t *gids;
+	unsigned int n_gids;
+};
+
+/*
+ * Returns the "user:name" atom of a user, its primary group and a copy of
+ * all its groups, to be freed with g_free(), NULL if the lookup failed.
+ * Users are looked up again once their entry is older than a few minutes,
+ * so that changes of group memberships are seen. Safe to call from any
+ * thread.
+ */
+const char *pold_credentials_user(uid_t uid, gid_t *gid, gid_t **gids,
+		unsigned int *n_gids);
+
+/*
+ * Returns the "group:name" atom of a group, NULL if the lookup failed.
+ * Group names are cached for the lifetime of the daemon.
+ */
+const char *pold_credentials_group(gid_t gid);
+
+/*
+ * Returns the "selinux:type" atom of an SELinux context
+ */
+const char *pold_credentials_parse_selinux(const char *context);
+
+/*
+ * Returns the prefetched credentials of a unique bus name, NULL if they
+ * are not known (yet). Always NULL unless prefetching is enabled.
+ *
+ * Only the credentials are prefetched, not the policy they resolve to.
+ * That policy changes with every reload and with the context of the rules,
+ * while the credentials stay the same as long as the connection lives.
+ * Resolving is an in-memory lookup on a worker, the bus and NSS round trips
+ * the prefetch saves are what makes a request slow.
+ */
+const struct pold_credentials *pold_credentials_lookup(const char *owner);
+
+/*
+ * With prefetch set, the credentials of every new connection to the bus are
+ * retrieved and cached until it disconnects. If filter is given, only
+ * credentials with a policy id ("selinux:x", "user:x" or "group:x")
+ * matching this regular expression are kept.
+ */
+bool pold_credentials_init(DBusConnection *dbus_connection, bool prefetch,
+		const char *filter);
+
+void pold_credentials_final(void);
+
+#endif
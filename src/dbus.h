@@ -22,6 +22,7 @@
 #define POLD_BUS_NAME "de.bmw.pold1"
 #define POLD_MANAGER_PATH "/de/bmw/pold1"
 #define POLD_MANAGER_INTERFACE "de.bmw.pold.Manager1"
+#define POLD_STATS_INTERFACE "de.bmw.pold.Stats1"
 #define POLD_AGENT_NOTIFICATION_INTERFACE "de.bmw.pold.Notification1"
 #define POLD_NOTIFICATION_PATH "/de/bmw/pold1"
 
@@ -22,8 +22,11 @@
 #include <errno.h>
 #include <glib.h>
 #include "log.h"
+#include "pool.h"
 #include "fdo-dbus.h"
 
+#define POLD_LOG_CATEGORY POLD_LOG_DBUS
+
 #define DBUS_UNIQUE_BUSNAME "org.freedesktop.DBus"
 #define DBUS_OBJECT_PATH "/"
 #define DBUS_INTERFACE "org.freedesktop.DBus"
@@ -33,6 +36,43 @@ struct callback_data {
 	void *data;
 };
 
+/*
+ * Pending calls are set up and completed on the main thread only
+ */
+static struct pold_pool callback_pool =
+	POLD_POOL_INIT(struct callback_data, 64);
+
+static struct callback_data *new_callback_data(void)
+{
+	return pold_pool_alloc0(&callback_pool);
+}
+
+static void free_callback_data(void *data)
+{
+	pold_pool_free(&callback_pool, data);
+}
+
+void pold_fdo_dbus_final(void)
+{
+	/* Calls still pending on the connection keep their data */
+	if (!pold_pool_clear(&callback_pool))
+		pold_log_debug("%u calls still pending",
+				callback_pool.allocated);
+}
+
+/*
+ * Maps an error reply to an error code. libdbus answers a call itself with
+ * NoReply when its timeout expires.
+ */
+static int reply_error(DBusMessage *reply)
+{
+	if (dbus_message_is_error(reply, DBUS_ERROR_NO_REPLY) ||
+			dbus_message_is_error(reply, DBUS_ERROR_TIMEOUT))
+		return -ETIMEDOUT;
+
+	return -EIO;
+}
+
 static unsigned char *parse_context(DBusMessage *msg)
 {
 	DBusMessageIter iter, array;
@@ -81,7 +121,7 @@ static void get_connection_selinux_context_reply(DBusPendingCall *call,
 
 	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
 		pold_log_debug("Failed to retrieve SELinux context");
-		err = -EIO;
+		err = reply_error(reply);
 		goto out;
 	}
 
@@ -103,7 +143,7 @@ out:
 int pold_fdo_dbus_get_connection_selinux_context(DBusConnection *connection,
 			const char *service,
 			pold_dbus_get_connection_selinux_context_cb callback,
-			void *user_data)
+			void *user_data, int timeout)
 {
 	struct callback_data *data;
 	DBusPendingCall *call;
@@ -113,7 +153,7 @@ int pold_fdo_dbus_get_connection_selinux_context(DBusConnection *connection,
 	if (!callback)
 		return -EINVAL;
 
-	data = g_new0(struct callback_data, 1);
+	data = new_callback_data();
 
 	msg = dbus_message_new_method_call(DBUS_UNIQUE_BUSNAME,
 					DBUS_OBJECT_PATH, DBUS_INTERFACE,
@@ -127,7 +167,8 @@ int pold_fdo_dbus_get_connection_selinux_context(DBusConnection *connection,
 	dbus_message_append_args(msg, DBUS_TYPE_STRING, &service,
 			DBUS_TYPE_INVALID);
 
-	if (!dbus_connection_send_with_reply(connection, msg, &call, -1)) {
+	if (!dbus_connection_send_with_reply(connection, msg, &call,
+			timeout)) {
 		pold_log_debug("Failed to execute method call");
 		err = -EINVAL;
 		goto error;
@@ -143,7 +184,7 @@ int pold_fdo_dbus_get_connection_selinux_context(DBusConnection *connection,
 	data->data = user_data;
 
 	dbus_pending_call_set_notify(call, get_connection_selinux_context_reply,
-							data, g_free);
+			data, free_callback_data);
 
 	dbus_message_unref(msg);
 
@@ -151,7 +192,7 @@ int pold_fdo_dbus_get_connection_selinux_context(DBusConnection *connection,
 
 error:
 	dbus_message_unref(msg);
-	g_free(data);
+	free_callback_data(data);
 
 	return err;
 }
@@ -170,7 +211,7 @@ static void get_connection_unix_user_reply(DBusPendingCall *call,
 
 	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
 		pold_log_debug("Failed to retrieve UID");
-		err = -EIO;
+		err = reply_error(reply);
 		goto out;
 	}
 
@@ -192,14 +233,14 @@ out:
 int pold_fdo_dbus_get_connection_unix_user(DBusConnection *connection,
 				const char *owner,
 				pold_dbus_get_connection_unix_user_cb callback,
-				void *user_data)
+				void *user_data, int timeout)
 {
 	struct callback_data *data;
 	DBusPendingCall *call;
 	DBusMessage *msg = NULL;
 	int err;
 
-	data = g_new0(struct callback_data, 1);
+	data = new_callback_data();
 
 	msg = dbus_message_new_method_call(DBUS_UNIQUE_BUSNAME,
 					DBUS_OBJECT_PATH, DBUS_INTERFACE,
@@ -213,7 +254,8 @@ int pold_fdo_dbus_get_connection_unix_user(DBusConnection *connection,
 	dbus_message_append_args(msg, DBUS_TYPE_STRING, &owner,
 					DBUS_TYPE_INVALID);
 
-	if (!dbus_connection_send_with_reply(connection, msg, &call, -1)) {
+	if (!dbus_connection_send_with_reply(connection, msg, &call,
+			timeout)) {
 		pold_log_debug("Failed to execute method call");
 		err = -EINVAL;
 		goto error;
@@ -233,7 +275,7 @@ int pold_fdo_dbus_get_connection_unix_user(DBusConnection *connection,
 	 * itself!
 	 */
 	dbus_pending_call_set_notify(call, get_connection_unix_user_reply,
-			data, g_free);
+			data, free_callback_data);
 
 	dbus_message_unref(msg);
 
@@ -241,7 +283,7 @@ int pold_fdo_dbus_get_connection_unix_user(DBusConnection *connection,
 
 error:
 	dbus_message_unref(msg);
-	g_free(data);
+	free_callback_data(data);
 
 	return err;
 }
@@ -24,13 +24,18 @@
 
 #include <dbus/dbus.h>
 
+/*
+ * The timeout of the calls is given in milliseconds, -1 for the libdbus
+ * default. The callback gets -ETIMEDOUT if it expired.
+ */
+
 typedef void (*pold_dbus_get_connection_selinux_context_cb) (
 		const unsigned char *context, void *user_data, int err);
 
 int pold_fdo_dbus_get_connection_selinux_context(DBusConnection *connection,
 		const char *owner,
 		pold_dbus_get_connection_selinux_context_cb callback,
-		void *user_data);
+		void *user_data, int timeout);
 
 typedef void (*pold_dbus_get_connection_unix_user_cb) (unsigned int uid,
 		void *user_data, int err);
@@ -38,6 +43,8 @@ typedef void (*pold_dbus_get_connection_unix_user_cb) (unsigned int uid,
 int pold_fdo_dbus_get_connection_unix_user(DBusConnection *connection,
 				const char *owner,
 				pold_dbus_get_connection_unix_user_cb callback,
-				void *user_data);
+				void *user_data, int timeout);
+
+void pold_fdo_dbus_final(void);
 
 #endif
@@ -0,0 +1,90 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <string.h>
+#include <glib.h>
+#include "histogram.h"
+
+static unsigned int value_to_bucket(guint64 value)
+{
+	unsigned int msb;
+
+	if (value < POLD_HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	/* Position of the most significant bit, at least 2 here */
+	msb = g_bit_storage(value) - 1;
+
+	return (msb - 1) * POLD_HISTOGRAM_SUB_BUCKETS +
+		((value >> (msb - 2)) & (POLD_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static guint64 bucket_upper_bound(unsigned int bucket)
+{
+	unsigned int msb, sub;
+	guint64 lower;
+
+	if (bucket < POLD_HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+
+	msb = bucket / POLD_HISTOGRAM_SUB_BUCKETS + 1;
+	sub = bucket % POLD_HISTOGRAM_SUB_BUCKETS;
+	lower = (guint64) (POLD_HISTOGRAM_SUB_BUCKETS + sub) << (msb - 2);
+
+	return lower + ((guint64) 1 << (msb - 2)) - 1;
+}
+
+void pold_histogram_add(struct pold_histogram *histogram, guint64 value)
+{
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max)
+		histogram->max = value;
+	histogram->buckets[value_to_bucket(value)]++;
+}
+
+guint64 pold_histogram_percentile(const struct pold_histogram *histogram,
+		double percentile)
+{
+	guint64 rank, seen = 0;
+	unsigned int i;
+
+	if (histogram->count == 0)
+		return 0;
+
+	rank = (guint64) (percentile * histogram->count);
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < POLD_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank)
+			return MIN(bucket_upper_bound(i), histogram->max);
+	}
+
+	return histogram->max;
+}
+
+void pold_histogram_reset(struct pold_histogram *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+}
@@ -0,0 +1,53 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <glib.h>
+
+/*
+ * Values below 4 get a bucket of their own, every larger power of two is
+ * split into 4 buckets. The relative error of a percentile is thus at most
+ * 25%, no matter how large the values are.
+ */
+#define POLD_HISTOGRAM_SUB_BUCKETS 4
+#define POLD_HISTOGRAM_BUCKETS (63 * POLD_HISTOGRAM_SUB_BUCKETS)
+
+struct pold_histogram {
+	guint64 count;
+	guint64 sum;
+	guint64 max;
+	guint64 buckets[POLD_HISTOGRAM_BUCKETS];
+};
+
+void pold_histogram_add(struct pold_histogram *histogram, guint64 value);
+
+/*
+ * Returns the upper bound of the bucket which contains the given percentile,
+ * e.g. 0.99 for the p99 value, or 0 if the histogram is empty.
+ */
+guint64 pold_histogram_percentile(const struct pold_histogram *histogram,
+		double percentile);
+
+void pold_histogram_reset(struct pold_histogram *histogram);
+
+#endif
@@ -24,134 +24,1308 @@
 #include <libsoup/soup.h>
 #include <glib.h>
 #include <glib/gprintf.h>
+#include <jansson.h>
+#if (HAVE_ZSTD > 0)
+#include <zstd.h>
+#endif
 #include "log.h"
 #include "policy.h"
 #include "http-client.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
 
+#define POLD_LOG_CATEGORY POLD_LOG_HTTP
+
+/*
+ * The policy server asked if there is no sources file
+ */
 #define HOST "http://127.0.0.1:9000"
 #define UPDATE_URL HOST "/update_policies"
+#define EVENTS_URL HOST "/events"
+
+#define SOURCES_FILE SYSCONFDIR "/pold/sources.conf"
+
+#define POLICY_FILE_SUFFIX ".policy"
+
+/*
+ * A source is fetched again once its policies are older than its Interval,
+ * by default this many seconds
+ */
+#define DEFAULT_INTERVAL_IN_SECONDS 10
+
+/*
+ * Once a fetch from a source failed, the source is left alone for a backoff
+ * which doubles with each further failure, from BACKOFF_MIN up to
+ * BACKOFF_MAX. The backoff is jittered to between half and all of it, so
+ * that daemons which lost the same server do not come back in lockstep.
+ */
+#define BACKOFF_MIN_IN_MILLISECONDS 1000
+#define BACKOFF_MAX_IN_MILLISECONDS (5 * 60 * 1000)
+
+/*
+ * An event stream which sends more than this without completing an event
+ * is cut off
+ */
+#define MAX_EVENT_SIZE (64 * 1024)
+
+#define CHANGE_EVENT "policies"
+
+#define EVENT_STREAM_TYPE "text/event-stream"
+
+/*
+ * A stream which comes back after it was lost triggers an update to catch up
+ * on missed changes, but not more often than this
+ */
+#define CATCH_UP_INTERVAL_IN_SECONDS 60
+
+/*
+ * Connections to the sources are kept open between refreshes, and one per
+ * source is opened ahead of the first refresh, so that a refresh does not
+ * wait on DNS, TCP and TLS setup. An event stream holds a connection of its
+ * own.
+ */
+#define MAX_CONNS_PER_HOST 4
+#define IDLE_TIMEOUT_IN_SECONDS (10 * 60)
+
+/*
+ * Policies which decompress to more than this are refused
+ */
+#define MAX_POLICIES_SIZE (16 * 1024 * 1024)
+
+/*
+ * gzip and deflate are decoded by libsoup, zstd by ourselves
+ */
+#if (HAVE_ZSTD > 0)
+#define ACCEPT_ENCODING "zstd, gzip, deflate"
+#else
+#define ACCEPT_ENCODING "gzip, deflate"
+#endif
+
+/*
+ * A place policies are fetched from, configured by a group of the sources
+ * file like
+ *
+ *   [central]
+ *   Url=http://policies.example.com/update_policies
+ *   Events=http://policies.example.com/events
+ *   Username=someuser
+ *   Password=password
+ *   Precedence=10
+ *   Interval=60
+ *
+ *   [local]
+ *   Directory=/etc/pold/policies.d
+ *   Precedence=20
+ *
+ * A directory source reads the "*.policy" files of the directory, each with
+ * one policy.
+ *
+ * A source is only fetched again once its policies are older than its
+ * Interval in seconds.
+ *
+ * If a source has an Events url and changes are watched, the source is
+ * fetched whenever the Server-Sent-Events stream at that url brings a
+ * "policies" event, see pold_http_client_watch().
+ */
+struct policy_source {
+	char *name;
+
+	/* Either of them is set */
+	char *url;
+	char *directory;
+
+	char *username;
+	char *password;
+
+	/*
+	 * Of several policies with the same id, the one of the source with
+	 * the highest precedence is taken, among equal ones the one of the
+	 * source which comes first in the sources file
+	 */
+	int precedence;
+
+	/*
+	 * The policies of the last successful fetch as JSON array, NULL before
+	 * the first one. A failed fetch keeps the previous policies.
+	 */
+	json_t *policies;
+
+	/*
+	 * Monotonic time of the last successful fetch, 0 if the policies
+	 * are due to be fetched again regardless of their age
+	 */
+	gint64 refreshed;
+
+	/* Seconds after which the policies are due to be fetched again */
+	int interval;
+
+	/*
+	 * Set while a fetch of the source is on its way. Further updates
+	 * leave the source alone meanwhile, so that a burst of them makes one
+	 * attempt, which counts as one failure at most.
+	 */
+	bool fetching;
+
+	/* The number of fetches that failed since the last successful one */
+	unsigned int failures;
+
+	/*
+	 * The circuit breaker. While it is open, the source is not fetched
+	 * and its last known policies stand in. Once retry_at passed, one
+	 * fetch is let through half-open, which closes the breaker if it
+	 * succeeds and opens it again otherwise.
+	 */
+	enum pold_breaker_state breaker;
+
+	/* Monotonic time from which on an open breaker lets a fetch through */
+	gint64 retry_at;
+
+	/* The jittered backoff in milliseconds of the last failure */
+	unsigned int backoff;
+
+	/* The number of times the breaker changed its state */
+	guint64 transitions;
+
+	char *events_url;
+
+	/* The request of the event stream while it is connected */
+	SoupMessage *events;
+
+	/* Received text of the stream which does not make a whole event yet */
+	GString *events_buffer;
 
-struct soup_session_queue_message_cb_data {
-	void (*cb)(const char *policies_json, void *data);
+	guint reconnect_timer;
+
+	/* The number of connections to the stream that failed in a row */
+	unsigned int events_failures;
+
+	/* Set once the response turned out to be an event stream */
+	bool events_accepted;
+
+	/* Set if changes may have been missed while disconnected */
+	bool events_lost;
+
+	/* Monotonic time of the last update to catch up on missed changes */
+	gint64 caught_up;
+};
+
+/*
+ * An update of the policies from all sources. The sources are fetched
+ * concurrently, and whenever one of them brings new policies the merged
+ * policies are handed out, so that slow sources do not hold back the
+ * others.
+ */
+struct update_round {
+	void (*cb)(const char *policies_json, bool done, void *data);
 	void *data;
+
+	/* The number of sources whose fetch did not finish yet */
+	unsigned int pending;
+
+	bool succeeded;
+	bool delivered;
+};
+
+struct fetch_data {
+	struct update_round *round;
+	struct policy_source *source;
+
+	/*
+	 * Monotonic time in microseconds at which the request was queued
+	 */
+	gint64 started;
+
+	/*
+	 * The decoded response as it comes in, so that the compressed one
+	 * need not be kept
+	 */
+	GString *body;
+
+	/* The number of bytes received before decoding */
+	gsize received;
+
+	/* Set if the response could not be decoded */
+	bool broken;
+
+#if (HAVE_ZSTD > 0)
+	ZSTD_DStream *zstd;
+#endif
 };
 
 static SoupSession *soup_session;
 
-static char *user, *pwd;
+/*
+ * Called when a source announces changed policies, set while watching
+ */
+static void (*changed_cb)(void *data);
+static void *changed_data;
+
+/*
+ * The sources ordered by precedence, highest first
+ */
+static GSList *sources;
+
+/*
+ * The merged policies handed out last
+ */
+static char *merged_json;
 
 static void authenticate_callback(SoupSession *sess, SoupMessage *msg,
 		SoupAuth *auth, gboolean retrying, gpointer user_data)
 {
-	soup_auth_authenticate(auth, user, pwd);
+	struct policy_source *source;
+
+	source = g_object_get_data(G_OBJECT(msg), "pold-source");
+	if (source && source->username)
+		soup_auth_authenticate(auth, source->username,
+				source->password);
+}
+
+static void free_source(gpointer pointer)
+{
+	struct policy_source *source = pointer;
+
+	g_free(source->name);
+	g_free(source->url);
+	g_free(source->directory);
+	g_free(source->username);
+	g_free(source->password);
+	g_free(source->events_url);
+	json_decref(source->policies);
+	if (source->events_buffer)
+		g_string_free(source->events_buffer, TRUE);
+	g_free(source);
+}
+
+static gint compare_precedence(gconstpointer a, gconstpointer b)
+{
+	const struct policy_source *source_a = a, *source_b = b;
+
+	return source_b->precedence - source_a->precedence;
+}
+
+static bool is_valid_url(const char *url)
+{
+	SoupMessage *msg;
+
+	msg = soup_message_new("GET", url);
+	if (!msg)
+		return false;
+
+	g_object_unref(msg);
+	return true;
+}
+
+static struct policy_source *load_source(GKeyFile *keyfile,
+		const char *group)
+{
+	struct policy_source *source;
+
+	source = g_new0(struct policy_source, 1);
+	source->name = g_strdup(group);
+	source->url = g_key_file_get_string(keyfile, group, "Url", NULL);
+	source->directory = g_key_file_get_string(keyfile, group,
+			"Directory", NULL);
+	source->username = g_key_file_get_string(keyfile, group, "Username",
+			NULL);
+	source->password = g_key_file_get_string(keyfile, group, "Password",
+			NULL);
+	source->events_url = g_key_file_get_string(keyfile, group, "Events",
+			NULL);
+	source->precedence = g_key_file_get_integer(keyfile, group,
+			"Precedence", NULL);
+	source->interval = DEFAULT_INTERVAL_IN_SECONDS;
+	if (g_key_file_has_key(keyfile, group, "Interval", NULL))
+		source->interval = g_key_file_get_integer(keyfile, group,
+				"Interval", NULL);
+
+	if (!source->url == !source->directory) {
+		pold_log_error("Source %s needs either a Url or a Directory",
+				group);
+		goto err;
+	}
+
+	if (source->url && !is_valid_url(source->url)) {
+		pold_log_error("Url %s of source %s is invalid", source->url,
+				group);
+		goto err;
+	}
+
+	if (source->interval < 0) {
+		pold_log_error("Interval of source %s is negative", group);
+		goto err;
+	}
+
+	if (source->events_url && (!source->url ||
+			!is_valid_url(source->events_url))) {
+		pold_log_error("Events url of source %s is invalid or lacks a "
+				"Url", group);
+		goto err;
+	}
+
+	return source;
+
+err:
+	free_source(source);
+	return NULL;
+}
+
+static bool load_sources(const char *filename)
+{
+	struct policy_source *source;
+	GError *error = NULL;
+	GKeyFile *keyfile;
+	char **groups;
+	bool ok = true;
+	int i;
+
+	keyfile = g_key_file_new();
+
+	if (!g_key_file_load_from_file(keyfile, filename, G_KEY_FILE_NONE,
+			&error)) {
+		pold_log_error("Failed to load sources file %s: %s", filename,
+				error->message);
+		g_error_free(error);
+		g_key_file_free(keyfile);
+		return false;
+	}
+
+	groups = g_key_file_get_groups(keyfile, NULL);
+	for (i = 0; groups[i] && ok; i++) {
+		source = load_source(keyfile, groups[i]);
+		if (source)
+			sources = g_slist_append(sources, source);
+		else
+			ok = false;
+	}
+	g_strfreev(groups);
+	g_key_file_free(keyfile);
+
+	if (ok && !sources) {
+		pold_log_error("Sources file %s has no sources", filename);
+		ok = false;
+	}
+
+	/* The sort is stable, so the file order breaks ties */
+	sources = g_slist_sort(sources, compare_precedence);
+
+	return ok;
 }
 
-bool pold_http_client_init(const char *username, const char *password)
+bool pold_http_client_init(const char *sources_file, const char *username,
+		const char *password)
 {
-	user = g_strdup(username);
-	pwd = g_strdup(password);
+	struct policy_source *source;
+
+	if (!sources_file && g_file_test(SOURCES_FILE, G_FILE_TEST_EXISTS))
+		sources_file = SOURCES_FILE;
 
-	soup_session = soup_session_new();
+	if (sources_file) {
+		if (!load_sources(sources_file))
+			return false;
+	} else {
+		source = g_new0(struct policy_source, 1);
+		source->name = g_strdup("default");
+		source->url = g_strdup(UPDATE_URL);
+		source->interval = DEFAULT_INTERVAL_IN_SECONDS;
+		source->events_url = g_strdup(EVENTS_URL);
+		source->username = g_strdup(username);
+		source->password = g_strdup(password);
+		sources = g_slist_append(sources, source);
+	}
+
+	soup_session = soup_session_new_with_options(
+			SOUP_SESSION_MAX_CONNS_PER_HOST, MAX_CONNS_PER_HOST,
+			SOUP_SESSION_IDLE_TIMEOUT, IDLE_TIMEOUT_IN_SECONDS,
+			NULL);
 	if (!soup_session)
 		return false;
 
+	/* Decodes gzip and deflate responses chunk by chunk */
+	soup_session_add_feature_by_type(soup_session,
+			SOUP_TYPE_CONTENT_DECODER);
+
 	if (g_signal_connect(soup_session, "authenticate",
 			G_CALLBACK(authenticate_callback), NULL) < 1)
 		return false;
 
+	pold_http_client_prewarm();
+
 	return true;
 }
 
 void pold_http_client_final(void)
 {
-	g_free(pwd);
-	g_free(user);
+	pold_http_client_unwatch();
+
+	g_slist_free_full(sources, free_source);
+	sources = NULL;
+	g_free(merged_json);
+	merged_json = NULL;
+}
+
+/*
+ * Merges the policies of all sources into one JSON array. Of several
+ * policies with the same id, the one of the source with the highest
+ * precedence is taken.
+ */
+static char *merge_sources(void)
+{
+	struct policy_source *source;
+	json_t *merged, *policy, *id;
+	GHashTable *ids;
+	GSList *list;
+	unsigned int i;
+	char *json;
+
+	merged = json_array();
+	ids = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (list = sources; list; list = list->next) {
+		source = list->data;
+		if (!source->policies)
+			continue;
+
+		for (i = 0; i < json_array_size(source->policies); i++) {
+			policy = json_array_get(source->policies, i);
+			id = json_object_get(policy, "Id");
+
+			if (!json_is_string(id)) {
+				pold_log_error("Policy without id from "
+						"source %s", source->name);
+				continue;
+			}
+
+			if (g_hash_table_contains(ids, json_string_value(id)))
+				continue;
+
+			g_hash_table_add(ids, (gpointer) json_string_value(id));
+			json_array_append(merged, policy);
+		}
+	}
+
+	json = json_dumps(merged, 0);
+
+	g_hash_table_destroy(ids);
+	json_decref(merged);
+
+	return json;
+}
+
+/*
+ * Hands the merged policies out if they changed, or if the round is done
+ * and did not hand any out yet
+ */
+static void deliver_policies(struct update_round *round, bool succeeded)
+{
+	char *merged = NULL;
+	bool done;
+
+	round->pending--;
+	done = round->pending == 0;
+
+	if (succeeded)
+		round->succeeded = true;
+
+	if (round->succeeded && (succeeded || done)) {
+		merged = merge_sources();
+
+		if (g_strcmp0(merged, merged_json) == 0 &&
+				(!done || round->delivered)) {
+			g_free(merged);
+			merged = NULL;
+		}
+	}
+
+	if (merged) {
+		g_free(merged_json);
+		merged_json = merged;
+		round->delivered = true;
+	}
+
+	if (merged || done)
+		round->cb(merged, done, round->data);
+
+	if (done)
+		g_free(round);
+}
+
+static unsigned int count_open_breakers(void)
+{
+	struct policy_source *source;
+	unsigned int count = 0;
+	GSList *list;
+
+	for (list = sources; list; list = list->next) {
+		source = list->data;
+		if (source->breaker == POLD_BREAKER_OPEN)
+			count++;
+	}
+
+	return count;
+}
+
+static void set_breaker(struct policy_source *source,
+		enum pold_breaker_state state)
+{
+	if (source->breaker == state)
+		return;
+
+	pold_log_info("Circuit breaker of source %s changes from %s to %s",
+			source->name, pold_breaker_state_name(source->breaker),
+			pold_breaker_state_name(state));
+
+	if (state == POLD_BREAKER_OPEN)
+		pold_stats_inc(POLD_STATS_BREAKERS_OPENED);
+	else if (state == POLD_BREAKER_CLOSED)
+		pold_stats_inc(POLD_STATS_BREAKERS_CLOSED);
+
+	source->breaker = state;
+	source->transitions++;
+
+	pold_stats_set(POLD_STATS_OPEN_BREAKERS, count_open_breakers());
 }
 
 /*
- * Joins a list of strings to a null-terminated string
+ * Returns the jittered backoff in milliseconds after the given number of
+ * failures in a row
  */
-static char *join_list(GSList *string_list)
+static unsigned int get_backoff(unsigned int failures)
 {
-	GSList *list = string_list;
-	char *ret, *buf;
-	int size = 1;
+	unsigned int backoff = BACKOFF_MIN_IN_MILLISECONDS;
+
+	while (--failures > 0 && backoff < BACKOFF_MAX_IN_MILLISECONDS)
+		backoff *= 2;
+
+	backoff = MIN(backoff, BACKOFF_MAX_IN_MILLISECONDS);
 
-	if (!string_list)
-		return NULL;
+	return g_random_int_range(backoff / 2, backoff + 1);
+}
+
+/*
+ * Tells whether the policies of the source are too old at the given
+ * monotonic time
+ */
+static bool is_due(struct policy_source *source, gint64 now)
+{
+	return !source->refreshed ||
+			now - source->refreshed >=
+			(gint64) source->interval * G_USEC_PER_SEC;
+}
 
-	for (list = string_list; list; list = list->next) {
-		size += strlen(list->data);
+/*
+ * Tells whether the source may be fetched at the given monotonic time, and
+ * lets the breaker go half-open if its backoff ran out
+ */
+static bool may_fetch(struct policy_source *source, gint64 now)
+{
+	switch (source->breaker) {
+	case POLD_BREAKER_CLOSED:
+		return true;
+	case POLD_BREAKER_OPEN:
+		if (now < source->retry_at)
+			return false;
+
+		set_breaker(source, POLD_BREAKER_HALF_OPEN);
+		return true;
+	case POLD_BREAKER_HALF_OPEN:
+		/* The trial fetch is still on its way */
+		return false;
 	}
 
-	ret = g_new(char, size);
-	buf = ret;
+	return false;
+}
 
-	for (list = string_list; list; list = list->next) {
-		buf = g_stpcpy(buf, list->data);
+static void record_fetch(struct policy_source *source, bool succeeded,
+		gint64 now)
+{
+	if (succeeded) {
+		source->failures = 0;
+		source->backoff = 0;
+		set_breaker(source, POLD_BREAKER_CLOSED);
+		return;
 	}
 
-	return ret;
+	source->failures++;
+	source->backoff = get_backoff(source->failures);
+	source->retry_at = now + (gint64) source->backoff * 1000;
+	set_breaker(source, POLD_BREAKER_OPEN);
+
+	pold_log_info("Source %s is retried in %u ms", source->name,
+			source->backoff);
 }
 
 /*
- * Converts a soup buffer to a null terminated string.
+ * Takes over the policies of a fetch, NULL if it failed
  */
-static char *soup_buffer_to_string(SoupBuffer *buf)
+static void finish_fetch(struct fetch_data *fetch, json_t *policies)
 {
-	char *ret = g_new(char, buf->length + 1);
+	struct policy_source *source = fetch->source;
+	gint64 now = g_get_monotonic_time();
+
+	source->fetching = false;
+
+	if (json_is_array(policies)) {
+		json_decref(source->policies);
+		source->policies = policies;
+		source->refreshed = now;
+	} else {
+		pold_log_error("Failed to update policies from source %s",
+				source->name);
+		json_decref(policies);
+	}
 
-	ret[buf->length] = 0;
-	g_memmove(ret, buf->data, buf->length);
+	record_fetch(source, json_is_array(policies), now);
 
-	return ret;
+	deliver_policies(fetch->round, json_is_array(policies));
+	g_free(fetch);
+}
+
+static gboolean read_directory(gpointer user_data)
+{
+	struct fetch_data *fetch = user_data;
+	const char *directory = fetch->source->directory;
+	json_t *policies, *policy;
+	const char *name;
+	char *full_path;
+	GDir *dir;
+
+	pold_stats_inc(POLD_STATS_REFRESHES);
+
+	dir = g_dir_open(directory, 0, NULL);
+	if (!dir) {
+		pold_log_error("Failed to open directory %s", directory);
+		pold_stats_inc(POLD_STATS_REFRESHES_FAILED);
+		finish_fetch(fetch, NULL);
+		return FALSE;
+	}
+
+	policies = json_array();
+
+	while ((name = g_dir_read_name(dir))) {
+		if (!g_str_has_suffix(name, POLICY_FILE_SUFFIX))
+			continue;
+
+		full_path = g_strdup_printf("%s/%s", directory, name);
+		policy = json_load_file(full_path, 0, NULL);
+
+		if (json_is_object(policy))
+			json_array_append(policies, policy);
+		else
+			pold_log_error("Failed to load policy file %s",
+					full_path);
+
+		json_decref(policy);
+		g_free(full_path);
+	}
+
+	g_dir_close(dir);
+
+	finish_fetch(fetch, policies);
+
+	return FALSE;
+}
+
+#if (HAVE_ZSTD > 0)
+static bool decode_zstd(struct fetch_data *fetch, const char *data,
+		gsize length)
+{
+	ZSTD_inBuffer in = { data, length, 0 };
+	ZSTD_outBuffer out;
+	char buf[16 * 1024];
+	size_t ret;
+
+	do {
+		out.dst = buf;
+		out.size = sizeof(buf);
+		out.pos = 0;
+
+		ret = ZSTD_decompressStream(fetch->zstd, &out, &in);
+		if (ZSTD_isError(ret)) {
+			pold_log_error("Failed to decode policies from "
+					"source %s: %s", fetch->source->name,
+					ZSTD_getErrorName(ret));
+			return false;
+		}
+
+		g_string_append_len(fetch->body, buf, out.pos);
+
+		/* A small chunk may decode to a lot */
+		if (fetch->body->len > MAX_POLICIES_SIZE)
+			return true;
+	} while (in.pos < in.size || out.pos == out.size);
+
+	return true;
+}
+#endif
+
+static void got_fetch_headers(SoupMessage *msg, gpointer user_data)
+{
+	struct fetch_data *fetch = user_data;
+	const char *encoding;
+
+	if (msg->status_code != SOUP_STATUS_OK)
+		return;
+
+	encoding = soup_message_headers_get_one(msg->response_headers,
+			"Content-Encoding");
+	if (!encoding || g_ascii_strcasecmp(encoding, "identity") == 0)
+		return;
+
+	/* Decoded by libsoup before the chunks get to us */
+	if (g_ascii_strcasecmp(encoding, "gzip") == 0 ||
+			g_ascii_strcasecmp(encoding, "x-gzip") == 0 ||
+			g_ascii_strcasecmp(encoding, "deflate") == 0)
+		return;
+
+#if (HAVE_ZSTD > 0)
+	if (g_ascii_strcasecmp(encoding, "zstd") == 0) {
+		fetch->zstd = ZSTD_createDStream();
+		if (fetch->zstd)
+			ZSTD_initDStream(fetch->zstd);
+		else
+			fetch->broken = true;
+		return;
+	}
+#endif
+
+	pold_log_error("Policies of source %s have unknown encoding %s",
+			fetch->source->name, encoding);
+	fetch->broken = true;
+}
+
+/*
+ * Decodes each chunk as it arrives, the encoded chunk is dropped right
+ * after
+ */
+static void got_fetch_chunk(SoupMessage *msg, SoupBuffer *chunk,
+		gpointer user_data)
+{
+	struct fetch_data *fetch = user_data;
+
+	if (msg->status_code != SOUP_STATUS_OK || fetch->broken)
+		return;
+
+	fetch->received += chunk->length;
+
+#if (HAVE_ZSTD > 0)
+	if (fetch->zstd) {
+		if (!decode_zstd(fetch, chunk->data, chunk->length))
+			fetch->broken = true;
+	} else
+#endif
+		g_string_append_len(fetch->body, chunk->data, chunk->length);
+
+	if (fetch->body->len > MAX_POLICIES_SIZE) {
+		pold_log_error("Policies of source %s are too large",
+				fetch->source->name);
+		fetch->broken = true;
+	}
 }
 
 static void soup_session_queue_message_cb(SoupSession *sess, SoupMessage *msg,
 		void *user_data)
 {
-	SoupBuffer *buf;
-	int offset = 0;
-	char *response = NULL;
-	GSList *chunks = NULL;
-	struct soup_session_queue_message_cb_data *cb_data = user_data;
+	struct fetch_data *fetch = user_data;
+	json_t *policies = NULL;
 
 	pold_log_info("update_callback");
 
-	if (msg->status_code == SOUP_STATUS_OK) {
-		while ((buf = soup_message_body_get_chunk(msg->response_body,
-				offset))) {
-			chunks = g_slist_append(chunks,
-					soup_buffer_to_string(buf));
-			offset += buf->length;
-		}
-		response = join_list(chunks);
-		g_slist_free_full(chunks, g_free);
+	pold_stats_inc(POLD_STATS_REFRESHES);
+	pold_stats_add(POLD_STATS_REFRESH_DURATION,
+			g_get_monotonic_time() - fetch->started);
+
+	if (msg->status_code == SOUP_STATUS_OK && !fetch->broken) {
+		pold_stats_add(POLD_STATS_REFRESH_BYTES, fetch->body->len);
+		pold_stats_add(POLD_STATS_REFRESH_WIRE_BYTES, fetch->received);
 
-		pold_log_debug("Policies received from server:\n%s", response);
+		pold_log_debug("Policies received from source %s:\n%s",
+				fetch->source->name, fetch->body->str);
+
+		policies = json_loadb(fetch->body->str, fetch->body->len, 0,
+				NULL);
 	} else {
 		pold_log_error("Failed to update policies");
-		goto out;
+		pold_stats_inc(POLD_STATS_REFRESHES_FAILED);
 	}
 
-out:
-	cb_data->cb(response, cb_data->data);
-	g_free(response);
-	g_free(cb_data);
+	pold_trace(POLD_TRACE_REFRESH_FINISHED, msg->status_code,
+			fetch->body->len, NULL);
+	POLD_PROBE3(refresh__done, msg->status_code, fetch->body->len,
+			g_get_monotonic_time() - fetch->started);
+
+#if (HAVE_ZSTD > 0)
+	if (fetch->zstd)
+		ZSTD_freeDStream(fetch->zstd);
+#endif
+	g_string_free(fetch->body, TRUE);
+
+	finish_fetch(fetch, policies);
 }
 
-void pold_http_client_update_policies(void (*cb)
-		(const char *policies_json, void *data), void *data)
+static void fetch_url(struct fetch_data *fetch)
 {
 	SoupMessage *msg;
-	struct soup_session_queue_message_cb_data *cb_data;
 
-	msg = soup_message_new("GET", UPDATE_URL);
+	msg = soup_message_new("GET", fetch->source->url);
+	g_object_set_data(G_OBJECT(msg), "pold-source", fetch->source);
+	soup_message_headers_append(msg->request_headers, "Accept-Encoding",
+			ACCEPT_ENCODING);
+
+	fetch->body = g_string_new(NULL);
+	soup_message_body_set_accumulate(msg->response_body, FALSE);
+	g_signal_connect(msg, "got-headers", G_CALLBACK(got_fetch_headers),
+			fetch);
+	g_signal_connect(msg, "got-chunk", G_CALLBACK(got_fetch_chunk),
+			fetch);
+
+	soup_session_queue_message(soup_session, msg,
+			soup_session_queue_message_cb, fetch);
+}
+
+void pold_http_client_update_policies(void (*cb)(const char *policies_json,
+		bool done, void *data), void *data)
+{
+	struct update_round *round;
+	struct fetch_data *fetch;
+	GSList *list, *due = NULL;
+	gint64 now = g_get_monotonic_time();
+
+	for (list = sources; list; list = list->next) {
+		if (!is_due(list->data, now) ||
+				((struct policy_source *) list->data)->fetching)
+			continue;
+
+		if (may_fetch(list->data, now))
+			due = g_slist_prepend(due, list->data);
+		else
+			pold_stats_inc(POLD_STATS_REFRESHES_SKIPPED);
+	}
+
+	if (!due) {
+		pold_log_debug("No source is due to be fetched");
+		cb(NULL, true, data);
+		return;
+	}
+
+	round = g_new0(struct update_round, 1);
+	round->cb = cb;
+	round->data = data;
+	round->pending = g_slist_length(due);
+
+	pold_trace(POLD_TRACE_REFRESH_STARTED, 0, 0, NULL);
+
+	due = g_slist_reverse(due);
+
+	for (list = due; list; list = list->next) {
+		fetch = g_new0(struct fetch_data, 1);
+		fetch->round = round;
+		fetch->source = list->data;
+		fetch->started = now;
+		fetch->source->fetching = true;
+
+		if (fetch->source->url)
+			fetch_url(fetch);
+		else
+			g_idle_add(read_directory, fetch);
+	}
+
+	g_slist_free(due);
+}
+
+bool pold_http_client_due(void)
+{
+	gint64 now = g_get_monotonic_time();
+	GSList *list;
+
+	for (list = sources; list; list = list->next) {
+		if (is_due(list->data, now))
+			return true;
+	}
+
+	return false;
+}
+
+bool pold_http_client_available(void)
+{
+	struct policy_source *source;
+	gint64 now = g_get_monotonic_time();
+	GSList *list;
+
+	for (list = sources; list; list = list->next) {
+		source = list->data;
+
+		if (!is_due(source, now) || source->fetching)
+			continue;
+
+		if (source->breaker == POLD_BREAKER_CLOSED ||
+				(source->breaker == POLD_BREAKER_OPEN &&
+				now >= source->retry_at))
+			return true;
+	}
+
+	return false;
+}
+
+void pold_http_client_expire(void)
+{
+	GSList *list;
+
+	for (list = sources; list; list = list->next)
+		((struct policy_source *) list->data)->refreshed = 0;
+}
+
+void pold_http_client_foreach_source(void (*func)(
+		const struct pold_source_status *status, void *data),
+		void *data)
+{
+	struct pold_source_status status;
+	struct policy_source *source;
+	gint64 now = g_get_monotonic_time();
+	gint64 real_now = g_get_real_time();
+	GSList *list;
+
+	for (list = sources; list; list = list->next) {
+		source = list->data;
+
+		status.name = source->name;
+		status.interval = source->interval;
+		status.refreshed = 0;
+		if (source->refreshed)
+			status.refreshed = (real_now - (now -
+					source->refreshed)) / G_USEC_PER_SEC;
+		status.breaker = source->breaker;
+		status.failures = source->failures;
+		status.backoff = source->backoff;
+		status.transitions = source->transitions;
+
+		func(&status, data);
+	}
+}
+
+const char *pold_breaker_state_name(enum pold_breaker_state state)
+{
+	switch (state) {
+	case POLD_BREAKER_CLOSED:
+		return "closed";
+	case POLD_BREAKER_OPEN:
+		return "open";
+	case POLD_BREAKER_HALF_OPEN:
+		return "half-open";
+	}
+
+	return "unknown";
+}
+
+static bool is_change_event(const char *event)
+{
+	const char *type = "message";
+	char **lines;
+	bool changed;
+	int i;
+
+	lines = g_strsplit(event, "\n", -1);
+
+	for (i = 0; lines[i]; i++) {
+		if (!g_str_has_prefix(lines[i], "event:"))
+			continue;
+
+		type = lines[i] + strlen("event:");
+		if (*type == ' ')
+			type++;
+	}
+
+	changed = g_strcmp0(type, CHANGE_EVENT) == 0;
+
+	g_strfreev(lines);
+
+	return changed;
+}
+
+/*
+ * Appends text received from an event stream to the buffer and returns the
+ * number of events it completed, keep-alive comments included. The number
+ * of change events among them is stored in changes. Whole events are
+ * removed from the buffer, the rest stays until more text comes in.
+ */
+static unsigned int parse_events(GString *buffer, const char *text,
+		gsize length, unsigned int *changes)
+{
+	unsigned int events = 0;
+	char *end, *event;
+	gsize i;
+
+	/* Lines may end in "\r\n" as well */
+	for (i = 0; i < length; i++) {
+		if (text[i] != '\r')
+			g_string_append_c(buffer, text[i]);
+	}
+
+	while ((end = strstr(buffer->str, "\n\n"))) {
+		event = g_strndup(buffer->str, end - buffer->str);
+		g_string_erase(buffer, 0, end - buffer->str + 2);
+
+		if (is_change_event(event))
+			(*changes)++;
 
-	cb_data = g_new0(struct soup_session_queue_message_cb_data, 1);
-	cb_data->cb = cb;
-	cb_data->data = data;
+		events++;
+		g_free(event);
+	}
+
+	return events;
+}
+
+static void got_events_headers(SoupMessage *msg, gpointer user_data)
+{
+	struct policy_source *source = user_data;
+	const char *type;
+
+	if (msg->status_code != SOUP_STATUS_OK)
+		return;
+
+	type = soup_message_headers_get_content_type(msg->response_headers,
+			NULL);
+	if (g_strcmp0(type, EVENT_STREAM_TYPE) != 0) {
+		pold_log_error("Events url of source %s answers with %s "
+				"instead of an event stream", source->name,
+				type ? type : "no content type");
+		soup_session_cancel_message(soup_session, msg,
+				SOUP_STATUS_CANCELLED);
+		return;
+	}
+
+	pold_log_info("Listening to the events of source %s", source->name);
+
+	source->events_accepted = true;
+}
+
+/*
+ * The first event or keep-alive of a stream shows that it works
+ */
+static void events_established(struct policy_source *source)
+{
+	gint64 now = g_get_monotonic_time();
+
+	source->events_failures = 0;
+
+	/* The server is back, so the breaker need not wait any longer */
+	if (source->breaker == POLD_BREAKER_OPEN)
+		source->retry_at = MIN(source->retry_at, now);
+
+	if (!source->events_lost)
+		return;
+
+	source->events_lost = false;
+
+	if (source->caught_up && now - source->caught_up <
+			CATCH_UP_INTERVAL_IN_SECONDS * G_USEC_PER_SEC) {
+		pold_log_debug("Source %s caught up recently, not again",
+				source->name);
+		return;
+	}
+
+	source->caught_up = now;
+	changed_cb(changed_data);
+}
+
+static void got_events_chunk(SoupMessage *msg, SoupBuffer *chunk,
+		gpointer user_data)
+{
+	struct policy_source *source = user_data;
+	unsigned int events, changes = 0;
+
+	if (msg->status_code != SOUP_STATUS_OK || !source->events_accepted)
+		return;
+
+	events = parse_events(source->events_buffer, chunk->data,
+			chunk->length, &changes);
+
+	if (events && source->events_failures)
+		events_established(source);
+
+	if (source->events_buffer->len > MAX_EVENT_SIZE) {
+		pold_log_error("Event of source %s too large, dropped",
+				source->name);
+		g_string_truncate(source->events_buffer, 0);
+	}
+
+	if (!changes)
+		return;
+
+	pold_log_debug("Source %s announced changed policies", source->name);
+	pold_stats_inc(POLD_STATS_CHANGE_EVENTS);
+
+	source->refreshed = 0;
+
+	/* Several changes in one go need only one update */
+	changed_cb(changed_data);
+}
+
+static void connect_events(struct policy_source *source);
+
+static gboolean reconnect_events(gpointer user_data)
+{
+	struct policy_source *source = user_data;
+
+	source->reconnect_timer = 0;
+	connect_events(source);
+
+	return FALSE;
+}
+
+static void events_finished(SoupSession *sess, SoupMessage *msg,
+		void *user_data)
+{
+	struct policy_source *source = user_data;
+	unsigned int backoff;
+
+	source->events = NULL;
+	source->events_accepted = false;
+
+	if (!changed_cb)
+		return;
+
+	source->events_lost = true;
+	source->events_failures++;
+	backoff = get_backoff(source->events_failures);
+
+	pold_log_info("Event stream of source %s ended with status %u, "
+			"reconnecting in %u ms", source->name,
+			msg->status_code, backoff);
+
+	source->reconnect_timer = g_timeout_add(backoff, reconnect_events,
+			source);
+}
+
+static void connect_events(struct policy_source *source)
+{
+	SoupMessage *msg;
+
+	msg = soup_message_new("GET", source->events_url);
+	g_object_set_data(G_OBJECT(msg), "pold-source", source);
+	soup_message_headers_append(msg->request_headers, "Accept",
+			"text/event-stream");
+
+	/* The stream never ends, so its chunks are handled as they come */
+	soup_message_body_set_accumulate(msg->response_body, FALSE);
+	g_signal_connect(msg, "got-headers", G_CALLBACK(got_events_headers),
+			source);
+	g_signal_connect(msg, "got-chunk", G_CALLBACK(got_events_chunk),
+			source);
+
+	g_string_truncate(source->events_buffer, 0);
+	source->events = msg;
+
+	soup_session_queue_message(soup_session, msg, events_finished, source);
+}
+
+void pold_http_client_watch(void (*cb)(void *data), void *data)
+{
+	struct policy_source *source;
+	GSList *list;
+
+	changed_cb = cb;
+	changed_data = data;
+
+	for (list = sources; list; list = list->next) {
+		source = list->data;
+		if (!source->events_url)
+			continue;
+
+		if (!source->events_buffer)
+			source->events_buffer = g_string_new(NULL);
+
+		connect_events(source);
+	}
+}
+
+void pold_http_client_unwatch(void)
+{
+	struct policy_source *source;
+	GSList *list;
+
+	if (!changed_cb)
+		return;
+
+	/* Keeps the cancelled streams from reconnecting */
+	changed_cb = NULL;
+	changed_data = NULL;
+
+	for (list = sources; list; list = list->next) {
+		source = list->data;
+
+		if (source->reconnect_timer) {
+			g_source_remove(source->reconnect_timer);
+			source->reconnect_timer = 0;
+		}
+
+		if (source->events)
+			soup_session_cancel_message(soup_session,
+					source->events, SOUP_STATUS_CANCELLED);
+	}
+}
+
+static void prewarm_cb(SoupSession *sess, SoupMessage *msg, void *user_data)
+{
+	struct policy_source *source = user_data;
+
+	pold_log_debug("Connection to source %s prewarmed with status %u",
+			source->name, msg->status_code);
+}
+
+void pold_http_client_prewarm(void)
+{
+	struct policy_source *source;
+	SoupMessage *msg;
+	GSList *list;
+
+	for (list = sources; list; list = list->next) {
+		source = list->data;
+
+		/* No point in connecting to a source which is down */
+		if (!source->url || source->breaker != POLD_BREAKER_CLOSED)
+			continue;
+
+		/*
+		 * The connection of the HEAD request stays open for the
+		 * next refresh, with its TLS session and authentication
+		 */
+		msg = soup_message_new("HEAD", source->url);
+		g_object_set_data(G_OBJECT(msg), "pold-source", source);
+
+		soup_session_queue_message(soup_session, msg, prewarm_cb,
+				source);
+	}
+}
+
+/*
+ * Failures before a network change say little about the new network, so
+ * the backoffs end early
+ */
+static void cut_backoffs(gint64 now)
+{
+	struct policy_source *source;
+	GSList *list;
+
+	for (list = sources; list; list = list->next) {
+		source = list->data;
+
+		if (source->breaker == POLD_BREAKER_OPEN)
+			source->retry_at = MIN(source->retry_at, now);
+
+		if (source->reconnect_timer) {
+			g_source_remove(source->reconnect_timer);
+			source->reconnect_timer = 0;
+			connect_events(source);
+		}
+	}
+}
+
+void pold_http_client_network_changed(void)
+{
+	pold_log_debug("Network changed, reconnecting to the sources");
 
-	soup_session_queue_message(soup_session, msg, soup_session_queue_message_cb,
-			cb_data);
+	cut_backoffs(g_get_monotonic_time());
+	pold_http_client_prewarm();
 }
@@ -25,11 +25,101 @@
 #include <glib.h>
 #include <stdbool.h>
 
-bool pold_http_client_init(const char *username, const char *password);
+enum pold_breaker_state {
+	POLD_BREAKER_CLOSED,
+	POLD_BREAKER_OPEN,
+	POLD_BREAKER_HALF_OPEN,
+};
+
+struct pold_source_status {
+	const char *name;
+	enum pold_breaker_state breaker;
+
+	/* The number of fetches that failed since the last successful one */
+	unsigned int failures;
+
+	/* The backoff in milliseconds after the last failure */
+	unsigned int backoff;
+
+	/* The number of times the breaker changed its state */
+	guint64 transitions;
+
+	/* Seconds after which the policies are due to be fetched again */
+	int interval;
+
+	/* Wall clock time in seconds of the last successful fetch, or 0 */
+	guint64 refreshed;
+};
+
+/*
+ * Reads the policy sources from the sources file, by default SYSCONFDIR
+ * "/pold/sources.conf". Without a sources file the policies come from the
+ * local policy server, with the given credentials.
+ */
+bool pold_http_client_init(const char *sources_file, const char *username,
+		const char *password);
 
 void pold_http_client_final(void);
 
-void pold_http_client_update_policies(void (*cb)
-		(const char *policies_json, void *data), void *data);
+/*
+ * Fetches the policies from all sources. Each time a source brings new
+ * policies, cb gets the policies of all sources merged as JSON array. Once
+ * all sources are done, cb is called with done set. The policies of that
+ * call are NULL if they were handed out before or if all sources failed.
+ *
+ * Only sources whose policies are older than their interval are fetched,
+ * and only if no fetch of them is on its way already. Sources whose circuit
+ * breaker is open are not fetched either, their last known policies stand
+ * in. If no source is fetched, cb is called with done
+ * set before the function returns.
+ */
+void pold_http_client_update_policies(void (*cb)(const char *policies_json,
+		bool done, void *data), void *data);
+
+/*
+ * Returns true if the policies of at least one source are older than its
+ * interval
+ */
+bool pold_http_client_due(void);
+
+/*
+ * Returns true if an update would fetch at least one source, false if no
+ * source is due, or all due sources are being fetched already or their
+ * breakers are open
+ */
+bool pold_http_client_available(void);
+
+/*
+ * Makes the policies of all sources due, so that the next update fetches
+ * all of them
+ */
+void pold_http_client_expire(void);
+
+void pold_http_client_foreach_source(void (*func)(
+		const struct pold_source_status *status, void *data),
+		void *data);
+
+const char *pold_breaker_state_name(enum pold_breaker_state state);
+
+/*
+ * Listens to the event streams of the sources and calls cb whenever one of
+ * them announces changed policies, or might have done so while it was
+ * disconnected. Broken streams are reconnected with a backoff.
+ */
+void pold_http_client_watch(void (*cb)(void *data), void *data);
+
+void pold_http_client_unwatch(void);
+
+/*
+ * Opens a connection to each source which is up, to be reused by the next
+ * update
+ */
+void pold_http_client_prewarm(void);
+
+/*
+ * To be called when the network came up or changed its bearer. Retries the
+ * sources without waiting for their backoffs and prewarms the connections.
+ */
+void pold_http_client_network_changed(void);
 
 #endif
@@ -22,6 +22,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <glib.h>
 #include "log.h"
 
 #if (HAVE_SYSTEMD_JOURNAL > 0)
@@ -30,14 +31,95 @@
 #include <syslog.h>
 #endif
 
+/*
+ * Messages are handed from the logging threads to a dedicated writer thread
+ * through a bounded lock-free ring (a multi-producer queue as described by
+ * Dmitry Vyukov). A producer reserves a slot first and only formats the
+ * message once it got one, so a full ring costs no formatting at all, the
+ * message is just counted as dropped. Writing to the journal, syslog or the
+ * terminal happens in the writer thread only.
+ */
+#define RING_SIZE 1024
+#define RING_MASK (RING_SIZE - 1)
+
+/*
+ * Messages which do not fit into a slot are formatted on the heap
+ */
+#define SLOT_MESSAGE_SIZE 256
+
+/*
+ * Upper bound for the time a message waits in the ring if the wakeup of
+ * the writer thread raced with it going to sleep
+ */
+#define WRITER_SLEEP_IN_MICROSECONDS 100000
+
+struct slot {
+	/*
+	 * Equals the position of the slot in the ring if the slot is free
+	 * for the producer at that position, and position + 1 if it holds a
+	 * message for the writer.
+	 */
+	gint sequence;
+	int priority;
+	char *long_message;
+	char message[SLOT_MESSAGE_SIZE];
+};
+
 /*
  * If false, the log appears in the systemd/syslog journal, otherwise it is
  * written to the terminal.
  */
 static bool log_on_console;
-static bool log_debug;
 
-static void log_x(int priority, const char *args, va_list args2)
+unsigned int pold_log_debug_mask;
+
+static const char *category_names[POLD_LOG_CATEGORIES] = {
+	[POLD_LOG_MAIN] = "main",
+	[POLD_LOG_POLICY] = "policy",
+	[POLD_LOG_MANAGER] = "manager",
+	[POLD_LOG_HTTP] = "http",
+	[POLD_LOG_DBUS] = "dbus",
+	[POLD_LOG_CONNMAN] = "connman",
+};
+
+static struct slot ring[RING_SIZE];
+static gint enqueue_pos;
+static guint dequeue_pos;
+
+/*
+ * Number of messages dropped since the writer last reported it
+ */
+static gint dropped;
+
+/*
+ * Once closed, messages are written synchronously. Producers counts the
+ * threads which may still be filling a slot, the ring is only drained for
+ * the last time when it dropped to zero.
+ */
+static gint closed;
+static gint producers;
+
+static GThread *writer;
+static gint writer_running;
+static gint writer_sleeping;
+static GMutex writer_mutex;
+static GCond writer_cond;
+
+static void write_message(int priority, const char *message)
+{
+	if (log_on_console) {
+		printf("%s\n", message);
+		fflush(stdout);
+	} else {
+#if (HAVE_SYSTEMD_JOURNAL > 0)
+		sd_journal_print(priority, "%s", message);
+#else
+		syslog(priority, "%s", message);
+#endif
+	}
+}
+
+static void log_sync(int priority, const char *args, va_list args2)
 {
 	if (log_on_console) {
 		vprintf(args, args2);
@@ -51,12 +133,157 @@ static void log_x(int priority, const char *args, va_list args2)
 	}
 }
 
-void pold_log_debug_no_prefix(const char *args, ...)
+static struct slot *reserve_slot(void)
 {
-	va_list args2;
+	struct slot *slot;
+	guint pos;
+	gint diff;
 
-	if (!log_debug)
+	pos = g_atomic_int_get(&enqueue_pos);
+
+	for (;;) {
+		slot = &ring[pos & RING_MASK];
+		diff = (gint) ((guint) g_atomic_int_get(&slot->sequence) - pos);
+
+		if (diff == 0) {
+			if (g_atomic_int_compare_and_exchange(&enqueue_pos,
+					pos, pos + 1))
+				return slot;
+		} else if (diff < 0) {
+			/* The writer did not yet consume this slot */
+			return NULL;
+		}
+
+		pos = g_atomic_int_get(&enqueue_pos);
+	}
+}
+
+static void log_x(int priority, const char *args, va_list args2)
+{
+	struct slot *slot;
+	va_list copy;
+	guint pos;
+	int length;
+
+	g_atomic_int_inc(&producers);
+
+	if (!g_atomic_int_get(&writer_running) ||
+			g_atomic_int_get(&closed)) {
+		g_atomic_int_add(&producers, -1);
+		log_sync(priority, args, args2);
+		return;
+	}
+
+	slot = reserve_slot();
+	if (!slot) {
+		g_atomic_int_inc(&dropped);
+		g_atomic_int_add(&producers, -1);
 		return;
+	}
+
+	/* The sequence of a reserved slot still equals its position */
+	pos = g_atomic_int_get(&slot->sequence);
+
+	slot->priority = priority;
+	slot->long_message = NULL;
+
+	va_copy(copy, args2);
+	length = vsnprintf(slot->message, SLOT_MESSAGE_SIZE, args, copy);
+	va_end(copy);
+
+	if (length >= SLOT_MESSAGE_SIZE)
+		slot->long_message = g_strdup_vprintf(args, args2);
+
+	g_atomic_int_set(&slot->sequence, pos + 1);
+
+	if (g_atomic_int_get(&writer_sleeping)) {
+		g_mutex_lock(&writer_mutex);
+		g_cond_signal(&writer_cond);
+		g_mutex_unlock(&writer_mutex);
+	}
+
+	g_atomic_int_add(&producers, -1);
+}
+
+/*
+ * Tells whether the next slot holds a message for the writer
+ */
+static bool message_ready(void)
+{
+	struct slot *slot = &ring[dequeue_pos & RING_MASK];
+
+	return (guint) g_atomic_int_get(&slot->sequence) == dequeue_pos + 1;
+}
+
+/*
+ * Writes all messages in the ring. Returns false if there were none.
+ */
+static bool drain_ring(void)
+{
+	struct slot *slot;
+	bool drained = false;
+	char *report;
+	gint lost;
+
+	while (message_ready()) {
+		slot = &ring[dequeue_pos & RING_MASK];
+
+		write_message(slot->priority, slot->long_message ?
+				slot->long_message : slot->message);
+		g_free(slot->long_message);
+		slot->long_message = NULL;
+
+		g_atomic_int_set(&slot->sequence, dequeue_pos + RING_SIZE);
+		dequeue_pos++;
+		drained = true;
+	}
+
+	lost = g_atomic_int_get(&dropped);
+	if (lost > 0) {
+		g_atomic_int_add(&dropped, -lost);
+		report = g_strdup_printf("%d log messages dropped", lost);
+		write_message(LOG_WARNING, report);
+		g_free(report);
+	}
+
+	return drained;
+}
+
+static gpointer writer_thread(gpointer data)
+{
+	gint64 end_time;
+
+	while (g_atomic_int_get(&writer_running)) {
+		if (drain_ring())
+			continue;
+
+		/*
+		 * Writing may block, so it never happens under the mutex,
+		 * producers only take it to wake the writer up
+		 */
+		g_mutex_lock(&writer_mutex);
+		g_atomic_int_set(&writer_sleeping, 1);
+
+		/* A message might have arrived before the flag was set */
+		if (!message_ready() && g_atomic_int_get(&writer_running)) {
+			end_time = g_get_monotonic_time() +
+					WRITER_SLEEP_IN_MICROSECONDS;
+			g_cond_wait_until(&writer_cond, &writer_mutex,
+					end_time);
+		}
+
+		g_atomic_int_set(&writer_sleeping, 0);
+		g_mutex_unlock(&writer_mutex);
+	}
+
+	drain_ring();
+
+	return NULL;
+}
+
+void pold_log_debug_no_prefix(const char *args, ...)
+{
+	va_list args2;
 
 	va_start(args2, args);
 	log_x(LOG_DEBUG, args, args2);
@@ -84,5 +311,108 @@ void pold_log_error(const char *args, ...)
 void pold_log_set_debug(bool debug)
 {
 	log_on_console = debug;
-	log_debug = debug;
+	pold_log_debug_mask = debug ? POLD_LOG_ALL_CATEGORIES : 0;
+}
+
+bool pold_log_set_debug_categories(const char *categories)
+{
+	char **names;
+	unsigned int mask = 0;
+	unsigned int i, j;
+	bool found = true;
+
+	names = g_strsplit(categories, ",", -1);
+
+	for (i = 0; found && names[i]; i++) {
+		g_strstrip(names[i]);
+
+		if (names[i][0] == '\0')
+			continue;
+
+		if (g_strcmp0(names[i], "all") == 0) {
+			mask = POLD_LOG_ALL_CATEGORIES;
+			continue;
+		}
+
+		found = false;
+		for (j = 0; j < POLD_LOG_CATEGORIES; j++) {
+			if (g_strcmp0(names[i], category_names[j]) == 0) {
+				mask |= 1U << j;
+				found = true;
+				break;
+			}
+		}
+	}
+
+	g_strfreev(names);
+
+	if (!found)
+		return false;
+
+	pold_log_debug_mask = mask;
+
+	return true;
+}
+
+char *pold_log_get_debug_categories(void)
+{
+	GString *categories;
+	unsigned int i;
+
+	categories = g_string_new(NULL);
+
+	for (i = 0; i < POLD_LOG_CATEGORIES; i++) {
+		if (!(pold_log_debug_mask & (1U << i)))
+			continue;
+
+		if (categories->len > 0)
+			g_string_append_c(categories, ',');
+		g_string_append(categories, category_names[i]);
+	}
+
+	return g_string_free(categories, FALSE);
+}
+
+void pold_log_init(void)
+{
+	unsigned int i;
+
+	if (writer)
+		return;
+
+	for (i = 0; i < RING_SIZE; i++)
+		ring[i].sequence = i;
+
+	enqueue_pos = 0;
+	dequeue_pos = 0;
+	closed = 0;
+
+	g_mutex_init(&writer_mutex);
+	g_cond_init(&writer_cond);
+
+	g_atomic_int_set(&writer_running, 1);
+	writer = g_thread_new("pold-log", writer_thread, NULL);
+}
+
+void pold_log_final(void)
+{
+	if (!writer)
+		return;
+
+	/* Let the producers which got a slot already finish their message */
+	g_atomic_int_set(&closed, 1);
+	while (g_atomic_int_get(&producers) > 0)
+		g_thread_yield();
+
+	g_mutex_lock(&writer_mutex);
+	g_atomic_int_set(&writer_running, 0);
+	g_cond_signal(&writer_cond);
+	g_mutex_unlock(&writer_mutex);
+
+	/* The writer thread flushes the ring before it terminates */
+	g_thread_join(writer);
+	writer = NULL;
+
+	g_cond_clear(&writer_cond);
+	g_mutex_clear(&writer_mutex);
 }
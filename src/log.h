@@ -24,9 +24,36 @@
 
 #include <stdbool.h>
 
+/*
+ * Every source file using pold_log_debug() defines POLD_LOG_CATEGORY to the
+ * subsystem it belongs to. Debug messages are only formatted if their
+ * category is enabled.
+ */
+enum pold_log_category {
+	POLD_LOG_MAIN,
+	POLD_LOG_POLICY,
+	POLD_LOG_MANAGER,
+	POLD_LOG_HTTP,
+	POLD_LOG_DBUS,
+	POLD_LOG_CONNMAN,
+	POLD_LOG_CATEGORIES
+};
+
+#define POLD_LOG_ALL_CATEGORIES ((1U << POLD_LOG_CATEGORIES) - 1)
+
+extern unsigned int pold_log_debug_mask;
+
+#ifdef DISABLE_DEBUG_LOG
+#define pold_log_debug_enabled(category) false
+#else
+#define pold_log_debug_enabled(category) \
+	__builtin_expect(!!(pold_log_debug_mask & (1U << (category))), 0)
+#endif
+
 #define pold_log_debug(fmt, arg...) do { \
-	pold_log_debug_no_prefix("%s:%s() " fmt, \
-			__FILE__, __FUNCTION__, ## arg); \
+	if (pold_log_debug_enabled(POLD_LOG_CATEGORY)) \
+		pold_log_debug_no_prefix("%s:%s() " fmt, \
+				__FILE__, __FUNCTION__, ## arg); \
 } while (0)
 
 void pold_log_debug_no_prefix(const char *args, ...);
@@ -37,4 +64,28 @@ void pold_log_error(const char *args, ...);
 
 void pold_log_set_debug(bool debug);
 
+/*
+ * Enables debug messages of the comma separated categories and disables all
+ * others. "all" enables every category. Returns false and leaves the enabled
+ * categories untouched if a category is unknown.
+ */
+bool pold_log_set_debug_categories(const char *categories);
+
+/*
+ * Returns the enabled categories in the format accepted by
+ * pold_log_set_debug_categories(). The string has to be freed by the caller.
+ */
+char *pold_log_get_debug_categories(void);
+
+/*
+ * Starts the writer thread. Until then, and after pold_log_final(),
+ * messages are written synchronously by the logging thread.
+ */
+void pold_log_init(void);
+
+/*
+ * Writes all pending messages and stops the writer thread.
+ */
+void pold_log_final(void);
+
 #endif
@@ -28,13 +28,18 @@
 #include <gdbus.h>
 #include "log.h"
 #include "dbus-common.h"
+#include "fdo-dbus.h"
 #include "policy.h"
+#include "credentials.h"
 #include "pold-manager.h"
 #include "connman-manager.h"
 #include "connman-notification.h"
 #include "session.h"
 #include "dbus.h"
 #include "http-client.h"
+#include "trace.h"
+
+#define POLD_LOG_CATEGORY POLD_LOG_MAIN
 
 #define USERNAME "someuser"
 #define PASSWORD "password"
@@ -45,10 +50,50 @@ DBusConnection *conn;
 
 static bool debug;
 
+static char *debug_categories;
+
+static int agent_updates = 4;
+
+static int workers;
+
+static bool prefetch;
+
+static char *prefetch_filter;
+
+static bool merge_policies;
+
+static char *sources_file;
+
+static bool watch_events;
+
 static GOptionEntry entries[] =
 {
 	{ "debug", 'd', 0, G_OPTION_ARG_NONE, &debug,
 		"Send output to the terminal", NULL },
+	{ "debug-categories", 'D', 0, G_OPTION_ARG_STRING, &debug_categories,
+		"Enable debug messages of the comma separated categories "
+		"(main, policy, manager, http, dbus, connman or all)",
+		"CATEGORIES" },
+	{ "agent-updates", 'u', 0, G_OPTION_ARG_INT, &agent_updates,
+		"Maximum number of unanswered updates per agent", "N" },
+	{ "workers", 'w', 0, G_OPTION_ARG_INT, &workers,
+		"Number of threads resolving policies "
+		"(default: number of processors)", "N" },
+	{ "prefetch", 'p', 0, G_OPTION_ARG_NONE, &prefetch,
+		"Retrieve the credentials of new bus connections before they "
+		"ask for a policy", NULL },
+	{ "prefetch-filter", 0, 0, G_OPTION_ARG_STRING, &prefetch_filter,
+		"Only keep prefetched credentials whose policy id matches "
+		"the regular expression", "REGEX" },
+	{ "merge-policies", 'm', 0, G_OPTION_ARG_NONE, &merge_policies,
+		"Merge the group, user and selinux policies of an app instead "
+		"of applying only the most specific one", NULL },
+	{ "sources", 's', 0, G_OPTION_ARG_FILENAME, &sources_file,
+		"Read the policy sources from FILE "
+		"(default: " SYSCONFDIR "/pold/sources.conf)", "FILE" },
+	{ "events", 'e', 0, G_OPTION_ARG_NONE, &watch_events,
+		"Listen to the change events of the policy sources and "
+		"update the policies as soon as they change", NULL },
 	{ NULL }
 };
 
@@ -62,11 +107,25 @@ static gboolean signal_update(gpointer user_data)
 {
 	pold_log_debug("Received SIGUSR2 - policy update from server "
 			"triggered");
+	pold_http_client_expire();
 	pold_policy_update_from_server(NULL, NULL);
 	return TRUE;
 }
 
-static gint shandlers[4];
+static void policies_changed(void *user_data)
+{
+	pold_log_debug("Policy source announced changes - policy update "
+			"from server triggered");
+	pold_policy_update_from_server(NULL, NULL);
+}
+
+static gboolean signal_dump_trace(gpointer user_data)
+{
+	pold_trace_dump(POLD_TRACE_FILE);
+	return TRUE;
+}
+
+static gint shandlers[5];
 
 static void install_signal_handlers(void)
 {
@@ -74,6 +133,7 @@ static void install_signal_handlers(void)
 	shandlers[1] = g_unix_signal_add(SIGTERM, signal_quit, NULL);
 	shandlers[2] = g_unix_signal_add(SIGHUP, signal_quit, NULL);
 	shandlers[3] = g_unix_signal_add(SIGUSR2, signal_update, NULL);
+	shandlers[4] = g_unix_signal_add(SIGUSR1, signal_dump_trace, NULL);
 }
 
 static void remove_signal_handlers(void)
@@ -91,6 +151,9 @@ static bool init_dbus(void)
 		return true;
 	}
 
+	/* Replies are marshalled on worker threads */
+	dbus_threads_init_default();
+
 	conn = g_dbus_setup_bus(DBUS_BUS_SYSTEM, POLD_BUS_NAME, NULL);
 	if (!conn) {
 		pold_log_error(
@@ -114,8 +177,27 @@ static bool parse_options(int argc, char *argv[])
 		return false;
 	}
 
+	if (agent_updates < 1) {
+		printf("Number of agent updates must be positive\n");
+		return false;
+	}
+
+	if (workers < 0) {
+		printf("Number of workers must not be negative\n");
+		return false;
+	}
+
+	if (workers == 0)
+		workers = g_get_num_processors();
+
 	pold_log_set_debug(debug);
 
+	if (debug_categories &&
+			!pold_log_set_debug_categories(debug_categories)) {
+		printf("Unknown debug category in %s\n", debug_categories);
+		return false;
+	}
+
 	return true;
 }
 
@@ -128,6 +210,8 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	pold_log_init();
+
 	pold_log_info("Starting Policy Daemon");
 
 	if (!init_dbus()) {
@@ -135,7 +219,7 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
-	if (!pold_http_client_init(USERNAME, PASSWORD)) {
+	if (!pold_http_client_init(sources_file, USERNAME, PASSWORD)) {
 		ret = EXIT_FAILURE;
 		goto out_http_client;
 	}
@@ -143,16 +227,21 @@ int main(int argc, char *argv[])
 	loop = g_main_loop_new(NULL, FALSE);
 	install_signal_handlers();
 
-	if (pold_policy_init(conn) < 0) {
+	if (pold_policy_init(conn, merge_policies) < 0) {
 		ret = EXIT_FAILURE;
 		goto out_signal_handlers;
 	}
 
-	if (!pold_manager_init(conn)) {
+	if (!pold_credentials_init(conn, prefetch, prefetch_filter)) {
 		ret = EXIT_FAILURE;
 		goto out_policy;
 	}
 
+	if (!pold_manager_init(conn, agent_updates, workers)) {
+		ret = EXIT_FAILURE;
+		goto out_credentials;
+	}
+
 	if (!pold_connman_notification_init(conn)) {
 		ret = EXIT_FAILURE;
 		goto out_manager;
@@ -161,6 +250,9 @@ int main(int argc, char *argv[])
 	pold_connman_manager_init(conn);
 	pold_session_init(conn);
 
+	if (watch_events)
+		pold_http_client_watch(policies_changed, NULL);
+
 	pold_log_info("Entering main loop");
 
 	g_main_loop_run(loop);
@@ -171,6 +263,8 @@ int main(int argc, char *argv[])
 
 out_manager:
 	pold_manager_final();
+out_credentials:
+	pold_credentials_final();
 out_policy:
 	pold_policy_final();
 out_signal_handlers:
@@ -180,8 +274,10 @@ out_http_client:
 	pold_http_client_final();
 	dbus_bus_release_name(conn, POLD_BUS_NAME, NULL);
 	dbus_connection_unref(conn);
+	pold_fdo_dbus_final();
 out:
 	pold_log_info("Exiting Policy Daemon");
+	pold_log_final();
 
 	return ret;
 }
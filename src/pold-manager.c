@@ -24,11 +24,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <pwd.h>
-#include <grp.h>
 #include <dbus/dbus.h>
 #include <glib.h>
-#include <glib/gstdio.h>
 #include <gdbus.h>
 #include <jansson.h>
 #include "log.h"
@@ -36,24 +33,224 @@
 #include "fdo-dbus.h"
 #include "policy.h"
 #include "dbus.h"
+#include "dbus-json.h"
+#include "histogram.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "credentials.h"
+#include "atom.h"
+#include "pool.h"
+#include "http-client.h"
 #include "pold-manager.h"
 
-#define POLICY_TIMEOUT_IN_SECONDS 10
+#define POLD_LOG_CATEGORY POLD_LOG_MANAGER
+
+/*
+ * Timeout for a single Update call to an agent
+ */
+#define UPDATE_TIMEOUT_IN_MILLISECONDS 5000
+
+/*
+ * A failed Update call is retried up to UPDATE_MAX_RETRIES times. The delay
+ * before the n-th retry is UPDATE_RETRY_DELAY_IN_MILLISECONDS * 2^(n-1).
+ */
+#define UPDATE_MAX_RETRIES 5
+#define UPDATE_RETRY_DELAY_IN_MILLISECONDS 100
+
+/*
+ * Stats1.GetAll is answered from a snapshot which is at most this old
+ */
+#define STATS_SNAPSHOT_INTERVAL_IN_MICROSECONDS 500000
+
+/*
+ * Time after which a GetPolicyConfig request is answered with a timeout
+ * error at the latest. Every bus call made on behalf of the request only
+ * gets the time left until then.
+ */
+#define REQUEST_DEADLINE_IN_MILLISECONDS 5000
+
+/*
+ * Maximum time a request waits for a policy refresh, afterwards it goes on
+ * with the policies loaded so far
+ */
+#define REFRESH_WAIT_IN_MILLISECONDS 2000
 
 static DBusConnection *connection;
 
 static const char *pold_unique_bus;
 
 /*
- * Maps the unique D-Bus owner to the object path on which the owner should be
- * notified in case of policy updates.
+ * Maximum number of unanswered Update calls per agent
  */
-static GHashTable *object_paths;
+static unsigned int max_agent_updates;
+
+/*
+ * A registered agent together with its outbound update queue
+ */
+struct agent {
+	/*
+	 * The D-Bus unique bus name of the agent
+	 */
+	char *owner;
+
+	/*
+	 * The object path on which the agent should be notified in case
+	 * of policy updates
+	 */
+	char *object_path;
+
+	/*
+	 * Updates which wait for a free in-flight slot, oldest first
+	 */
+	GQueue queue;
+
+	/*
+	 * Maps the app owner to its update in the queue. A newer update for
+	 * the same app replaces the queued one instead of being queued as well.
+	 */
+	GHashTable *queued;
+
+	/*
+	 * Updates which have been sent but not answered yet, including
+	 * those waiting for a retry
+	 */
+	GSList *in_flight;
+
+	/*
+	 * The disconnect watch on the agent's owner
+	 */
+	guint watch;
+};
+
+/*
+ * A single Update call for an app of an agent
+ */
+struct agent_update {
+	struct agent *agent;
+
+	char *app_owner;
+
+	/*
+	 * The policy as JSON string, copied since the policy itself might be
+	 * freed by a policy reload before the update is sent
+	 */
+	char *policy_json;
+
+	unsigned int retries;
+
+	DBusPendingCall *call;
+
+	guint retry_timer;
+};
+
+/*
+ * A policy reload sends an update to every watched app at once
+ */
+static struct pold_pool update_pool = POLD_POOL_INIT(struct agent_update, 64);
+
+/*
+ * Maps the unique D-Bus owner to the registered agent
+ */
+static GHashTable *agents;
+
+/*
+ * The marshalled reply to Stats1.GetAll built from the last snapshot, and
+ * the time when the snapshot was taken
+ */
+static DBusMessage *stats_reply;
+static gint64 stats_reply_time;
+
+/*
+ * Points in time which a request passes in the get_policy_config callback
+ * chain. Refresh points are only set if a policy update from the server
+ * was necessary.
+ */
+enum request_point {
+	REQUEST_RECEIVED,
+	REQUEST_REFRESH_STARTED,
+	REQUEST_REFRESH_DONE,
+	REQUEST_CREDENTIALS_STARTED,
+	REQUEST_CREDENTIALS_DONE,
+	REQUEST_NSS_DONE,
+	REQUEST_RESOLVED,
+	REQUEST_MARSHALLED,
+	REQUEST_SENT,
+	REQUEST_POINTS
+};
+
+/*
+ * Stages of a request whose latency is tracked, each one lasting from one
+ * request point to another.
+ */
+enum request_stage {
+	STAGE_CREDENTIALS,
+	STAGE_NSS,
+	STAGE_REFRESH,
+	STAGE_RESOLUTION,
+	STAGE_MARSHALLING,
+	STAGE_SEND,
+	STAGE_TOTAL,
+	STAGES
+};
+
+static const struct {
+	const char *name;
+	enum request_point start;
+	enum request_point end;
+} stages[STAGES] = {
+	[STAGE_CREDENTIALS] = { "BusCredentials",
+		REQUEST_CREDENTIALS_STARTED, REQUEST_CREDENTIALS_DONE },
+	[STAGE_NSS] = { "NSS", REQUEST_CREDENTIALS_DONE, REQUEST_NSS_DONE },
+	[STAGE_REFRESH] = { "Refresh",
+		REQUEST_REFRESH_STARTED, REQUEST_REFRESH_DONE },
+	[STAGE_RESOLUTION] = { "Resolution",
+		REQUEST_NSS_DONE, REQUEST_RESOLVED },
+	[STAGE_MARSHALLING] = { "Marshalling",
+		REQUEST_RESOLVED, REQUEST_MARSHALLED },
+	[STAGE_SEND] = { "Send", REQUEST_MARSHALLED, REQUEST_SENT },
+	[STAGE_TOTAL] = { "Total", REQUEST_RECEIVED, REQUEST_SENT },
+};
+
+/*
+ * Latencies in microseconds of all requests answered so far, per stage
+ */
+static struct pold_histogram latencies[STAGES];
+
+static guint32 last_request_id;
+
+/*
+ * Resolves the policies of requests once their credentials are known
+ */
+static GThreadPool *workers;
+
+/*
+ * Requests which are resolved by a worker and wait for the main thread to
+ * send the reply
+ */
+static GAsyncQueue *finished_requests;
+
+/*
+ * Whether deliver_requests() is scheduled on the main loop
+ */
+static gint delivery_scheduled;
+
+/*
+ * Maps the app owner atom to the request which currently resolves the app's
+ * policy. Further requests about the same app join it instead of starting
+ * their own lookup.
+ */
+static GHashTable *lookups;
 
 /*
  * Data that is needed/filled in during the get_policy_config callback chain.
  */
 struct config_data {
+	/*
+	 * Identifies the request in the flight recorder
+	 */
+	guint32 id;
+
 	/*
 	 * The initial message to which a reply has to be prepared.
 	 */
@@ -61,18 +258,19 @@ struct config_data {
 
 	/*
 	 * The D-Bus unique bus name of the agent that corresponds to the app
-	 * whose configuration is sought.
+	 * whose configuration is sought. Like all strings of the request, it
+	 * is an atom.
 	 */
-	char *agent_owner;
+	const char *agent_owner;
 
 	/*
 	 * The D-Bus unique bus name of the app whose configuration is sought,
 	 * needed to retrieve the caller's selinux, user id and group id.
 	 */
-	char *app_owner;
+	const char *app_owner;
 
-	/* Needed to identify the policy configuration */
-	char *selinux;
+	/* Needed to identify the policy configuration, "selinux:type" */
+	const char *selinux;
 
 	/*
 	 * Needed to identify the policy configuration, in case no selinux
@@ -85,170 +283,438 @@ struct config_data {
 	 * nor user id are present
 	 */
 	gid_t gid;
+
+	/*
+	 * The policy ids of the app's user and group, "user:name" and
+	 * "group:name", NULL if the name could not be resolved
+	 */
+	const char *user;
+	const char *group;
+
+	/*
+	 * All groups of the app's user, consulted when neither of the ids
+	 * above has a policy
+	 */
+	struct pold_policy_groups *groups;
+
+	/*
+	 * The policies the request is resolved against
+	 */
+	struct pold_policy_generation *generation;
+
+	/*
+	 * The reply prepared by a worker thread and the policy it carries
+	 */
+	DBusMessage *reply;
+	struct pold_policy *policy;
+
+	/*
+	 * Requests about the same app which arrived while this one was being
+	 * resolved. They are answered together with it.
+	 */
+	GSList *followers;
+
+	/*
+	 * Monotonic time in microseconds by which the request has to be
+	 * answered
+	 */
+	gint64 deadline;
+
+	/*
+	 * Monotonic time in microseconds at which the request passed each
+	 * request point, 0 if it did not pass it
+	 */
+	gint64 timestamps[REQUEST_POINTS];
+};
+
+/*
+ * Requests are only allocated and freed on the main thread
+ */
+static struct pold_pool request_pool = POLD_POOL_INIT(struct config_data, 32);
+
+static void mark_request(struct config_data *data, enum request_point point)
+{
+	data->timestamps[point] = g_get_monotonic_time();
+}
+
+static void record_latencies(struct config_data *data)
+{
+	gint64 start, end;
+	unsigned int i;
+
+	for (i = 0; i < STAGES; i++) {
+		start = data->timestamps[stages[i].start];
+		end = data->timestamps[stages[i].end];
+
+		if (start && end >= start)
+			pold_histogram_add(&latencies[i], end - start);
+	}
+}
+
+/*
+ * A request waiting for a policy refresh. When the wait times out, the
+ * request is detached and the refresh completes without it.
+ */
+struct refresh_wait {
+	struct config_data *data;
+
+	guint timer;
 };
 
+/*
+ * The requests waiting for the refresh in progress. Requests coming in
+ * meanwhile wait for the same refresh instead of starting another one.
+ */
+static GSList *refresh_waits;
+static bool refreshing;
+
+/*
+ * Returns the milliseconds left until the deadline of the request, 0 if it
+ * passed
+ */
+static int remaining_time(struct config_data *data)
+{
+	gint64 remaining;
+
+	remaining = data->deadline - g_get_monotonic_time();
+	if (remaining <= 0)
+		return 0;
+
+	/* Round up, a timeout of 0 would mean no timeout at all */
+	return (remaining + 999) / 1000;
+}
+
 static void free_config_data(struct config_data *data)
 {
 	if (data->pending)
 		dbus_message_unref(data->pending);
-	g_free(data->agent_owner);
-	g_free(data->app_owner);
-	g_free(data->selinux);
-	g_free(data);
+	pold_atom_unref(data->agent_owner);
+	pold_atom_unref(data->app_owner);
+	pold_atom_unref(data->selinux);
+	pold_atom_unref(data->user);
+	pold_atom_unref(data->group);
+	pold_policy_groups_unref(data->groups);
+	pold_policy_generation_unref(data->generation);
+	if (data->reply)
+		dbus_message_unref(data->reply);
+	g_slist_free(data->followers);
+	pold_pool_free(&request_pool, data);
 }
 
-static const char *get_user(uid_t uid)
+/*
+ * Stops further requests from joining the request
+ */
+static void finish_lookup(struct config_data *data)
 {
-	struct passwd *pwd;
+	if (g_hash_table_lookup(lookups, data->app_owner) == data)
+		g_hash_table_remove(lookups, data->app_owner);
+}
 
-	pwd = getpwuid(uid);
-	if (!pwd) {
-		pold_log_error("getpwuid failed with error code %d", errno);
-		return NULL;
+/*
+ * Answers the request and the requests which joined it with an error and
+ * frees them
+ */
+static void send_error(struct config_data *data, const char *name,
+		const char *text)
+{
+	DBusMessage *reply;
+	GSList *list;
+
+	finish_lookup(data);
+
+	for (list = data->followers; list; list = list->next)
+		send_error(list->data, name, text);
+
+	reply = g_dbus_create_error(data->pending, name, "%s", text);
+	if (reply)
+		g_dbus_send_message(connection, reply);
+	else
+		pold_log_debug("Could not create D-Bus error reply message");
+
+	free_config_data(data);
+}
+
+static void send_timeout(struct config_data *data)
+{
+	pold_log_info("Deadline of policy request for app %s passed",
+			data->app_owner);
+	send_error(data, DBUS_ERROR_TIMEOUT,
+			"Policy could not be resolved in time");
+}
+
+/*
+ * Appends the policy to a reply. A policy without id, i.e. the default
+ * policy, is sent with the given id instead. The shared policy itself is
+ * not modified, since other threads may read it at the same time.
+ */
+static void append_policy(DBusMessage *reply, struct pold_policy *policy,
+		const char *id)
+{
+	DBusMessageIter iter;
+	json_t *root;
+
+	root = json_loads(policy->json, 0, NULL);
+	if (!root) {
+		pold_policy_append_to_message(reply, policy);
+		return;
 	}
 
-	return pwd->pw_name;
+	json_object_set_new(root, "Id", json_string(id));
+
+	dbus_message_iter_init_append(reply, &iter);
+	pold_dbus_json_append_object(&iter, root);
+
+	json_decref(root);
 }
 
-static const char *get_group(gid_t gid)
+/*
+ * Returns the reply to a request with the policy. Policies without an id
+ * get the given id, all others are copied from their prepared reply.
+ */
+static DBusMessage *new_policy_reply(DBusMessage *pending,
+		struct pold_policy *policy, const char *id)
 {
-	struct group *group;
+	DBusMessage *reply;
 
-	group = getgrgid(gid);
-	if (!group) {
-		pold_log_error("getgrgid failed with error code %d", errno);
-		return NULL;
+	if (strlen(policy->id) > 0 || !id)
+		return pold_policy_new_reply(policy, pending);
+
+	reply = dbus_message_new_method_return(pending);
+	if (reply)
+		append_policy(reply, policy, id);
+
+	return reply;
+}
+
+/*
+ * Resolves and marshals the policy of a request against the generation
+ * referenced by the request
+ */
+static struct pold_policy *resolve_request(struct config_data *data)
+{
+	struct pold_policy *policy;
+
+	policy = pold_policy_generation_lookup(data->generation, data->groups,
+			3, data->selinux, data->user, data->group);
+
+	mark_request(data, REQUEST_RESOLVED);
+	pold_trace(POLD_TRACE_POLICY_CHOSEN, data->id, 0, policy->id);
+
+	data->reply = new_policy_reply(data->pending, policy, data->user);
+	data->policy = policy;
+
+	mark_request(data, REQUEST_MARSHALLED);
+
+	return policy;
+}
+
+static void schedule_delivery(struct config_data *data);
+
+/*
+ * Runs on a worker thread. Everything touched here is either owned by the
+ * request or immutable, the app bookkeeping is left to the main thread.
+ */
+static void process_request(gpointer task, gpointer user_data)
+{
+	struct config_data *data = task;
+	gid_t *gids;
+	unsigned int n_gids;
+
+	/* Prefetched credentials come with the names already resolved */
+	if (!data->user) {
+		data->user = pold_credentials_user(data->uid, &data->gid,
+				&gids, &n_gids);
+		if (data->user) {
+			data->group = pold_credentials_group(data->gid);
+			data->groups = pold_policy_groups_new(gids, n_gids);
+			g_free(gids);
+		}
 	}
 
-	return group->gr_name;
+	mark_request(data, REQUEST_NSS_DONE);
+
+	pold_log_debug("(selinux, user, group) = (%s, %s, %s)",
+			data->selinux, data->user, data->group);
+
+	resolve_request(data);
+
+	schedule_delivery(data);
+}
+
+/*
+ * Starts watching the app of a request for the given agent and returns its
+ * active policy. The policy the worker resolved is taken over, so that the
+ * main thread does not resolve it again.
+ */
+static struct pold_policy *watch_app(const char *agent_owner,
+		struct config_data *data)
+{
+	if (data->selinux)
+		return pold_policy_watch_resolved_app(agent_owner,
+				data->app_owner, data->groups,
+				data->generation, data->policy, 3,
+				data->selinux, data->user, data->group);
+
+	return pold_policy_watch_resolved_app(agent_owner, data->app_owner,
+			data->groups, data->generation, data->policy, 2,
+			data->user, data->group);
+}
+
+/*
+ * Sends the reply to a request and frees the request
+ */
+static void send_reply(struct config_data *data, DBusMessage *reply,
+		struct pold_policy *policy)
+{
+	pold_log_debug("Policy for app \"%s\" sent to agent \"%s\":\n%s",
+			data->app_owner, data->agent_owner, policy->json);
+
+	g_dbus_send_message(connection, reply);
+	pold_stats_inc(POLD_STATS_REQUESTS);
+
+	mark_request(data, REQUEST_SENT);
+	record_latencies(data);
+	pold_trace(POLD_TRACE_REPLY_SENT, data->id,
+			data->timestamps[REQUEST_SENT] -
+			data->timestamps[REQUEST_RECEIVED], data->agent_owner);
+	POLD_PROBE4(request__done, data->id, data->app_owner, policy->id,
+			data->timestamps[REQUEST_SENT] -
+			data->timestamps[REQUEST_RECEIVED]);
+
+	free_config_data(data);
 }
 
-static int get_groupid(uid_t uid)
+/*
+ * Answers a request which joined the given one with a copy of its reply
+ */
+static void deliver_follower(struct config_data *data,
+		struct config_data *follower, struct pold_policy *policy)
 {
-	struct passwd *pwd;
+	DBusMessage *reply;
+
+	watch_app(follower->agent_owner, data);
 
-	pwd = getpwuid(uid);
-	if (!pwd) {
-		pold_log_error("getpwuid failed with error code %d", errno);
-		return -1;
+	reply = dbus_message_copy(data->reply);
+	if (!reply) {
+		pold_log_debug("Could not copy D-Bus reply message");
+		send_error(follower, DBUS_ERROR_NO_MEMORY,
+				"Could not create reply");
+		return;
 	}
 
-	return pwd->pw_gid;
+	dbus_message_set_reply_serial(reply,
+			dbus_message_get_serial(follower->pending));
+	dbus_message_set_destination(reply, follower->agent_owner);
+
+	send_reply(follower, reply, policy);
 }
 
-static char *parse_selinux_type(const char *context)
+/*
+ * Runs on the main thread for every request a worker is done with
+ */
+static void deliver_request(struct config_data *data)
 {
-	char *ident, **tokens;
+	struct pold_policy *policy;
+	DBusMessage *reply;
+	GSList *list;
+
+	policy = watch_app(data->agent_owner, data);
 
 	/*
-	 * SELinux combines Role-Based Access Control (RBAC), Type
-	 * Enforcment (TE) and optionally Multi-Level Security (MLS).
-	 *
-	 * When SELinux is enabled all processes and files are labeled
-	 * with a contex that contains information such as user, role
-	 * type (and optionally a level). E.g.
-	 *
-	 * $ ls -Z
-	 * -rwxrwxr-x. wagi wagi unconfined_u:object_r:haifux_exec_t:s0 session_ui.py
-	 *
-	 * For identifyng application we (ab)using the type
-	 * information. In the above example the haifux_exec_t type
-	 * will be transfered to haifux_t as defined in the domain
-	 * transition and thus we are able to identify the application
-	 * as haifux_t.
+	 * The policies were reloaded or the context of their rules changed
+	 * while the worker was busy. The agent is only updated about changes
+	 * of the policy it got, so the reply has to be built from the current
+	 * policy instead.
 	 */
+	if (!pold_policy_generation_is_current(data->generation) ||
+			policy != data->policy) {
+		pold_log_debug("Policies changed while resolving the policy "
+				"of app %s", data->app_owner);
 
-	tokens = g_strsplit(context, ":", 0);
-	if (g_strv_length(tokens) < 2) {
-		g_strfreev(tokens);
-		return NULL;
+		if (data->reply)
+			dbus_message_unref(data->reply);
+
+		data->reply = new_policy_reply(data->pending, policy,
+				data->user);
+	}
+
+	if (!data->reply) {
+		pold_log_debug("Could not create D-Bus reply message");
+		send_error(data, DBUS_ERROR_NO_MEMORY,
+				"Could not create reply");
+		return;
 	}
 
-	/* Use the SELinux type as identification token. */
-	ident = g_strdup(tokens[2]);
+	finish_lookup(data);
+
+	for (list = data->followers; list; list = list->next)
+		deliver_follower(data, list->data, policy);
+
+	reply = data->reply;
+	data->reply = NULL;
+
+	send_reply(data, reply, policy);
+}
+
+static gboolean deliver_requests(gpointer user_data)
+{
+	struct config_data *data;
+
+	/*
+	 * Reset before draining, so that a request which is finished in the
+	 * meantime schedules another run
+	 */
+	g_atomic_int_set(&delivery_scheduled, 0);
+
+	while ((data = g_async_queue_try_pop(finished_requests)))
+		deliver_request(data);
+
+	return FALSE;
+}
 
-	g_strfreev(tokens);
+static void schedule_delivery(struct config_data *data)
+{
+	g_async_queue_push(finished_requests, data);
 
-	return ident;
+	if (g_atomic_int_compare_and_exchange(&delivery_scheduled, 0, 1))
+		g_idle_add(deliver_requests, NULL);
 }
 
 /*
- * Replaces the policy id by a given id if it is empty
+ * Hands a request with known credentials over to the workers
  */
-static void replace_id_if_empty(struct pold_policy *policy, const char *id)
+static void dispatch_request(struct config_data *data)
 {
-	json_t *json;
+	data->generation = pold_policy_generation_ref();
 
-	if (strlen(policy->id) == 0) {
-		g_free(policy->id);
-		policy->id = g_strdup(id);
-		json = json_string(policy->json);
-		json_object_set(json, "id", json_string(id));
-		g_free(policy->json);
-		policy->json = json_dumps(json, 0);
-	}
+	g_thread_pool_push(workers, data, NULL);
 }
 
 static void user_cb(unsigned int uid, void *user_data, int err)
 {
-	DBusMessage *reply;
 	struct config_data *data = user_data;
-	struct pold_policy *policy;
-	char *selinux = NULL, *user = NULL, *group = NULL;
-	char *app_id;
+
+	if (err == -ETIMEDOUT) {
+		send_timeout(data);
+		return;
+	}
 
 	if (err < 0) {
 		pold_log_debug("Retrieving user id failed with "
 				"error %d", err);
-		reply = g_dbus_create_error(data->pending,
-				DBUS_ERROR_FAILED, "Retrieving user id failed "
-				"with error %d", err);
-		if (!reply) {
-			pold_log_debug("Could not create D-Bus error reply "
-					"message");
-			goto out;
-		}
-		goto out_send_message;
+		send_error(data, DBUS_ERROR_FAILED,
+				"Retrieving user id failed");
+		return;
 	}
 
-	if (data->selinux)
-		selinux = g_strdup_printf("selinux:%s", data->selinux);
+	mark_request(data, REQUEST_CREDENTIALS_DONE);
+	pold_trace(POLD_TRACE_CREDENTIALS_RESOLVED, data->id, uid,
+			data->selinux);
+	POLD_PROBE3(credentials__resolved, data->id, uid, data->selinux);
 
 	data->uid = uid;
-	user = g_strdup_printf("user:%s", get_user(data->uid));
-
-	data->gid = get_groupid(uid);
-	group = g_strdup_printf("group:%s", get_group(data->gid));
-
-	pold_log_debug("(selinux, user, group) = (%s, %s, %s)",
-			data->selinux, user, group);
-
-	if (selinux)
-		pold_policy_watch_app(data->agent_owner, data->app_owner, 3,
-				selinux, user, group);
-	else
-		pold_policy_watch_app(data->agent_owner, data->app_owner, 2,
-				user, group);
-
-	app_id = g_strdup_printf("%s/%s", data->agent_owner, data->app_owner);
-	policy = pold_policy_get_active_policy(app_id);
-	g_free(app_id);
-
-	replace_id_if_empty(policy, user);
-
-	pold_log_debug("Policy for app \"%s\" sent to agent \"%s\":\n%s",
-			data->app_owner, data->agent_owner, policy->json);
-
-	reply = dbus_message_new_method_return(data->pending);
-	pold_policy_append_to_message(reply, policy);
 
-out_send_message:
-	g_dbus_send_message(connection, reply);
-out:
-	g_free(user);
-	g_free(group);
-	g_free(selinux);
-	free_config_data(data);
+	dispatch_request(data);
 }
 
 static void selinux_cb(const unsigned char *selinux, void *user_data,
@@ -260,61 +726,136 @@ static void selinux_cb(const unsigned char *selinux, void *user_data,
 		pold_log_debug("Retrieving selinux context failed with "
 				"error %d", err);
 	} else {
-		data->selinux = parse_selinux_type((const char *) selinux);
+		data->selinux = pold_credentials_parse_selinux(
+				(const char *) selinux);
+	}
+
+	if (remaining_time(data) == 0) {
+		send_timeout(data);
+		return;
 	}
 
-	pold_fdo_dbus_get_connection_unix_user(connection, data->app_owner,
-			user_cb, data);
+	if (pold_fdo_dbus_get_connection_unix_user(connection,
+			data->app_owner, user_cb, data,
+			remaining_time(data)) < 0)
+		send_error(data, DBUS_ERROR_FAILED,
+				"Retrieving user id failed");
 }
 
-static bool need_http_policy_update(void)
+/*
+ * Starts retrieving the credentials of the app, the SELinux context first
+ */
+static void request_credentials(struct config_data *data)
 {
-	int error;
-	GStatBuf stat_buf;
-	int current_time, modification_time, delta_time;
+	const struct pold_credentials *credentials;
+
+	mark_request(data, REQUEST_CREDENTIALS_STARTED);
+
+	credentials = pold_credentials_lookup(data->app_owner);
+	if (credentials) {
+		data->selinux = pold_atom_ref(credentials->selinux);
+		data->uid = credentials->uid;
+		data->gid = credentials->gid;
+		data->user = pold_atom_ref(credentials->user);
+		data->group = pold_atom_ref(credentials->group);
+		data->groups = pold_policy_groups_new(credentials->gids,
+				credentials->n_gids);
+
+		mark_request(data, REQUEST_CREDENTIALS_DONE);
+		pold_trace(POLD_TRACE_CREDENTIALS_RESOLVED, data->id,
+				data->uid, data->selinux);
+		POLD_PROBE3(credentials__resolved, data->id, data->uid,
+				data->selinux);
+
+		dispatch_request(data);
+		return;
+	}
 
-	error = g_stat(POLICYDIR, &stat_buf);
-	if (error) {
-		pold_log_error("The policy directory does not exist");
-		return false;
+	if (remaining_time(data) == 0) {
+		send_timeout(data);
+		return;
+	}
+
+	if (pold_fdo_dbus_get_connection_selinux_context(connection,
+			data->app_owner, selinux_cb, data,
+			remaining_time(data)) < 0)
+		send_error(data, DBUS_ERROR_FAILED,
+				"Retrieving SELinux context failed");
+}
+
+static void update_from_server_cb(int error, void *user_data)
+{
+	struct refresh_wait *wait = user_data;
+	struct config_data *data = wait->data;
+
+	/* The request stopped waiting and went on without the refresh */
+	if (!data) {
+		pold_log_debug("Policy update from server finished after "
+				"waiting requests timed out");
+		g_free(wait);
+		return;
 	}
 
-	current_time = time(NULL);
-	modification_time = stat_buf.st_mtime;
-	delta_time = current_time - modification_time;
+	g_source_remove(wait->timer);
+	g_free(wait);
+
+	mark_request(data, REQUEST_REFRESH_DONE);
+
+	/* The policies loaded last are still good to serve */
+	if (error)
+		pold_log_error("Policy update from server failed, going on "
+				"with the current policies");
+	else
+		pold_log_debug("Policy update from server successful");
+
+	request_credentials(data);
+}
+
+static void refresh_done(int error, void *user_data)
+{
+	GSList *waits = refresh_waits, *list;
+
+	refresh_waits = NULL;
+	refreshing = false;
+
+	for (list = waits; list; list = list->next)
+		update_from_server_cb(error, list->data);
 
-	return delta_time > POLICY_TIMEOUT_IN_SECONDS;
+	g_slist_free(waits);
 }
 
-static void update_from_server_cb(int error, void *user_data)
+static gboolean refresh_wait_timeout(gpointer user_data)
 {
-	struct config_data *data;
-	DBusMessage *reply;
+	struct refresh_wait *wait = user_data;
+	struct config_data *data = wait->data;
 
-	data = user_data;
+	pold_log_info("Policy update from server takes too long, going on "
+			"with the current policies");
 
-	if (error) {
-		pold_log_error("Policy update from server failed");
-		reply = g_dbus_create_error(data->pending,
-				DBUS_ERROR_FAILED, "Policy update "
-				"from server failed");
-		if (!reply) {
-			pold_log_debug("Could not create D-Bus error reply message");
-			goto error;
-		}
+	wait->data = NULL;
+	wait->timer = 0;
 
-		g_dbus_send_message(connection, reply);
-		goto error;
-	}
+	mark_request(data, REQUEST_REFRESH_DONE);
+	request_credentials(data);
 
-	pold_log_debug("Policy update from server successful");
+	return FALSE;
+}
 
-	pold_fdo_dbus_get_connection_selinux_context(connection, data->app_owner,
-			selinux_cb, data);
-	return;
+/*
+ * Lets the request wait for the refresh, but not beyond its deadline
+ */
+static void wait_for_refresh(struct config_data *data)
+{
+	struct refresh_wait *wait;
 
-error:
-	free_config_data(data);
+	mark_request(data, REQUEST_REFRESH_STARTED);
+
+	wait = g_new0(struct refresh_wait, 1);
+	wait->data = data;
+	wait->timer = g_timeout_add(MIN(REFRESH_WAIT_IN_MILLISECONDS,
+			remaining_time(data)), refresh_wait_timeout, wait);
+
+	refresh_waits = g_slist_append(refresh_waits, wait);
 }
 
 DBusMessage *pold_manager_get_policy_config(DBusConnection *dbus_connection,
@@ -323,17 +864,24 @@ DBusMessage *pold_manager_get_policy_config(DBusConnection *dbus_connection,
 	DBusMessage *reply;
 	DBusMessageIter args;
 	char *app_owner;
-	struct config_data *data;
+	struct config_data *data, *leader;
 	struct pold_policy *own_policy;
 
-	data = g_new0(struct config_data, 1);
+	data = pold_pool_alloc0(&request_pool);
+	mark_request(data, REQUEST_RECEIVED);
+	data->deadline = data->timestamps[REQUEST_RECEIVED] +
+			REQUEST_DEADLINE_IN_MILLISECONDS * 1000;
+	data->id = ++last_request_id;
 	data->pending = dbus_message_ref(message);
-	data->agent_owner = g_strdup(dbus_message_get_sender(message));
+	data->agent_owner = pold_atom_intern(dbus_message_get_sender(message));
 
 	dbus_message_iter_init(message, &args);
 	dbus_message_iter_get_basic(&args, &app_owner);
 
-	data->app_owner = g_strdup(app_owner);
+	data->app_owner = pold_atom_intern(app_owner);
+	pold_trace(POLD_TRACE_REQUEST_RECEIVED, data->id, 0, data->app_owner);
+	POLD_PROBE3(request__start, data->id, data->agent_owner,
+			data->app_owner);
 
 	pold_log_debug("Policy for app \"%s\" requested by agent \"%s\"",
 			data->app_owner, data->agent_owner);
@@ -350,6 +898,11 @@ DBusMessage *pold_manager_get_policy_config(DBusConnection *dbus_connection,
 		own_policy = pold_policy_get_own_policy();
 		pold_policy_append_to_message(reply, own_policy);
 		g_dbus_send_message(connection, reply);
+		pold_stats_inc(POLD_STATS_REQUESTS);
+		pold_trace(POLD_TRACE_REPLY_SENT, data->id,
+				g_get_monotonic_time() -
+				data->timestamps[REQUEST_RECEIVED],
+				data->agent_owner);
 
 		pold_log_debug("Policy for app \"%s\" (pold) sent to agent "
 				"\"%s\":\n%s", data->app_owner,
@@ -360,28 +913,235 @@ DBusMessage *pold_manager_get_policy_config(DBusConnection *dbus_connection,
 		return NULL;
 	}
 
+	leader = g_hash_table_lookup(lookups, data->app_owner);
+	if (leader) {
+		pold_log_debug("Joining pending lookup of app \"%s\"",
+				data->app_owner);
+		leader->followers = g_slist_append(leader->followers, data);
+		pold_stats_inc(POLD_STATS_COALESCED_REQUESTS);
+		return NULL;
+	}
+
+	g_hash_table_insert(lookups, (gpointer) data->app_owner, data);
+
 	pold_log_debug("Checking whether policies are up-to-date");
 
-	if (need_http_policy_update()) {
-		pold_log_debug("Policies are not up-to-date anymore - update"
-				"from server started...");
-		pold_policy_update_from_server(update_from_server_cb, data);
-	} else {
+	if (refreshing) {
+		pold_log_debug("Waiting for the update from server in "
+				"progress");
+		wait_for_refresh(data);
+	} else if (!pold_http_client_due()) {
 		pold_log_debug("Policies are still up-to-date, no update from "
 				"server needed");
-		pold_fdo_dbus_get_connection_selinux_context(connection,
-				app_owner, selinux_cb, data);
+		request_credentials(data);
+	} else if (!pold_http_client_available()) {
+		pold_log_debug("Policies are not up-to-date anymore, but all "
+				"sources back off - going on with the "
+				"current policies");
+		request_credentials(data);
+	} else {
+		pold_log_debug("Policies are not up-to-date anymore - update "
+				"from server started...");
+		wait_for_refresh(data);
+
+		refreshing = true;
+		pold_policy_update_from_server(refresh_done, NULL);
 	}
 
 	return NULL;
 }
 
+static void free_update(struct agent_update *update)
+{
+	if (update->call) {
+		dbus_pending_call_cancel(update->call);
+		dbus_pending_call_unref(update->call);
+	}
+
+	if (update->retry_timer)
+		g_source_remove(update->retry_timer);
+
+	g_free(update->app_owner);
+	g_free(update->policy_json);
+	pold_pool_free(&update_pool, update);
+}
+
+static void free_agent(void *pointer)
+{
+	struct agent *agent = pointer;
+	struct agent_update *update;
+
+	if (agent->watch)
+		g_dbus_remove_watch(connection, agent->watch);
+
+	while ((update = g_queue_pop_head(&agent->queue)))
+		free_update(update);
+
+	g_slist_free_full(agent->in_flight, (GDestroyNotify) free_update);
+	g_hash_table_destroy(agent->queued);
+	g_free(agent->owner);
+	g_free(agent->object_path);
+	g_free(agent);
+}
+
+static void send_updates(struct agent *agent);
+
+static void send_update(struct agent_update *update);
+
+static gboolean retry_update(gpointer user_data)
+{
+	struct agent_update *update = user_data;
+
+	update->retry_timer = 0;
+	send_update(update);
+
+	return FALSE;
+}
+
+/*
+ * Retries the update with exponential backoff unless the retries are used up
+ * or a newer update for the same app is already waiting in the queue.
+ */
+static bool schedule_retry(struct agent_update *update)
+{
+	struct agent *agent = update->agent;
+	unsigned int delay;
+
+	if (update->retries >= UPDATE_MAX_RETRIES)
+		return false;
+
+	if (g_hash_table_contains(agent->queued, update->app_owner))
+		return false;
+
+	delay = UPDATE_RETRY_DELAY_IN_MILLISECONDS << update->retries;
+	update->retries++;
+
+	pold_log_debug("Retrying update of app %s at agent %s in %u ms",
+			update->app_owner, agent->owner, delay);
+
+	update->retry_timer = g_timeout_add(delay, retry_update, update);
+
+	return true;
+}
+
+static void finish_update(struct agent_update *update)
+{
+	struct agent *agent = update->agent;
+
+	agent->in_flight = g_slist_remove(agent->in_flight, update);
+	free_update(update);
+
+	send_updates(agent);
+}
+
+static void update_reply(DBusPendingCall *call, void *user_data)
+{
+	struct agent_update *update = user_data;
+	DBusMessage *reply;
+	DBusError error;
+
+	reply = dbus_pending_call_steal_reply(call);
+	dbus_pending_call_unref(update->call);
+	update->call = NULL;
+
+	dbus_error_init(&error);
+
+	if (dbus_set_error_from_message(&error, reply)) {
+		pold_log_debug("Update of app %s at agent %s failed: %s",
+				update->app_owner, update->agent->owner,
+				error.message);
+		dbus_error_free(&error);
+
+		if (schedule_retry(update))
+			goto out;
+
+		pold_stats_inc(POLD_STATS_AGENT_UPDATES_FAILED);
+	} else {
+		pold_stats_inc(POLD_STATS_AGENT_UPDATES_SENT);
+	}
+
+	finish_update(update);
+
+out:
+	dbus_message_unref(reply);
+}
+
+static void send_update(struct agent_update *update)
+{
+	struct agent *agent = update->agent;
+	DBusMessage *msg;
+	DBusMessageIter msg_iter;
+
+	pold_log_debug("Update agent %s on object path %s...",
+			agent->owner, agent->object_path);
+
+	msg = dbus_message_new_method_call(agent->owner, agent->object_path,
+			POLD_AGENT_NOTIFICATION_INTERFACE, "Update");
+	if (!msg)
+		goto error;
+
+	dbus_message_iter_init_append(msg, &msg_iter);
+	dbus_message_iter_append_basic(&msg_iter, DBUS_TYPE_STRING,
+			&update->app_owner);
+	pold_dbus_json_append_string(&msg_iter, update->policy_json);
+
+	if (!g_dbus_send_message_with_reply(connection, msg, &update->call,
+			UPDATE_TIMEOUT_IN_MILLISECONDS) || !update->call) {
+		dbus_message_unref(msg);
+		goto error;
+	}
+
+	dbus_pending_call_set_notify(update->call, update_reply, update, NULL);
+	dbus_message_unref(msg);
+
+	pold_trace(POLD_TRACE_AGENT_UPDATE_SENT, 0, update->retries,
+			update->app_owner);
+
+	return;
+
+error:
+	pold_log_debug("Agent update failed with error %s",
+			strerror(ENOMEM));
+
+	if (schedule_retry(update))
+		return;
+
+	pold_stats_inc(POLD_STATS_AGENT_UPDATES_FAILED);
+	finish_update(update);
+}
+
+/*
+ * Sends queued updates until the agent's in-flight limit is reached
+ */
+static void send_updates(struct agent *agent)
+{
+	struct agent_update *update;
+
+	while (g_slist_length(agent->in_flight) < max_agent_updates) {
+		update = g_queue_pop_head(&agent->queue);
+		if (!update)
+			break;
+
+		g_hash_table_remove(agent->queued, update->app_owner);
+		agent->in_flight = g_slist_prepend(agent->in_flight, update);
+
+		send_update(update);
+	}
+}
+
 static void owner_disconnect(DBusConnection *dbus_connection, void *user_data)
 {
-	char *agent_owner = user_data;
+	struct agent *agent = user_data;
+	char *agent_owner;
 
-	g_hash_table_remove(object_paths, agent_owner);
+	/* The watch is removed by gdbus once this callback returns */
+	agent->watch = 0;
+
+	agent_owner = g_strdup(agent->owner);
+	g_hash_table_remove(agents, agent_owner);
+	pold_stats_set(POLD_STATS_AGENTS, g_hash_table_size(agents));
 	pold_remove_agent_apps(agent_owner);
+	g_free(agent_owner);
 }
 
 DBusMessage *pold_manager_register_agent(DBusConnection *dbus_connection,
@@ -390,6 +1150,7 @@ DBusMessage *pold_manager_register_agent(DBusConnection *dbus_connection,
 	DBusMessage *reply;
 	const char *agent_owner;
 	char *object_path;
+	struct agent *agent;
 
 	reply = dbus_message_new_method_return(message);
 	if (!reply) {
@@ -402,17 +1163,24 @@ DBusMessage *pold_manager_register_agent(DBusConnection *dbus_connection,
 	dbus_message_get_args(message, NULL, DBUS_TYPE_OBJECT_PATH,
 				&object_path);
 
-	if (g_hash_table_lookup(object_paths, agent_owner)) {
+	if (g_hash_table_lookup(agents, agent_owner)) {
 		pold_log_debug("Agent registration failed, since an "
 				"agent is already registered");
+		dbus_message_unref(reply);
 		return NULL;
 	}
 
-	g_hash_table_replace(object_paths, g_strdup(agent_owner),
-				g_strdup(object_path));
+	agent = g_new0(struct agent, 1);
+	agent->owner = g_strdup(agent_owner);
+	agent->object_path = g_strdup(object_path);
+	g_queue_init(&agent->queue);
+	agent->queued = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_hash_table_replace(agents, agent->owner, agent);
+	pold_stats_set(POLD_STATS_AGENTS, g_hash_table_size(agents));
 
-	g_dbus_add_disconnect_watch(dbus_connection, agent_owner,
-					owner_disconnect, (void *) agent_owner,
+	agent->watch = g_dbus_add_disconnect_watch(dbus_connection,
+					agent->owner, owner_disconnect, agent,
 					NULL);
 
 	pold_log_debug("Agent %s registered successfully on object "
@@ -425,23 +1193,25 @@ DBusMessage *pold_manager_unregister_agent(DBusConnection *dbus_connection,
 		DBusMessage *message, void *user_data)
 {
 	const char *agent_owner;
-	char *given_object_path, *stored_object_path;
+	char *given_object_path;
+	struct agent *agent;
 
 	agent_owner = dbus_message_get_sender(message);
 
 	dbus_message_get_args(message, NULL, DBUS_TYPE_OBJECT_PATH,
 				&given_object_path);
 
-	stored_object_path = g_hash_table_lookup(object_paths, agent_owner);
+	agent = g_hash_table_lookup(agents, agent_owner);
 
-	if (g_strcmp0(stored_object_path, given_object_path) != 0) {
+	if (!agent || g_strcmp0(agent->object_path, given_object_path) != 0) {
 		pold_log_info("Agent could not be unregistered");
 		return g_dbus_create_error(message, DBUS_ERROR_FAILED,
 					"Agent could "
 					"not be unregistered");
 	}
 
-	g_hash_table_remove(object_paths, agent_owner);
+	g_hash_table_remove(agents, agent_owner);
+	pold_stats_set(POLD_STATS_AGENTS, g_hash_table_size(agents));
 	pold_remove_agent_apps(agent_owner);
 
 	pold_log_debug("Agent %s unregistered successfully from "
@@ -450,45 +1220,352 @@ DBusMessage *pold_manager_unregister_agent(DBusConnection *dbus_connection,
 	return g_dbus_create_reply(message, DBUS_TYPE_INVALID);
 }
 
+/*
+ * Queues an Update call for an app at its agent. The call is sent as soon as
+ * the agent has less than max_agent_updates unanswered Update calls. A still
+ * queued update for the same app is replaced, since the agent is only
+ * interested in the most recent policy.
+ */
 int pold_manager_update_agent(DBusConnection *dbus_connection,
 		const char *agent_owner, const char *app_owner,
 		struct pold_policy *policy)
 {
-	DBusMessage *msg = NULL;
-	DBusMessageIter msg_iter;
-	char *object_path;
+	struct agent *agent;
+	struct agent_update *update;
 
-	pold_log_debug("Update agents...");
+	POLD_PROBE3(update__agent, agent_owner, app_owner, policy->id);
 
-	object_path = g_hash_table_lookup(object_paths, agent_owner);
+	/*
+	 * GetPolicyConfig does not require RegisterAgent, so apps of agents
+	 * which never registered are watched as well. There is no one to
+	 * update then.
+	 */
+	agent = g_hash_table_lookup(agents, agent_owner);
+	if (!agent) {
+		pold_log_debug("Agent %s is not registered, not updating it",
+				agent_owner);
+		return 0;
+	}
 
-	pold_log_debug("Update agent %s on object path %s...",
-			agent_owner, object_path);
+	update = g_hash_table_lookup(agent->queued, app_owner);
+	if (update) {
+		pold_log_debug("Replacing queued update of app %s at agent %s",
+				app_owner, agent_owner);
+		g_free(update->policy_json);
+		update->policy_json = g_strdup(policy->json);
+		return 0;
+	}
 
-	msg = dbus_message_new_method_call(agent_owner, object_path,
-			POLD_AGENT_NOTIFICATION_INTERFACE, "Update");
+	update = pold_pool_alloc0(&update_pool);
+	update->agent = agent;
+	update->app_owner = g_strdup(app_owner);
+	update->policy_json = g_strdup(policy->json);
 
-	if (!msg)
-		goto error_nomem;
+	g_queue_push_tail(&agent->queue, update);
+	g_hash_table_insert(agent->queued, update->app_owner, update);
 
-	dbus_message_iter_init_append(msg, &msg_iter);
-	dbus_message_iter_append_basic(&msg_iter, DBUS_TYPE_STRING, &app_owner);
+	send_updates(agent);
 
-	pold_policy_append_to_message(msg, policy);
+	return 0;
+}
 
-	if (!g_dbus_send_message(dbus_connection, msg))
-		goto error_nomem;
+/*
+ * Returns the number of answered requests together with the p50 and p99
+ * latency in microseconds for every stage of a request.
+ */
+DBusMessage *pold_manager_get_latency(DBusConnection *dbus_connection,
+		DBusMessage *message, void *user_data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, dict, entry, value;
+	dbus_uint64_t count, p50, p99;
+	unsigned int i;
 
-	return 0;
+	reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		pold_log_debug("Could not create D-Bus reply message");
+		return NULL;
+	}
 
-error_nomem:
-	dbus_message_unref(msg);
-	pold_log_debug("Agent update failed with error %s",
-			strerror(ENOMEM));
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{s(ttt)}",
+			&dict);
+
+	for (i = 0; i < STAGES; i++) {
+		count = latencies[i].count;
+		p50 = pold_histogram_percentile(&latencies[i], 0.5);
+		p99 = pold_histogram_percentile(&latencies[i], 0.99);
+
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+				NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+				&stages[i].name);
+		dbus_message_iter_open_container(&entry, DBUS_TYPE_STRUCT,
+				NULL, &value);
+		dbus_message_iter_append_basic(&value, DBUS_TYPE_UINT64, &count);
+		dbus_message_iter_append_basic(&value, DBUS_TYPE_UINT64, &p50);
+		dbus_message_iter_append_basic(&value, DBUS_TYPE_UINT64, &p99);
+		dbus_message_iter_close_container(&entry, &value);
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+	return reply;
+}
+
+/*
+ * Returns the enabled debug categories as a comma separated list
+ */
+DBusMessage *pold_manager_get_debug_categories(
+		DBusConnection *dbus_connection, DBusMessage *message,
+		void *user_data)
+{
+	DBusMessage *reply;
+	char *categories;
+
+	categories = pold_log_get_debug_categories();
+	reply = g_dbus_create_reply(message, DBUS_TYPE_STRING, &categories,
+			DBUS_TYPE_INVALID);
+	g_free(categories);
+
+	return reply;
+}
+
+/*
+ * Enables debug messages of the given comma separated categories and
+ * disables all others. Messages are written to the journal, unless pold
+ * runs with --debug.
+ */
+DBusMessage *pold_manager_set_debug_categories(
+		DBusConnection *dbus_connection, DBusMessage *message,
+		void *user_data)
+{
+	const char *categories;
+
+	if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING,
+				&categories, DBUS_TYPE_INVALID))
+		return g_dbus_create_error(message, DBUS_ERROR_INVALID_ARGS,
+				"Expected a string of categories");
+
+	if (!pold_log_set_debug_categories(categories))
+		return g_dbus_create_error(message, DBUS_ERROR_INVALID_ARGS,
+				"Unknown debug category in %s", categories);
+
+	pold_log_info("Debug categories set to \"%s\"", categories);
+
+	return g_dbus_create_reply(message, DBUS_TYPE_INVALID);
+}
+
+/*
+ * Writes the flight recorder to POLD_TRACE_FILE and returns its path
+ */
+DBusMessage *pold_manager_dump_trace(DBusConnection *dbus_connection,
+		DBusMessage *message, void *user_data)
+{
+	const char *path = POLD_TRACE_FILE;
+
+	if (!pold_trace_dump(path))
+		return g_dbus_create_error(message, DBUS_ERROR_FAILED,
+				"Writing trace to %s failed", path);
+
+	return g_dbus_create_reply(message, DBUS_TYPE_STRING, &path,
+			DBUS_TYPE_INVALID);
+}
+
+static void append_histogram(DBusMessageIter *dict, const char *name,
+		const struct pold_histogram *histogram)
+{
+	dbus_uint64_t value;
+	const dbus_uint64_t *buckets = histogram->buckets;
+	char *key;
+
+	key = g_strdup_printf("%sCount", name);
+	dict_append_entry(dict, key, DBUS_TYPE_UINT64,
+			(void *) &histogram->count);
+	g_free(key);
+
+	key = g_strdup_printf("%sSum", name);
+	dict_append_entry(dict, key, DBUS_TYPE_UINT64,
+			(void *) &histogram->sum);
+	g_free(key);
+
+	key = g_strdup_printf("%sMax", name);
+	dict_append_entry(dict, key, DBUS_TYPE_UINT64,
+			(void *) &histogram->max);
+	g_free(key);
+
+	key = g_strdup_printf("%sP50", name);
+	value = pold_histogram_percentile(histogram, 0.5);
+	dict_append_entry(dict, key, DBUS_TYPE_UINT64, &value);
+	g_free(key);
+
+	key = g_strdup_printf("%sP99", name);
+	value = pold_histogram_percentile(histogram, 0.99);
+	dict_append_entry(dict, key, DBUS_TYPE_UINT64, &value);
+	g_free(key);
+
+	key = g_strdup_printf("%sBuckets", name);
+	dict_append_array(dict, key, DBUS_TYPE_UINT64, &buckets,
+			POLD_HISTOGRAM_BUCKETS);
+	g_free(key);
+}
+
+static void append_source(const struct pold_source_status *status,
+		void *data)
+{
+	DBusMessageIter *sources = data;
+	DBusMessageIter entry, dict;
+	const char *breaker = pold_breaker_state_name(status->breaker);
+	dbus_uint32_t value;
+
+	dbus_message_iter_open_container(sources, DBUS_TYPE_DICT_ENTRY, NULL,
+			&entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+			&status->name);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	dict_append_entry(&dict, "Breaker", DBUS_TYPE_STRING, &breaker);
+	value = status->failures;
+	dict_append_entry(&dict, "Failures", DBUS_TYPE_UINT32, &value);
+	value = status->backoff;
+	dict_append_entry(&dict, "Backoff", DBUS_TYPE_UINT32, &value);
+	dict_append_entry(&dict, "Transitions", DBUS_TYPE_UINT64,
+			(void *) &status->transitions);
+	value = status->interval;
+	dict_append_entry(&dict, "Interval", DBUS_TYPE_UINT32, &value);
+	dict_append_entry(&dict, "Refreshed", DBUS_TYPE_UINT64,
+			(void *) &status->refreshed);
+
+	dbus_message_iter_close_container(&entry, &dict);
+	dbus_message_iter_close_container(sources, &entry);
+}
+
+/*
+ * Appends the state of the sources as "Sources" entry of type a{sa{sv}},
+ * keyed by source name. It only changes along with the breaker and refresh
+ * statistics, so it may be kept as part of the snapshot.
+ */
+static void append_sources(DBusMessageIter *dict)
+{
+	DBusMessageIter entry, variant, sources;
+	const char *key = "Sources";
+	const char *signature = DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL,
+			&entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature,
+			&variant);
+	dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY,
+			signature + 1, &sources);
+
+	pold_http_client_foreach_source(append_source, &sources);
+
+	dbus_message_iter_close_container(&variant, &sources);
+	dbus_message_iter_close_container(&entry, &variant);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static DBusMessage *build_stats_reply(const struct pold_stats *snapshot)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, dict;
+	unsigned int i;
+
+	reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	for (i = 0; i < POLD_STATS_COUNTERS; i++)
+		dict_append_entry(&dict, pold_stats_counter_name(i),
+				DBUS_TYPE_UINT64,
+				(void *) &snapshot->counters[i]);
+
+	for (i = 0; i < POLD_STATS_GAUGES; i++)
+		dict_append_entry(&dict, pold_stats_gauge_name(i),
+				DBUS_TYPE_UINT64,
+				(void *) &snapshot->gauges[i]);
+
+	for (i = 0; i < POLD_STATS_HISTOGRAMS; i++)
+		append_histogram(&dict, pold_stats_histogram_name(i),
+				&snapshot->histograms[i]);
+
+	append_sources(&dict);
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+	return reply;
+}
+
+/*
+ * Returns all statistics. The reply is marshalled once per snapshot and
+ * only copied for each call, so that polling does not compete with policy
+ * requests.
+ */
+DBusMessage *pold_manager_get_stats(DBusConnection *dbus_connection,
+		DBusMessage *message, void *user_data)
+{
+	struct pold_stats snapshot;
+	DBusMessage *reply;
+	gint64 now;
+
+	now = g_get_monotonic_time();
+
+	if (!stats_reply || now - stats_reply_time >=
+			STATS_SNAPSHOT_INTERVAL_IN_MICROSECONDS) {
+		if (pold_stats_snapshot(&snapshot) || !stats_reply) {
+			reply = build_stats_reply(&snapshot);
+			if (!reply) {
+				pold_log_debug("Could not create D-Bus reply "
+						"message");
+				return NULL;
+			}
+
+			if (stats_reply)
+				dbus_message_unref(stats_reply);
+			stats_reply = reply;
+		}
+
+		stats_reply_time = now;
+	}
+
+	reply = dbus_message_copy(stats_reply);
+	if (!reply) {
+		pold_log_debug("Could not create D-Bus reply message");
+		return NULL;
+	}
 
-	return -ENOMEM;
+	dbus_message_set_reply_serial(reply, dbus_message_get_serial(message));
+	dbus_message_set_destination(reply, dbus_message_get_sender(message));
+
+	return reply;
 }
 
+static const GDBusMethodTable stats_methods[] = {
+		{ GDBUS_METHOD("GetAll", NULL,
+				GDBUS_ARGS({"stats", "a{sv}"}),
+				pold_manager_get_stats)
+		},
+		{ }
+};
+
 static const GDBusMethodTable manager_methods[] = {
 		{ GDBUS_ASYNC_METHOD("GetPolicyConfig", GDBUS_ARGS({"in", "s"}),
 				GDBUS_ARGS({"out", "a{sv}"}),
@@ -500,27 +1577,132 @@ static const GDBusMethodTable manager_methods[] = {
 		{ GDBUS_METHOD("UnregisterAgent", GDBUS_ARGS({"in", "o"}),
 				NULL, pold_manager_unregister_agent)
 		},
+		{ GDBUS_METHOD("GetLatency", NULL,
+				GDBUS_ARGS({"latency", "a{s(ttt)}"}),
+				pold_manager_get_latency)
+		},
+		{ GDBUS_METHOD("GetDebugCategories", NULL,
+				GDBUS_ARGS({"categories", "s"}),
+				pold_manager_get_debug_categories)
+		},
+		{ GDBUS_METHOD("SetDebugCategories",
+				GDBUS_ARGS({"categories", "s"}), NULL,
+				pold_manager_set_debug_categories)
+		},
+		{ GDBUS_METHOD("DumpTrace", NULL,
+				GDBUS_ARGS({"path", "s"}),
+				pold_manager_dump_trace)
+		},
 		{ }
 };
 
-bool pold_manager_init(DBusConnection *dbus_connection)
+bool pold_manager_init(DBusConnection *dbus_connection,
+		unsigned int max_updates, unsigned int max_workers)
 {
+	GError *error = NULL;
+
 	connection = dbus_connection;
 	pold_unique_bus = dbus_bus_get_unique_name(dbus_connection);
-	object_paths = g_hash_table_new_full(g_str_hash, g_str_equal,
-						g_free, g_free);
+	max_agent_updates = max_updates;
+	agents = g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, free_agent);
+
+	lookups = g_hash_table_new(g_direct_hash, g_direct_equal);
+	finished_requests = g_async_queue_new();
+	workers = g_thread_pool_new(process_request, NULL, max_workers, FALSE,
+			&error);
+	if (!workers) {
+		pold_log_error("Error creating worker threads: %s",
+				error->message);
+		g_error_free(error);
+		g_async_queue_unref(finished_requests);
+		g_hash_table_destroy(lookups);
+		return false;
+	}
 
 	if (!g_dbus_register_interface(dbus_connection, POLD_MANAGER_PATH,
 			POLD_MANAGER_INTERFACE, manager_methods,
 			NULL, NULL, NULL, NULL)) {
 		pold_log_error("Error registering manager in D-Bus");
+		g_thread_pool_free(workers, TRUE, TRUE);
+		g_async_queue_unref(finished_requests);
+		g_hash_table_destroy(lookups);
+		return false;
+	}
+
+	if (!g_dbus_register_interface(dbus_connection, POLD_MANAGER_PATH,
+			POLD_STATS_INTERFACE, stats_methods,
+			NULL, NULL, NULL, NULL)) {
+		pold_log_error("Error registering statistics in D-Bus");
+		g_dbus_unregister_interface(dbus_connection, POLD_MANAGER_PATH,
+				POLD_MANAGER_INTERFACE);
+		g_thread_pool_free(workers, TRUE, TRUE);
+		g_async_queue_unref(finished_requests);
+		g_hash_table_destroy(lookups);
 		return false;
 	}
 
 	return true;
 }
 
+/*
+ * Frees a request along with the requests which joined it, unanswered
+ */
+static void free_lookup(struct config_data *data)
+{
+	GSList *list;
+
+	for (list = data->followers; list; list = list->next)
+		free_config_data(list->data);
+
+	free_config_data(data);
+}
+
 void pold_manager_final(void)
 {
-	g_hash_table_destroy(object_paths);
+	struct config_data *data;
+	struct refresh_wait *wait;
+	GHashTableIter iter;
+	gpointer value;
+	GSList *list;
+
+	/* Let the workers finish, their requests are dropped unanswered */
+	g_thread_pool_free(workers, FALSE, TRUE);
+
+	while ((data = g_async_queue_try_pop(finished_requests))) {
+		finish_lookup(data);
+		free_lookup(data);
+	}
+	g_async_queue_unref(finished_requests);
+
+	for (list = refresh_waits; list; list = list->next) {
+		wait = list->data;
+		if (wait->timer)
+			g_source_remove(wait->timer);
+		g_free(wait);
+	}
+	g_slist_free(refresh_waits);
+	refresh_waits = NULL;
+
+	/* The others still wait for their credentials or a refresh */
+	g_hash_table_iter_init(&iter, lookups);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		free_lookup(value);
+	g_hash_table_destroy(lookups);
+
+	g_hash_table_destroy(agents);
+
+	if (stats_reply)
+		dbus_message_unref(stats_reply);
+
+	/*
+	 * Requests may still wait for a bus call or a refresh, and updates
+	 * for the reply of an agent. Their pools are left to them then.
+	 */
+	if (!pold_pool_clear(&request_pool))
+		pold_log_debug("%u requests still pending",
+				request_pool.allocated);
+	if (!pold_pool_clear(&update_pool))
+		pold_log_debug("%u agent updates still pending",
+				update_pool.allocated);
 }
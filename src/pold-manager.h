@@ -35,11 +35,29 @@ DBusMessage *pold_manager_register_agent(DBusConnection *connection,
 DBusMessage *pold_manager_unregister_agent(DBusConnection *connection,
 		DBusMessage *message, void *user_data);
 
+DBusMessage *pold_manager_get_latency(DBusConnection *dbus_connection,
+		DBusMessage *message, void *user_data);
+
+DBusMessage *pold_manager_get_debug_categories(
+		DBusConnection *dbus_connection, DBusMessage *message,
+		void *user_data);
+
+DBusMessage *pold_manager_set_debug_categories(
+		DBusConnection *dbus_connection, DBusMessage *message,
+		void *user_data);
+
+DBusMessage *pold_manager_dump_trace(DBusConnection *dbus_connection,
+		DBusMessage *message, void *user_data);
+
+DBusMessage *pold_manager_get_stats(DBusConnection *dbus_connection,
+		DBusMessage *message, void *user_data);
+
 int pold_manager_update_agent(DBusConnection *dbus_connection,
 		const char *agent_owner, const char *app_owner,
 		struct pold_policy *policy);
 
-bool pold_manager_init(DBusConnection *dbus_connection);
+bool pold_manager_init(DBusConnection *dbus_connection,
+		unsigned int max_updates, unsigned int max_workers);
 
 void pold_manager_final(void);
 
@@ -0,0 +1,127 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Decodes a flight recorder dump written by pold, one event per line:
+ *
+ * 2014-06-02 10:12:31.402113 +0.000000 request-received id=17 arg=0 :1.42
+ *
+ * The second column is the time since the oldest event in seconds.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include "trace.h"
+
+static void print_record(const struct pold_trace_header *header,
+		const struct pold_trace_record *record, guint64 first)
+{
+	char name[POLD_TRACE_NAME_SIZE + 1];
+	char date[32];
+	guint64 real_time;
+	time_t seconds;
+	struct tm tm;
+
+	/* Derive the wall clock time from the monotonic clock */
+	real_time = header->real_time -
+			(header->monotonic_time - record->timestamp);
+	seconds = real_time / G_USEC_PER_SEC;
+	localtime_r(&seconds, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+	memcpy(name, record->name, POLD_TRACE_NAME_SIZE);
+	name[POLD_TRACE_NAME_SIZE] = '\0';
+
+	printf("%s.%06u +%u.%06u %s id=%u arg=%" G_GUINT64_FORMAT " %s\n",
+			date, (unsigned int) (real_time % G_USEC_PER_SEC),
+			(unsigned int) ((record->timestamp - first) /
+					G_USEC_PER_SEC),
+			(unsigned int) ((record->timestamp - first) %
+					G_USEC_PER_SEC),
+			pold_trace_event_name(record->event), record->id,
+			record->arg, name);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = POLD_TRACE_FILE;
+	struct pold_trace_header header;
+	const struct pold_trace_record *records;
+	GError *error = NULL;
+	char *contents;
+	gsize length;
+	guint32 i;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [TRACE-FILE]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (argc == 2)
+		path = argv[1];
+
+	if (!g_file_get_contents(path, &contents, &length, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	if (length < sizeof(header)) {
+		fprintf(stderr, "%s is too short\n", path);
+		goto error;
+	}
+
+	memcpy(&header, contents, sizeof(header));
+
+	if (memcmp(header.magic, POLD_TRACE_MAGIC, sizeof(header.magic)) ||
+			header.record_size !=
+				sizeof(struct pold_trace_record)) {
+		fprintf(stderr, "%s is not a trace of this pold version\n",
+				path);
+		goto error;
+	}
+
+	if (length < sizeof(header) + (gsize) header.records *
+			header.record_size) {
+		fprintf(stderr, "%s is truncated\n", path);
+		goto error;
+	}
+
+	/* g_file_get_contents() returns memory aligned for any type */
+	records = (const struct pold_trace_record *) (contents +
+			sizeof(header));
+
+	for (i = 0; i < header.records; i++)
+		print_record(&header, &records[i], records[0].timestamp);
+
+	g_free(contents);
+
+	return EXIT_SUCCESS;
+
+error:
+	g_free(contents);
+
+	return EXIT_FAILURE;
+}
@@ -24,6 +24,8 @@
 #include <string.h>
 #include <sys/inotify.h>
 #include <unistd.h>
+#include <grp.h>
+#include <time.h>
 #include <config.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -39,6 +41,32 @@
 #include "dbus-common.h"
 #include "http-client.h"
 #include "dbus-json.h"
+#include "stats.h"
+#include "probes.h"
+#include "atom.h"
+#include "pool.h"
+#include "trie.h"
+#include "rules.h"
+
+#define POLD_LOG_CATEGORY POLD_LOG_POLICY
+
+/*
+ * Characters allowed in the name part of a policy id, enough for SELinux
+ * types like "haifux_t" and user and group names like "svc-1.2"
+ */
+#define POLICY_NAME_CHARS "[a-zA-Z0-9_.@$-]"
+
+/*
+ * Initial buffer size for getgrnam_r(), doubled as long as it reports ERANGE
+ */
+#define NSS_BUFFER_SIZE 1024
+
+/*
+ * Groups are summarized in a 64 bit mask with one bit per gid modulo 64.
+ * If the masks of a user's groups and of the groups with a policy do not
+ * intersect, none of the user's groups has a policy.
+ */
+#define GROUP_BIT(gid) ((guint64) 1 << ((gid) % 64))
 
 /*
  * This file contains data structures and functions related to the
@@ -49,21 +77,60 @@
  */
 
 /*
- * Struct that represents an agent application from pold's point of view
+ * Policy ids and app ids are atoms, so all tables below are keyed by
+ * pointer.
+ */
+
+/*
+ * The types of policy ids, ordered by priority
+ */
+enum policy_type {
+	POLICY_TYPE_GROUP,
+	POLICY_TYPE_USER,
+	POLICY_TYPE_SELINUX,
+	POLICY_TYPES
+};
+
+/*
+ * Struct that represents an agent application from pold's point of view.
+ * The fields needed to find the active policy through the ids come first
+ * and fill one cache line on 64 bit systems.
  */
 struct pold_agent_app {
 	/*
-	 * The id is of the format "agent_owner/app_owner", where agent_owner
-	 * is the application's agent's unique D-Bus owner and app_owner is
-	 * the application's unique D-Bus owner.
+	 * The serial of the generation the policies below were looked up in
+	 */
+	unsigned int serial;
+
+	/*
+	 * The policy of the highest priority type in policies, or the default
+	 * policy
+	 */
+	struct pold_policy *active;
+
+	/*
+	 * The policy id of each type to which the application potentially
+	 * matches, NULL if the application has no id of that type
+	 */
+	const char *ids[POLICY_TYPES];
+
+	/*
+	 * The policy of each id, NULL if there is none
+	 */
+	struct pold_policy *policies[POLICY_TYPES];
+
+	/*
+	 * The groups of the app's user, NULL if unknown. They are only looked
+	 * at if none of the ids has a policy.
 	 */
-	char *id;
+	struct pold_policy_groups *groups;
 
 	/*
-	 * A list of policy ids to which the application potentially matches.
-	 * Only one of those policy ids corresponds to the active policy.
+	 * The id is of the format "agent_owner/app_owner", where agent_owner
+	 * is the application's agent's unique D-Bus owner and app_owner is
+	 * the application's unique D-Bus owner.
 	 */
-	GSList *policy_ids;
+	const char *id;
 
 	/*
 	 * In order to be able to update the agent when a policy changes,
@@ -73,9 +140,79 @@ struct pold_agent_app {
 	char *agent_policy_json;
 };
 
+static struct pold_pool app_pool = POLD_POOL_INIT(struct pold_agent_app, 64);
+
 struct update_policies_cb_data {
 	void (*cb)(int error, void *data);
 	void *data;
+
+	/* The result of applying the policies last handed out */
+	int error;
+};
+
+/*
+ * An immutable set of loaded policies. Requests resolved on worker threads
+ * keep a reference to the generation they started with, so the policies are
+ * never modified or freed under their feet.
+ */
+struct pold_policy_generation {
+	gint refcount;
+
+	/*
+	 * Tells generations apart, unlike their addresses which may be reused
+	 */
+	unsigned int serial;
+
+	/*
+	 * Maps the id atom to a pold_policy
+	 */
+	GHashTable *id_to_policy;
+
+	/*
+	 * The policies whose id is a pattern like "selinux:*_app_t". They are
+	 * only considered if no policy has exactly the id looked up.
+	 */
+	struct pold_trie *patterns;
+
+	/*
+	 * Maps the gid of each group with a policy to the policy, the mask
+	 * has the GROUP_BIT of all of them set
+	 */
+	GHashTable *gid_to_policy;
+	guint64 gid_mask;
+
+	/*
+	 * The merged policies, filled as combinations of layers show up when
+	 * merging policies is enabled. Shared between threads, hence the lock.
+	 */
+	GHashTable *merged;
+	GMutex merged_lock;
+
+	/*
+	 * The enum pold_rules_input the rules of all policies depend on
+	 */
+	unsigned int inputs;
+};
+
+/*
+ * A policy deep merged from the policies of several types of ids, the
+ * layers. It is owned by the generation of its layers.
+ */
+struct merged_policy {
+	struct pold_policy policy;
+
+	/* The policy of each type of id, NULL if there is none */
+	struct pold_policy *layers[POLICY_TYPES];
+};
+
+struct pold_policy_groups {
+	gint refcount;
+
+	/* The GROUP_BIT of all gids */
+	guint64 mask;
+
+	unsigned int n_gids;
+	gid_t gids[];
 };
 
 static struct pold_policy *default_policy;
@@ -83,15 +220,36 @@ static struct pold_policy *default_policy;
 static struct pold_policy *own_policy;
 
 /*
- * A regular expression which defines valid policy ids.
+ * Whether the policies of all types of an app's ids are merged, instead of
+ * only the one of the highest priority type applying
+ */
+static bool merge_policies;
+
+/*
+ * The context rules are evaluated against, see rules.h. Only replaced on
+ * the main thread, but read by the workers as well.
+ */
+static gint rules_context;
+
+/*
+ * Fires when a time window of a rule opens or closes
+ */
+static guint time_watch;
+
+/*
+ * Regular expressions which define valid policy ids and valid patterns of
+ * policy ids, which contain a single '*'
  */
 static GRegex *valid_policy_ids;
+static GRegex *valid_policy_patterns;
 
 /*
- * Maps the id string to a pold_policy.  Every policy must be contained at
- * least once in one of these hash tables.
+ * The generation of the most recently loaded policies. Only replaced and
+ * referenced on the main thread.
  */
-static GHashTable *id_to_policy;
+static struct pold_policy_generation *current_generation;
+
+static unsigned int last_generation_serial;
 
 /*
  * Maps the policy id to a list of apps
@@ -111,6 +269,12 @@ static GHashTable *app_id_to_app;
  */
 static GHashTable *update_apps;
 
+/*
+ * Set of all apps whose active policy has rules, which are the only ones
+ * to look at when the context changes
+ */
+static GHashTable *contextual_apps;
+
 /*
  * D-Bus connection used by the agent update trigger
  */
@@ -119,14 +283,106 @@ static DBusConnection *conn;
 static void free_policy(gpointer data)
 {
 	struct pold_policy *policy = data;
+	unsigned int i;
 
 	pold_log_debug("Removing policy %s from memory", policy->id);
 
-	g_free(policy->id);
+	pold_atom_unref(policy->id);
 	g_free(policy->json);
+	if (policy->reply)
+		dbus_message_unref(policy->reply);
+	if (policy->rules) {
+		for (i = 0; i <= pold_rules_size(policy->rules); i++)
+			free_policy(policy->variants[i]);
+		g_free(policy->variants);
+		pold_rules_free(policy->rules);
+	}
 	g_free(policy);
 }
 
+/*
+ * Prepares the reply template of a policy, so that replies do not need to
+ * convert the JSON again
+ */
+static void marshal_policy(struct pold_policy *policy)
+{
+	policy->reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!policy->reply)
+		return;
+
+	dbus_message_set_no_reply(policy->reply, TRUE);
+	pold_policy_append_to_message(policy->reply, policy);
+}
+
+static guint merged_hash(gconstpointer key)
+{
+	const struct merged_policy *merged = key;
+	guint hash = 0;
+	int type;
+
+	for (type = 0; type < POLICY_TYPES; type++)
+		hash = hash * 31 + g_direct_hash(merged->layers[type]);
+
+	return hash;
+}
+
+static gboolean merged_equal(gconstpointer a, gconstpointer b)
+{
+	const struct merged_policy *merged_a = a, *merged_b = b;
+
+	return memcmp(merged_a->layers, merged_b->layers,
+			sizeof(merged_a->layers)) == 0;
+}
+
+static struct pold_policy_generation *new_generation(void)
+{
+	struct pold_policy_generation *new;
+
+	new = g_new0(struct pold_policy_generation, 1);
+	new->refcount = 1;
+	new->serial = ++last_generation_serial;
+	new->id_to_policy = g_hash_table_new_full(g_direct_hash,
+			g_direct_equal, NULL, free_policy);
+	new->patterns = pold_trie_new();
+	new->gid_to_policy = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	/* The policy is the first member of merged_policy */
+	new->merged = g_hash_table_new_full(merged_hash, merged_equal,
+			free_policy, NULL);
+	g_mutex_init(&new->merged_lock);
+
+	return new;
+}
+
+struct pold_policy_generation *pold_policy_generation_ref(void)
+{
+	g_atomic_int_inc(&current_generation->refcount);
+
+	return current_generation;
+}
+
+void pold_policy_generation_unref(struct pold_policy_generation *generation)
+{
+	if (!generation)
+		return;
+
+	if (!g_atomic_int_dec_and_test(&generation->refcount))
+		return;
+
+	g_hash_table_destroy(generation->id_to_policy);
+	pold_trie_free(generation->patterns);
+	g_hash_table_destroy(generation->gid_to_policy);
+	g_hash_table_destroy(generation->merged);
+	g_mutex_clear(&generation->merged_lock);
+	g_free(generation);
+}
+
+bool pold_policy_generation_is_current(
+		struct pold_policy_generation *generation)
+{
+	return generation == current_generation;
+}
+
 static bool is_valid_policy_id(const char *id)
 {
 	if (!id)
@@ -141,48 +397,390 @@ static int get_policy_priority(const char *id)
 		return -1;
 
 	if (g_str_has_prefix(id, "selinux:"))
-		return 2;
+		return POLICY_TYPE_SELINUX;
 	else if (g_str_has_prefix(id, "user:"))
-		return 1;
+		return POLICY_TYPE_USER;
 	else if (g_str_has_prefix(id, "group:"))
-		return 0;
+		return POLICY_TYPE_GROUP;
 
 	return -1;
 }
 
+struct pold_policy_groups *pold_policy_groups_new(const gid_t *gids,
+		unsigned int n_gids)
+{
+	struct pold_policy_groups *groups;
+	unsigned int i;
+
+	groups = g_malloc(sizeof(*groups) + n_gids * sizeof(gid_t));
+	groups->refcount = 1;
+	groups->mask = 0;
+	groups->n_gids = n_gids;
+
+	for (i = 0; i < n_gids; i++) {
+		groups->gids[i] = gids[i];
+		groups->mask |= GROUP_BIT(gids[i]);
+	}
+
+	return groups;
+}
+
+struct pold_policy_groups *pold_policy_groups_ref(
+		struct pold_policy_groups *groups)
+{
+	if (groups)
+		g_atomic_int_inc(&groups->refcount);
+
+	return groups;
+}
+
+void pold_policy_groups_unref(struct pold_policy_groups *groups)
+{
+	if (groups && g_atomic_int_dec_and_test(&groups->refcount))
+		g_free(groups);
+}
+
 /*
- * An app has a list of policies which potentially match. The active policy
- * among those policies is the one whose type has the highest priority. If
- * there are several policies which have the same highest priority type, the
- * first one in the list wins.
+ * Returns the policy of the first of the groups which has a group policy,
+ * NULL if none has
  */
-static struct pold_policy *get_active_policy(struct pold_agent_app *app)
+static struct pold_policy *lookup_groups(
+		struct pold_policy_generation *generation,
+		struct pold_policy_groups *groups)
+{
+	struct pold_policy *policy;
+	unsigned int i;
+
+	if (!groups || !(groups->mask & generation->gid_mask))
+		return NULL;
+
+	for (i = 0; i < groups->n_gids; i++) {
+		if (!(GROUP_BIT(groups->gids[i]) & generation->gid_mask))
+			continue;
+
+		policy = g_hash_table_lookup(generation->gid_to_policy,
+				GUINT_TO_POINTER(groups->gids[i]));
+		if (policy)
+			return policy;
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the policy with the given id, or else the policy with the best
+ * matching pattern
+ */
+static struct pold_policy *lookup_policy(
+		struct pold_policy_generation *generation, const char *id)
+{
+	struct pold_policy *policy;
+
+	policy = g_hash_table_lookup(generation->id_to_policy, id);
+	if (policy)
+		return policy;
+
+	return pold_trie_match(generation->patterns, id);
+}
+
+/*
+ * Replaces the given policy by the policy with the given id, if it exists
+ * and has a higher priority
+ */
+static void consider_policy(struct pold_policy_generation *generation,
+		const char *id, struct pold_policy **policy, int *max_priority)
 {
-	struct pold_policy *policy = NULL;
 	struct pold_policy *current_policy;
 	int current_priority;
-	GSList *ids;
-	char *id;
-	int max_priority = -1;
 
-	for (ids = app->policy_ids; ids; ids = ids->next) {
-		id = ids->data;
+	current_priority = get_policy_priority(id);
+	if (current_priority <= *max_priority)
+		return;
+
+	current_policy = lookup_policy(generation, id);
+
+	if (current_policy) {
+		*policy = current_policy;
+		*max_priority = current_priority;
+	}
+}
+
+/*
+ * Looks up the policy of an id, unless a policy of an id of the same type
+ * was found already
+ */
+static void add_layer(struct pold_policy_generation *generation,
+		const char *id, struct pold_policy *layers[])
+{
+	int type;
+
+	type = get_policy_priority(id);
+	if (!layers[type])
+		layers[type] = lookup_policy(generation, id);
+}
+
+/*
+ * Deep merges the JSON object overlay into base. Members which are objects
+ * in both are merged recursively, any other member of overlay replaces the
+ * one of base. Arrays are replaced as a whole.
+ */
+static void merge_json(json_t *base, json_t *overlay)
+{
+	const char *key;
+	json_t *value, *current;
+
+	json_object_foreach(overlay, key, value) {
+		current = json_object_get(base, key);
+
+		if (json_is_object(current) && json_is_object(value))
+			merge_json(current, value);
+		else
+			json_object_set(base, key, value);
+	}
+}
+
+static struct pold_policy *new_variant(struct pold_policy *policy,
+		json_t *root)
+{
+	struct pold_policy *variant;
+
+	variant = g_new0(struct pold_policy, 1);
+	variant->id = pold_atom_ref(policy->id);
+	variant->base = policy;
+	variant->json = json_dumps(root, 0);
+	marshal_policy(variant);
+
+	return variant;
+}
+
+/*
+ * Compiles the rules of a policy and prepares its variants, i.e. the
+ * policy without the rules and with the "Set" of each rule merged in.
+ * Returns false if the rules are invalid.
+ */
+static bool compile_rules(struct pold_policy *policy, json_t *root)
+{
+	json_t *array, *base, *variant, *set;
+	unsigned int i, n_rules;
+
+	array = json_object_get(root, "Rules");
+	if (!array)
+		return true;
+
+	policy->rules = pold_rules_compile(array);
+	if (!policy->rules) {
+		pold_log_error("Invalid rules in policy %s", policy->id);
+		return false;
+	}
+
+	n_rules = pold_rules_size(policy->rules);
+	policy->variants = g_new0(struct pold_policy *, n_rules + 1);
+
+	base = json_deep_copy(root);
+	json_object_del(base, "Rules");
+
+	for (i = 0; i < n_rules; i++) {
+		variant = json_deep_copy(base);
+
+		set = json_object_get(json_array_get(array, i), "Set");
+		if (set)
+			merge_json(variant, set);
+
+		policy->variants[i] = new_variant(policy, variant);
+		json_decref(variant);
+	}
+
+	policy->variants[n_rules] = new_variant(policy, base);
+	json_decref(base);
+
+	return true;
+}
+
+/*
+ * Returns the variant of a policy for the current context
+ */
+static struct pold_policy *evaluate_policy(struct pold_policy *policy)
+{
+	if (!policy->rules)
+		return policy;
+
+	return policy->variants[pold_rules_evaluate(policy->rules,
+			g_atomic_int_get(&rules_context))];
+}
+
+/*
+ * Merges the layers, lowest priority first. The merged policy has the id
+ * of the highest priority layer.
+ */
+static struct merged_policy *new_merged_policy(struct pold_policy *layers[])
+{
+	struct merged_policy *merged;
+	json_t *root = NULL, *layer;
+	int type;
+
+	merged = g_new0(struct merged_policy, 1);
+	memcpy(merged->layers, layers, sizeof(merged->layers));
+
+	for (type = 0; type < POLICY_TYPES; type++) {
+		if (!layers[type])
+			continue;
+
+		layer = json_loads(layers[type]->json, 0, NULL);
+		if (!layer)
+			continue;
+
+		if (root) {
+			merge_json(root, layer);
+			json_decref(layer);
+		} else {
+			root = layer;
+		}
+
+		pold_atom_unref(merged->policy.id);
+		merged->policy.id = pold_atom_ref(layers[type]->id);
+	}
 
-		current_policy = g_hash_table_lookup(id_to_policy, id);
-		current_priority = get_policy_priority(id);
+	merged->policy.json = json_dumps(root, 0);
+	compile_rules(&merged->policy, root);
+	json_decref(root);
+
+	marshal_policy(&merged->policy);
+
+	return merged;
+}
 
-		if (current_priority > max_priority && current_policy) {
-			policy = current_policy;
-			max_priority = current_priority;
+/*
+ * Returns the policy of the highest priority layer with the policies of the
+ * other layers merged in, NULL if there are no layers. Each combination of
+ * layers is only merged once per generation. May be called from any thread.
+ */
+static struct pold_policy *merge_layers(
+		struct pold_policy_generation *generation,
+		struct pold_policy *layers[])
+{
+	struct merged_policy key, *merged, *new;
+	struct pold_policy *top = NULL;
+	int type, n_layers = 0;
+
+	for (type = 0; type < POLICY_TYPES; type++) {
+		if (layers[type]) {
+			top = layers[type];
+			n_layers++;
 		}
 	}
 
+	if (n_layers < 2)
+		return top;
+
+	memcpy(key.layers, layers, sizeof(key.layers));
+
+	g_mutex_lock(&generation->merged_lock);
+	merged = g_hash_table_lookup(generation->merged, &key);
+	g_mutex_unlock(&generation->merged_lock);
+
+	if (merged)
+		return &merged->policy;
+
+	/* Merging is slow, so it is done without holding the lock */
+	new = new_merged_policy(layers);
+
+	g_mutex_lock(&generation->merged_lock);
+	merged = g_hash_table_lookup(generation->merged, &key);
+	if (!merged) {
+		g_hash_table_add(generation->merged, new);
+		merged = new;
+		new = NULL;
+	}
+	g_mutex_unlock(&generation->merged_lock);
+
+	if (new)
+		free_policy(&new->policy);
+
+	return &merged->policy;
+}
+
+/*
+ * Returns the policy which applies to the given policies of the types of
+ * ids and the groups, either the one of the highest priority type or, if
+ * enabled, all of them merged
+ */
+static struct pold_policy *select_policy(
+		struct pold_policy_generation *generation,
+		struct pold_policy *policies[],
+		struct pold_policy_groups *groups)
+{
+	struct pold_policy *layers[POLICY_TYPES];
+	struct pold_policy *policy = NULL;
+	int type;
+
+	if (merge_policies) {
+		memcpy(layers, policies, sizeof(layers));
+		if (!layers[POLICY_TYPE_GROUP])
+			layers[POLICY_TYPE_GROUP] = lookup_groups(generation,
+					groups);
+
+		policy = merge_layers(generation, layers);
+	} else {
+		for (type = POLICY_TYPES - 1; type >= 0 && !policy; type--)
+			policy = policies[type];
+
+		if (!policy)
+			policy = lookup_groups(generation, groups);
+	}
+
 	if (!policy)
 		policy = default_policy;
 
 	return policy;
 }
 
+static void set_active_policy(struct pold_agent_app *app,
+		struct pold_policy *policy)
+{
+	app->active = policy;
+	app->serial = current_generation->serial;
+
+	if (policy->rules)
+		g_hash_table_add(contextual_apps, app);
+	else
+		g_hash_table_remove(contextual_apps, app);
+}
+
+/*
+ * Looks up the policies of the app's ids in the current generation. The
+ * active policy among them is the one whose type has the highest priority,
+ * or all of them merged.
+ */
+static void resolve_app(struct pold_agent_app *app)
+{
+	int type;
+
+	for (type = 0; type < POLICY_TYPES; type++) {
+		if (app->ids[type])
+			app->policies[type] = lookup_policy(
+					current_generation, app->ids[type]);
+		else
+			app->policies[type] = NULL;
+	}
+
+	set_active_policy(app, select_policy(current_generation, app->policies,
+			app->groups));
+}
+
+/*
+ * Returns the active policy of an app, which is only looked up again after
+ * the policies were reloaded, in the variant for the current context
+ */
+static struct pold_policy *get_active_policy(struct pold_agent_app *app)
+{
+	if (app->serial != current_generation->serial)
+		resolve_app(app);
+
+	POLD_PROBE2(active__policy, app->id, app->active->id);
+
+	return evaluate_policy(app->active);
+}
+
 /*
  * Compares the currently active policy to the the policy that the agent knows
  * about. If they differ, the application will be marked for update.
@@ -222,15 +820,153 @@ static struct pold_policy *load_policy(const char *full_path)
 		goto out;
 
 	policy = g_new0(struct pold_policy, 1);
-	policy->id = g_strdup(json_string_value(id));
+	policy->id = pold_atom_intern(json_string_value(id));
 	policy->json = json_dumps(root, 0);
 
+	if (!compile_rules(policy, root)) {
+		free_policy(policy);
+		policy = NULL;
+	}
+
 out:
 	json_decref(root);
 
 	return policy;
 }
 
+static bool get_group_id(const char *name, gid_t *gid)
+{
+	struct group grp, *result;
+	size_t size = NSS_BUFFER_SIZE;
+	char *buffer;
+	int err;
+
+	for (;;) {
+		buffer = g_malloc(size);
+		err = getgrnam_r(name, &grp, buffer, size, &result);
+		if (err != ERANGE)
+			break;
+
+		g_free(buffer);
+		size *= 2;
+	}
+
+	if (result)
+		*gid = grp.gr_gid;
+
+	g_free(buffer);
+
+	return result != NULL;
+}
+
+/*
+ * Adds a group policy to the gid index, so that it also applies to users
+ * with the group as supplementary group
+ */
+static void index_group(struct pold_policy_generation *generation,
+		struct pold_policy *policy)
+{
+	gid_t gid;
+
+	if (!get_group_id(policy->id + strlen("group:"), &gid)) {
+		pold_log_debug("Group of policy %s is unknown", policy->id);
+		return;
+	}
+
+	if (g_hash_table_contains(generation->gid_to_policy,
+			GUINT_TO_POINTER(gid)))
+		return;
+
+	g_hash_table_insert(generation->gid_to_policy, GUINT_TO_POINTER(gid),
+			policy);
+	generation->gid_mask |= GROUP_BIT(gid);
+}
+
+/*
+ * Adds the policies whose id is a pattern to the pattern trie and the
+ * group policies to the gid index, prepares the reply templates and
+ * collects the inputs of the rules
+ */
+static void index_policies(struct pold_policy_generation *generation)
+{
+	struct pold_policy *policy;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (default_policy && default_policy->rules)
+		generation->inputs = pold_rules_inputs(default_policy->rules);
+
+	g_hash_table_iter_init(&iter, generation->id_to_policy);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		policy = value;
+
+		marshal_policy(policy);
+
+		if (policy->rules)
+			generation->inputs |= pold_rules_inputs(
+					policy->rules);
+
+		if (!strchr(policy->id, '*')) {
+			if (g_str_has_prefix(policy->id, "group:"))
+				index_group(generation, policy);
+			continue;
+		}
+
+		if (!g_regex_match(valid_policy_patterns, policy->id, 0,
+				NULL)) {
+			pold_log_error("Policy id %s is not a valid pattern",
+					policy->id);
+			continue;
+		}
+
+		pold_trie_insert(generation->patterns, policy->id, policy);
+	}
+}
+
+/*
+ * Merges the combinations of layers that were in use with the previous
+ * policies again, as far as their policies still exist, so that requests
+ * rarely have to merge after a reload
+ */
+static void remerge_policies(struct pold_policy_generation *previous,
+		struct pold_policy_generation *loaded)
+{
+	struct pold_policy *layers[POLICY_TYPES];
+	struct merged_policy *merged;
+	GHashTableIter iter;
+	gpointer key, value;
+	GPtrArray *in_use;
+	unsigned int i;
+	int type;
+
+	in_use = g_ptr_array_new();
+
+	g_mutex_lock(&previous->merged_lock);
+	g_hash_table_iter_init(&iter, previous->merged);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		g_ptr_array_add(in_use, key);
+	g_mutex_unlock(&previous->merged_lock);
+
+	for (i = 0; i < in_use->len; i++) {
+		merged = g_ptr_array_index(in_use, i);
+
+		for (type = 0; type < POLICY_TYPES; type++) {
+			if (merged->layers[type])
+				layers[type] = g_hash_table_lookup(
+						loaded->id_to_policy,
+						merged->layers[type]->id);
+			else
+				layers[type] = NULL;
+		}
+
+		merge_layers(loaded, layers);
+	}
+
+	g_ptr_array_free(in_use, TRUE);
+}
+
+static void update_time(void);
+
 static bool is_valid_policy_filename(char *filename)
 {
 	return g_str_has_suffix(filename, ".policy");
@@ -247,10 +983,14 @@ static int load_policies(const char *policy_dir)
 	const char *name;
 	GDir *dir;
 	struct pold_policy *policy;
+	struct pold_policy_generation *loaded;
+	gint64 started;
 
 	pold_log_debug("Loading policies from directory %s",
 			policy_dir);
 
+	started = POLD_PROBE_NOW();
+
 	dir = g_dir_open(policy_dir, 0, &g_error);
 	if (!dir) {
 		error = g_error->code;
@@ -259,7 +999,7 @@ static int load_policies(const char *policy_dir)
 		return -error;
 	}
 
-	g_hash_table_remove_all(id_to_policy);
+	loaded = new_generation();
 
 	while ((name = g_dir_read_name(dir))) {
 		full_path = g_strdup_printf("%s/%s", policy_dir, name);
@@ -274,8 +1014,8 @@ static int load_policies(const char *policy_dir)
 				goto out;
 			}
 
-			g_hash_table_replace(id_to_policy,
-					g_strdup(policy->id), policy);
+			g_hash_table_replace(loaded->id_to_policy,
+					(gpointer) policy->id, policy);
 		}
 
 		g_free(full_path);
@@ -283,6 +1023,29 @@ static int load_policies(const char *policy_dir)
 
 out:
 	g_dir_close(dir);
+
+	/* Keep serving the previous policies if loading failed */
+	if (error) {
+		g_free(full_path);
+		pold_policy_generation_unref(loaded);
+		return error;
+	}
+
+	index_policies(loaded);
+
+	if (merge_policies)
+		remerge_policies(current_generation, loaded);
+
+	pold_policy_generation_unref(current_generation);
+	current_generation = loaded;
+
+	update_time();
+
+	pold_stats_set(POLD_STATS_POLICIES,
+			g_hash_table_size(current_generation->id_to_policy));
+	POLD_PROBE3(load__policies, policy_dir,
+			g_hash_table_size(current_generation->id_to_policy),
+			POLD_PROBE_NOW() - started);
 	return error;
 }
 
@@ -379,6 +1142,9 @@ static int update_agent_policies(void)
 	int error;
 	struct pold_agent_app *app;
 	char **agent_and_app_owner;
+	gint64 started;
+
+	started = POLD_PROBE_NOW();
 
 	g_hash_table_iter_init(&iter, update_apps);
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
@@ -397,20 +1163,153 @@ static int update_agent_policies(void)
 		app->agent_policy_json = g_strdup(policy->json);
 	}
 
+	POLD_PROBE2(update__agents, g_hash_table_size(update_apps),
+			POLD_PROBE_NOW() - started);
+
 	return 0;
 }
 
+/*
+ * Updates the agents of the apps whose policy depends on the changed
+ * inputs of the context, if the variant of their policy changed
+ */
+static void update_contextual_apps(unsigned int changed)
+{
+	struct pold_agent_app *app;
+	struct pold_policy *policy;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_remove_all(update_apps);
+
+	g_hash_table_iter_init(&iter, contextual_apps);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		app = key;
+
+		/* Their update follows once the reload is done */
+		if (app->serial != current_generation->serial)
+			continue;
+
+		if (!(pold_rules_inputs(app->active->rules) & changed))
+			continue;
+
+		policy = evaluate_policy(app->active);
+		if (g_strcmp0(app->agent_policy_json, policy->json) != 0)
+			g_hash_table_add(update_apps, app);
+	}
+
+	if (g_hash_table_size(update_apps) > 0)
+		update_agent_policies();
+}
+
+static void set_context(gint new_context)
+{
+	unsigned int changed;
+
+	changed = pold_rules_context_diff(rules_context, new_context);
+	if (!changed)
+		return;
+
+	g_atomic_int_set(&rules_context, new_context);
+
+	if (changed & current_generation->inputs)
+		update_contextual_apps(changed);
+}
+
+static gboolean time_changed(gpointer user_data)
+{
+	time_watch = 0;
+	update_time();
+
+	return FALSE;
+}
+
+/*
+ * Returns the minutes until the next time window of a rule opens or
+ * closes, 0 if no rule has one
+ */
+static unsigned int get_next_change(unsigned int minute)
+{
+	struct pold_policy *policy;
+	unsigned int next = 0, minutes;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, current_generation->id_to_policy);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		policy = value;
+		if (!policy->rules)
+			continue;
+
+		minutes = pold_rules_next_change(policy->rules, minute);
+		if (minutes && (!next || minutes < next))
+			next = minutes;
+	}
+
+	if (default_policy->rules) {
+		minutes = pold_rules_next_change(default_policy->rules, minute);
+		if (minutes && (!next || minutes < next))
+			next = minutes;
+	}
+
+	return next;
+}
+
+/*
+ * Updates the time of the context if rules depend on it, and schedules the
+ * next update for when a time window opens or closes
+ */
+static void update_time(void)
+{
+	unsigned int minute, next;
+	struct tm local;
+	time_t now;
+
+	if (time_watch) {
+		g_source_remove(time_watch);
+		time_watch = 0;
+	}
+
+	if (!(current_generation->inputs & POLD_RULES_TIME))
+		return;
+
+	now = time(NULL);
+	localtime_r(&now, &local);
+	minute = local.tm_hour * 60 + local.tm_min;
+
+	set_context(pold_rules_context_set_minute(rules_context, minute));
+
+	next = get_next_change(minute);
+	if (next)
+		time_watch = g_timeout_add_seconds(next * 60 - local.tm_sec,
+				time_changed, NULL);
+}
+
+void pold_policy_set_session_state(const char *state)
+{
+	set_context(pold_rules_context_set_state(rules_context, state));
+}
+
+void pold_policy_set_session_bearer(const char *bearer)
+{
+	set_context(pold_rules_context_set_bearer(rules_context,
+			bearer));
+}
+
 static void free_app(void *pointer)
 {
 	struct pold_agent_app *app = pointer;
+	int type;
 
 	if (!app)
 		return;
 
-	g_free(app->id);
-	g_slist_free_full(app->policy_ids, g_free);
+	pold_atom_unref(app->id);
+	for (type = 0; type < POLICY_TYPES; type++)
+		pold_atom_unref(app->ids[type]);
+	pold_policy_groups_unref(app->groups);
 	g_free(app->agent_policy_json);
-	g_free(app);
+	pold_pool_free(&app_pool, app);
 }
 
 static int init_default_policy(void)
@@ -421,6 +1320,8 @@ static int init_default_policy(void)
 				DEFAULT_POLICY);
 		return -ENOENT;
 	}
+
+	marshal_policy(default_policy);
 	return 0;
 }
 
@@ -442,13 +1343,13 @@ static void free_list(void *list)
 
 static void hashtables_init(void)
 {
-	id_to_policy = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-			free_policy);
-	id_to_apps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-			free_list);
-	app_id_to_app = g_hash_table_new_full(g_str_hash, g_str_equal,
-			g_free, free_app);
+	current_generation = new_generation();
+	id_to_apps = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			pold_atom_free, free_list);
+	app_id_to_app = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, free_app);
 	update_apps = g_hash_table_new(g_direct_hash, g_direct_equal);
+	contextual_apps = g_hash_table_new(g_direct_hash, g_direct_equal);
 }
 
 /*
@@ -457,27 +1358,32 @@ static void hashtables_init(void)
  */
 static void hashtables_final(void)
 {
-	g_hash_table_destroy(id_to_policy);
+	pold_policy_generation_unref(current_generation);
+	current_generation = NULL;
 	g_hash_table_destroy(id_to_apps);
 	g_hash_table_destroy(app_id_to_app);
 	g_hash_table_destroy(update_apps);
+	g_hash_table_destroy(contextual_apps);
 }
 
 static void stop_watching_app(DBusConnection *connection, void *user_data)
 {
 	struct pold_agent_app *app = user_data;
-	GSList *ids;
 	GSList *apps;
-	char *id;
+	int type;
 
-	for (ids = app->policy_ids; ids; ids = ids->next) {
-		id = ids->data;
+	for (type = 0; type < POLICY_TYPES; type++) {
+		if (!app->ids[type])
+			continue;
 
-		apps = g_hash_table_lookup(id_to_apps, id);
+		apps = g_hash_table_lookup(id_to_apps, app->ids[type]);
 		g_slist_remove(apps, app);
 	}
 
+	g_hash_table_remove(contextual_apps, app);
 	g_hash_table_remove(app_id_to_app, app->id);
+	pold_stats_set(POLD_STATS_WATCHED_APPS,
+			g_hash_table_size(app_id_to_app));
 }
 
 static void fill_apps_to_remove(const char *agent_owner,
@@ -501,34 +1407,45 @@ static void fill_apps_to_remove(const char *agent_owner,
 	}
 }
 
-static void update_policies_cb(const char *policies_json, void *data)
+/*
+ * Replaces the stored policies by the given ones and updates the agents
+ */
+static int apply_policies(const char *policies_json)
 {
 	int error;
-	struct update_policies_cb_data *update_policies_cb_data = data;
-
-	if (!policies_json) {
-		error = -EINVAL;
-		goto out;
-	}
 
 	error = delete_all_policies(POLICYDIR);
 	if (error)
-		goto out;
+		return error;
 
 	error = save_policies(POLICYDIR, policies_json);
 	if (error)
-		goto out;
+		return error;
 
 	error = load_policies(POLICYDIR);
 	if (error)
-		goto out;
+		return error;
 
 	mark_update_apps();
 	update_agent_policies();
 
-out:
+	return 0;
+}
+
+static void update_policies_cb(const char *policies_json, bool done,
+		void *data)
+{
+	struct update_policies_cb_data *update_policies_cb_data = data;
+
+	if (policies_json)
+		update_policies_cb_data->error = apply_policies(policies_json);
+
+	if (!done)
+		return;
+
 	if (update_policies_cb_data->cb)
-		update_policies_cb_data->cb(error, update_policies_cb_data->data);
+		update_policies_cb_data->cb(update_policies_cb_data->error,
+				update_policies_cb_data->data);
 	g_free(update_policies_cb_data);
 }
 
@@ -561,7 +1478,8 @@ static void add_app(const char *id, struct pold_agent_app *app)
 	apps = g_hash_table_lookup(id_to_apps, id);
 	if (!apps) {
 		apps = g_slist_append(apps, NULL);
-		g_hash_table_insert(id_to_apps, g_strdup(id), apps);
+		g_hash_table_insert(id_to_apps, (gpointer) pold_atom_ref(id),
+				apps);
 	}
 
 	g_slist_append(apps, app);
@@ -571,48 +1489,105 @@ static void add_app(const char *id, struct pold_agent_app *app)
  * Starts watching an app, which is identified by its agent's D-Bus owner and
  * its own owner. The number of policy id's n_ids which can apply is variable,
  * each id includes the type of the id encoded in the string. E.g., a valid id
- * would be "user:foo".
+ * would be "user:foo". Only the first id of each type is used. A new app
+ * takes the resolved policy over if there is one, instead of looking its
+ * ids up.
  */
-void pold_policy_watch_app(const char *agent_owner, const char *app_owner,
-		int n_ids, ...)
+static struct pold_policy *start_watching_app(const char *agent_owner,
+		const char *app_owner, struct pold_policy_groups *groups,
+		struct pold_policy *resolved, int n_ids, va_list ap)
 {
 	struct pold_agent_app *app;
+	struct pold_policy *policy;
 	const char *policy_id;
-	char *app_id;
-	va_list ap;
-	int i;
+	const char *app_id;
+	int i, type;
 
-	app_id = g_strdup_printf("%s/%s", agent_owner, app_owner);
+	app_id = pold_atom_printf("%s/%s", agent_owner, app_owner);
 
-	if (g_hash_table_contains(app_id_to_app, app_id))
-		return;
+	app = g_hash_table_lookup(app_id_to_app, app_id);
+	if (app) {
+		pold_stats_inc(POLD_STATS_CACHE_HITS);
+		pold_atom_unref(app_id);
+		return get_active_policy(app);
+	}
 
-	app = g_new0(struct pold_agent_app, 1);
-	app->id = g_strdup(app_id);
-	app->policy_ids = NULL;
+	pold_stats_inc(POLD_STATS_CACHE_MISSES);
+
+	app = pold_pool_alloc0(&app_pool);
+	app->id = app_id;
+	app->groups = pold_policy_groups_ref(groups);
 
-	va_start(ap, n_ids);
 	for (i = 0; i < n_ids; i++) {
 		policy_id = va_arg(ap, const char*);
 
-		if (is_valid_policy_id(policy_id)) {
-			app->policy_ids = g_slist_append(app->policy_ids,
-					g_strdup(policy_id));
-			add_app(policy_id, app);
-		} else {
+		if (!is_valid_policy_id(policy_id)) {
 			pold_log_debug(
 					"id %s is an unknown "
 					"policy type!", policy_id);
+			continue;
+		}
+
+		type = get_policy_priority(policy_id);
+		if (app->ids[type]) {
+			pold_log_debug("id %s ignored, app %s already has "
+					"id %s", policy_id, app_id,
+					app->ids[type]);
+			continue;
 		}
+
+		app->ids[type] = pold_atom_intern(policy_id);
+		add_app(app->ids[type], app);
 	}
-	va_end(ap);
 
-	app->agent_policy_json = g_strdup(get_active_policy(app)->json);
+	if (resolved)
+		set_active_policy(app, resolved);
 
-	g_hash_table_replace(app_id_to_app, g_strdup(app_id), app);
+	policy = get_active_policy(app);
+	app->agent_policy_json = g_strdup(policy->json);
+
+	g_hash_table_insert(app_id_to_app, (gpointer) app->id, app);
+	pold_stats_set(POLD_STATS_WATCHED_APPS,
+			g_hash_table_size(app_id_to_app));
 	g_dbus_add_disconnect_watch(conn, app_owner, stop_watching_app,
 			(void *) app, NULL);
-	g_free(app_id);
+
+	return policy;
+}
+
+struct pold_policy *pold_policy_watch_app(const char *agent_owner,
+		const char *app_owner, struct pold_policy_groups *groups,
+		int n_ids, ...)
+{
+	struct pold_policy *policy;
+	va_list ap;
+
+	va_start(ap, n_ids);
+	policy = start_watching_app(agent_owner, app_owner, groups, NULL,
+			n_ids, ap);
+	va_end(ap);
+
+	return policy;
+}
+
+struct pold_policy *pold_policy_watch_resolved_app(const char *agent_owner,
+		const char *app_owner, struct pold_policy_groups *groups,
+		struct pold_policy_generation *generation,
+		struct pold_policy *policy, int n_ids, ...)
+{
+	struct pold_policy *resolved = NULL;
+	va_list ap;
+
+	/* A policy of an older generation may be gone from the current one */
+	if (generation == current_generation)
+		resolved = policy->base ? policy->base : policy;
+
+	va_start(ap, n_ids);
+	policy = start_watching_app(agent_owner, app_owner, groups, resolved,
+			n_ids, ap);
+	va_end(ap);
+
+	return policy;
 }
 
 void pold_policy_append_to_message(DBusMessage *msg, struct pold_policy *policy)
@@ -623,9 +1598,71 @@ void pold_policy_append_to_message(DBusMessage *msg, struct pold_policy *policy)
 	pold_dbus_json_append_string(&iter, policy->json);
 }
 
+DBusMessage *pold_policy_new_reply(struct pold_policy *policy,
+		DBusMessage *msg)
+{
+	DBusMessage *reply;
+
+	if (!policy->reply) {
+		reply = dbus_message_new_method_return(msg);
+		if (reply)
+			pold_policy_append_to_message(reply, policy);
+
+		return reply;
+	}
+
+	reply = dbus_message_copy(policy->reply);
+	if (!reply)
+		return NULL;
+
+	dbus_message_set_reply_serial(reply, dbus_message_get_serial(msg));
+	dbus_message_set_destination(reply, dbus_message_get_sender(msg));
+
+	return reply;
+}
+
 struct pold_policy *pold_policy_get(const char *policy_id)
 {
-	return g_hash_table_lookup(id_to_policy, policy_id);
+	return g_hash_table_lookup(current_generation->id_to_policy,
+			pold_atom_lookup(policy_id));
+}
+
+/*
+ * Returns the policy with the highest priority among the given ids, or
+ * else the policy of one of the groups, like get_active_policy() does for a
+ * watched app. Unlike the latter it may be
+ * called from any thread. The ids have to be atoms, invalid ids are ignored.
+ */
+struct pold_policy *pold_policy_generation_lookup(
+		struct pold_policy_generation *generation,
+		struct pold_policy_groups *groups, int n_ids, ...)
+{
+	struct pold_policy *layers[POLICY_TYPES] = { NULL };
+	struct pold_policy *policy = NULL;
+	const char *policy_id;
+	int max_priority = -1;
+	va_list ap;
+	int i;
+
+	va_start(ap, n_ids);
+	for (i = 0; i < n_ids; i++) {
+		policy_id = va_arg(ap, const char *);
+
+		if (!is_valid_policy_id(policy_id))
+			continue;
+
+		if (merge_policies)
+			add_layer(generation, policy_id, layers);
+		else
+			consider_policy(generation, policy_id, &policy,
+					&max_priority);
+	}
+	va_end(ap);
+
+	if (!policy)
+		policy = select_policy(generation, layers, groups);
+
+	return evaluate_policy(policy);
 }
 
 struct pold_policy *pold_policy_get_default(void)
@@ -638,18 +1675,14 @@ struct pold_policy *pold_policy_get_own_policy(void)
 	return own_policy;
 }
 
-struct pold_policy *pold_policy_get_active_policy(const char *app_id)
-{
-	struct pold_agent_app *agent_app;
-
-	agent_app = g_hash_table_lookup(app_id_to_app, app_id);
-	return get_active_policy(agent_app);
-}
-
 static void valid_policy_ids_init(void)
 {
-	valid_policy_ids = g_regex_new("(selinux|user|group):[a-zA-Z]+",
-			0, 0, NULL);
+	valid_policy_ids = g_regex_new(
+			"^(selinux|user|group):" POLICY_NAME_CHARS "+$",
+			G_REGEX_OPTIMIZE, 0, NULL);
+	valid_policy_patterns = g_regex_new(
+			"^(selinux|user|group):" POLICY_NAME_CHARS "*\\*"
+			POLICY_NAME_CHARS "*$", G_REGEX_OPTIMIZE, 0, NULL);
 }
 
 void pold_policy_update_from_server(void (*cb)(int error, void *data),
@@ -661,15 +1694,19 @@ void pold_policy_update_from_server(void (*cb)(int error, void *data),
 	update_policies_cb_data->cb = cb;
 	update_policies_cb_data->data = data;
 
+	/* Stays if no source delivers policies */
+	update_policies_cb_data->error = -EINVAL;
+
 	pold_http_client_update_policies(update_policies_cb, update_policies_cb_data);
 }
 
-int pold_policy_init(DBusConnection *dbus_connection)
+int pold_policy_init(DBusConnection *dbus_connection, bool merge)
 {
 	int error;
 
 	pold_log_debug("Initializing policy file loading...");
 	conn = dbus_connection;
+	merge_policies = merge;
 	hashtables_init();
 	valid_policy_ids_init();
 
@@ -693,6 +1730,7 @@ out_own_policy:
 	free_policy(default_policy);
 out_default_policy:
 	g_regex_unref(valid_policy_ids);
+	g_regex_unref(valid_policy_patterns);
 	hashtables_final();
 
 	return error;
@@ -701,9 +1739,14 @@ out_default_policy:
 void pold_policy_final(void)
 {
 	pold_log_debug("Finalizing policy file loading...");
+	if (time_watch)
+		g_source_remove(time_watch);
+	time_watch = 0;
 	if (own_policy)
 		free_policy(own_policy);
 	if (default_policy)
 		free_policy(default_policy);
 	hashtables_final();
+	if (!pold_pool_clear(&app_pool))
+		pold_log_debug("%u apps still referenced", app_pool.allocated);
 }
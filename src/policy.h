@@ -23,6 +23,7 @@
 #define POLICY_H
 
 #include <stdbool.h>
+#include <sys/types.h>
 #include <glib.h>
 #include <dbus/dbus.h>
 
@@ -30,39 +31,130 @@
 #define DEFAULT_POLICY STORAGEDIR "/default.policy"
 #define OWN_POLICY STORAGEDIR "/pold.policy"
 
+struct pold_rules;
+
 struct pold_policy {
 	/*
 	 * The id can be either an SELinux, user or group id. The id is of the
 	 * format "type:value". Valid types are: "SELinux", "User", "Group".
+	 * The id is an atom.
 	 */
-	char *id;
+	const char *id;
 
 	/*
 	 * A JSON string that represents the policy.
 	 */
 	char *json;
+
+	/*
+	 * A method return with the policy already marshalled, copied for each
+	 * reply. NULL if the policy has to be marshalled for each reply.
+	 */
+	DBusMessage *reply;
+
+	/*
+	 * The compiled "Rules" of the policy, NULL if it has none. Then the
+	 * policy itself is never handed out, but one of its variants, with
+	 * the "Set" of the rule that holds applied. The last variant applies
+	 * if no rule holds.
+	 */
+	struct pold_rules *rules;
+	struct pold_policy **variants;
+
+	/* The policy a variant belongs to, NULL if this is no variant */
+	struct pold_policy *base;
 };
 
+/*
+ * An immutable snapshot of the loaded policies. Reloading the policies
+ * creates a new generation, the old one lives on until its last reference
+ * is dropped. Only the main thread may take references, but the policies of
+ * a referenced generation may be looked up and the reference dropped on any
+ * thread.
+ */
+struct pold_policy_generation;
+
+struct pold_policy_generation *pold_policy_generation_ref(void);
+
+void pold_policy_generation_unref(struct pold_policy_generation *generation);
+
+bool pold_policy_generation_is_current(
+		struct pold_policy_generation *generation);
+
+/*
+ * The groups a user is a member of. A group policy applies to a user
+ * through any of them, unless a policy applies to one of the user's policy
+ * ids. Group sets are immutable and may be shared between threads.
+ */
+struct pold_policy_groups;
+
+struct pold_policy_groups *pold_policy_groups_new(const gid_t *gids,
+		unsigned int n_gids);
+
+struct pold_policy_groups *pold_policy_groups_ref(
+		struct pold_policy_groups *groups);
+
+void pold_policy_groups_unref(struct pold_policy_groups *groups);
+
+/*
+ * The policy ids have to be atoms, groups may be NULL
+ */
+struct pold_policy *pold_policy_generation_lookup(
+		struct pold_policy_generation *generation,
+		struct pold_policy_groups *groups, int n_ids, ...);
+
 void pold_remove_agent_apps(const char *agent_owner);
 
-void pold_policy_watch_app(const char *agent_owner, const char *app_owner,
+/*
+ * Returns the active policy of the app
+ */
+struct pold_policy *pold_policy_watch_app(const char *agent_owner,
+		const char *app_owner, struct pold_policy_groups *groups,
 		int n_ids, ...);
 
+/*
+ * Like pold_policy_watch_app(), for an app whose policy was resolved with
+ * pold_policy_generation_lookup() already. Unless the generation is outdated
+ * a new app takes that policy over instead of being resolved again, only the
+ * context of its rules is evaluated anew.
+ */
+struct pold_policy *pold_policy_watch_resolved_app(const char *agent_owner,
+		const char *app_owner, struct pold_policy_groups *groups,
+		struct pold_policy_generation *generation,
+		struct pold_policy *policy, int n_ids, ...);
+
 struct pold_policy *pold_policy_get(const char *policy_id);
 
 struct pold_policy *pold_policy_get_default(void);
 
 struct pold_policy *pold_policy_get_own_policy(void);
 
-struct pold_policy *pold_policy_get_active_policy(const char *app_id);
-
 void pold_policy_append_to_message(DBusMessage *msg,
 		struct pold_policy *policy);
 
+/*
+ * Returns a reply to msg which carries the policy. May be called from any
+ * thread.
+ */
+DBusMessage *pold_policy_new_reply(struct pold_policy *policy,
+		DBusMessage *msg);
+
 void pold_policy_update_from_server(void (*cb)(int error, void *data),
 		void *data);
 
-int pold_policy_init(DBusConnection *dbus_connection);
+/*
+ * Update the ConnMan session context the rules of policies depend on. The
+ * agents whose policy changes are updated.
+ */
+void pold_policy_set_session_state(const char *state);
+
+void pold_policy_set_session_bearer(const char *bearer);
+
+/*
+ * If merge is set, the policies of all types of ids applying to an app are
+ * deep merged, the ones of higher priority types overriding the others
+ */
+int pold_policy_init(DBusConnection *dbus_connection, bool merge);
 
 void pold_policy_final(void);
 
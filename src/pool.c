@@ -0,0 +1,78 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "pool.h"
+
+static void add_slab(struct pold_pool *pool)
+{
+	char *slab;
+	unsigned int i;
+
+	slab = g_malloc(pool->object_size * pool->slab_objects);
+	pool->slabs = g_slist_prepend(pool->slabs, slab);
+
+	/* Link the objects back to front, so they are handed out in order */
+	for (i = pool->slab_objects; i > 0; i--) {
+		*(void **) (slab + (i - 1) * pool->object_size) =
+			pool->free_list;
+		pool->free_list = slab + (i - 1) * pool->object_size;
+	}
+}
+
+gpointer pold_pool_alloc0(struct pold_pool *pool)
+{
+	void *object;
+
+	if (!pool->free_list)
+		add_slab(pool);
+
+	object = pool->free_list;
+	pool->free_list = *(void **) object;
+	pool->allocated++;
+
+	memset(object, 0, pool->object_size);
+
+	return object;
+}
+
+void pold_pool_free(struct pold_pool *pool, gpointer object)
+{
+	if (!object)
+		return;
+
+	*(void **) object = pool->free_list;
+	pool->free_list = object;
+	pool->allocated--;
+}
+
+bool pold_pool_clear(struct pold_pool *pool)
+{
+	if (pool->allocated > 0)
+		return false;
+
+	g_slist_free_full(pool->slabs, g_free);
+	pool->slabs = NULL;
+	pool->free_list = NULL;
+
+	return true;
+}
@@ -0,0 +1,78 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <glib.h>
+
+/*
+ * A pool hands out objects of one fixed size from slabs, each holding many
+ * objects. Freed objects are kept on a free list for reuse, slabs are only
+ * returned to the system by pold_pool_clear(). This keeps records which
+ * come and go all the time from fragmenting the heap.
+ *
+ * Pools are not thread-safe, each one must only be used by one thread.
+ */
+struct pold_pool {
+	/* Size of an object, including padding for the free list link */
+	size_t object_size;
+
+	/* Number of objects per slab */
+	unsigned int slab_objects;
+
+	/* Freed objects, linked through their first word */
+	void *free_list;
+
+	GSList *slabs;
+
+	/* Objects currently handed out */
+	unsigned int allocated;
+};
+
+/*
+ * Statically initializes a pool for objects of the given type, allocating
+ * n objects at a time
+ */
+#define POLD_POOL_INIT(type, n) \
+	{ POLD_POOL_OBJECT_SIZE(sizeof(type)), (n), NULL, NULL, 0 }
+
+#define POLD_POOL_ALIGNMENT (2 * sizeof(void *))
+#define POLD_POOL_OBJECT_SIZE(size) \
+	(((size) + POLD_POOL_ALIGNMENT - 1) & ~(POLD_POOL_ALIGNMENT - 1))
+
+/*
+ * Returns a zeroed object
+ */
+gpointer pold_pool_alloc0(struct pold_pool *pool);
+
+void pold_pool_free(struct pold_pool *pool, gpointer object);
+
+/*
+ * Frees all slabs and returns true. If objects are still allocated from the
+ * pool, nothing is freed and false is returned, so that their users may
+ * keep on using them.
+ */
+bool pold_pool_clear(struct pold_pool *pool);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes for bpftrace, perf or SystemTap, e.g.
+ *
+ * bpftrace -e 'usdt:/usr/sbin/pold:pold:request__done { @[str(arg2)] =
+ *	hist(arg3); }'
+ *
+ * A probe compiles to a single nop plus a note in the ELF file, so they stay
+ * enabled in release builds. Arguments must not have side effects, since they
+ * are evaluated whether or not a tracer is attached. Timestamps which only
+ * feed probes are taken with POLD_PROBE_NOW(), which is 0 without probes.
+ *
+ * request__start(id, agent owner, app owner)
+ * credentials__resolved(id, uid, selinux id or NULL)
+ * request__done(id, app owner, policy id or NULL, microseconds)
+ * active__policy(app id, policy id)
+ * update__agents(apps, microseconds)
+ * update__agent(agent owner, app owner, policy id)
+ * refresh__done(HTTP status, bytes, microseconds)
+ * load__policies(directory, policies, microseconds)
+ */
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define POLD_PROBE2(name, a, b) \
+	DTRACE_PROBE2(pold, name, a, b)
+#define POLD_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(pold, name, a, b, c)
+#define POLD_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(pold, name, a, b, c, d)
+
+#define POLD_PROBE_NOW() g_get_monotonic_time()
+
+#else
+
+/*
+ * The arguments are referenced but never evaluated
+ */
+#define POLD_PROBE2(name, a, b) do { \
+	if (0) { (void) (a); (void) (b); } \
+} while (0)
+#define POLD_PROBE3(name, a, b, c) do { \
+	if (0) { (void) (a); (void) (b); (void) (c); } \
+} while (0)
+#define POLD_PROBE4(name, a, b, c, d) do { \
+	if (0) { (void) (a); (void) (b); (void) (c); (void) (d); } \
+} while (0)
+
+#define POLD_PROBE_NOW() 0
+
+#endif
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <jansson.h>
+#include "rules.h"
+
+#define MINUTES_PER_DAY (24 * 60)
+
+/*
+ * Layout of the context: the minute of the day in the lowest 11 bits, then
+ * 4 bits of state and 5 bits of bearer
+ */
+#define MINUTE_MASK 0x7ff
+#define STATE_SHIFT 11
+#define STATE_MASK 0xf
+#define BEARER_SHIFT 15
+#define BEARER_MASK 0x1f
+
+#define ANY G_MAXUINT32
+
+/*
+ * The known states and bearers, index 0 stands for unknown ones
+ */
+static const char *states[] = {
+	NULL,
+	"disconnected",
+	"connected",
+	"online",
+};
+
+static const char *bearers[] = {
+	NULL,
+	"ethernet",
+	"wifi",
+	"cellular",
+	"bluetooth",
+	"gadget",
+	"vpn",
+};
+
+struct rule {
+	/* Bit masks of the states and bearers for which the rule holds */
+	guint32 states;
+	guint32 bearers;
+
+	/*
+	 * The time window in minutes of the day, from inclusive and to
+	 * exclusive. If from is greater than to, the window spans midnight.
+	 * Both are -1 if the rule does not depend on the time.
+	 */
+	gint16 from;
+	gint16 to;
+};
+
+struct pold_rules {
+	unsigned int inputs;
+
+	unsigned int n_rules;
+	struct rule rules[];
+};
+
+static unsigned int find_name(const char *names[], unsigned int n_names,
+		const char *name)
+{
+	unsigned int i;
+
+	for (i = 1; i < n_names && name; i++) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+
+	return 0;
+}
+
+guint32 pold_rules_context_set_state(guint32 context, const char *state)
+{
+	context &= ~(STATE_MASK << STATE_SHIFT);
+
+	return context | find_name(states, G_N_ELEMENTS(states), state) <<
+			STATE_SHIFT;
+}
+
+guint32 pold_rules_context_set_bearer(guint32 context, const char *bearer)
+{
+	context &= ~(BEARER_MASK << BEARER_SHIFT);
+
+	return context | find_name(bearers, G_N_ELEMENTS(bearers), bearer) <<
+			BEARER_SHIFT;
+}
+
+guint32 pold_rules_context_set_minute(guint32 context, unsigned int minute)
+{
+	return (context & ~MINUTE_MASK) | (minute % MINUTES_PER_DAY);
+}
+
+unsigned int pold_rules_context_diff(guint32 a, guint32 b)
+{
+	unsigned int inputs = 0;
+	guint32 diff = a ^ b;
+
+	if (diff & (STATE_MASK << STATE_SHIFT))
+		inputs |= POLD_RULES_STATE;
+	if (diff & (BEARER_MASK << BEARER_SHIFT))
+		inputs |= POLD_RULES_BEARER;
+	if (diff & MINUTE_MASK)
+		inputs |= POLD_RULES_TIME;
+
+	return inputs;
+}
+
+/*
+ * Compiles a condition which is either a name or an array of names into a
+ * bit mask of their indexes. Returns false if a name is unknown.
+ */
+static bool compile_names(json_t *condition, const char *names[],
+		unsigned int n_names, guint32 *mask)
+{
+	json_t *value;
+	unsigned int i, index;
+
+	if (json_is_string(condition)) {
+		index = find_name(names, n_names, json_string_value(condition));
+		*mask = 1u << index;
+		return index != 0;
+	}
+
+	if (!json_is_array(condition))
+		return false;
+
+	*mask = 0;
+	for (i = 0; i < json_array_size(condition); i++) {
+		value = json_array_get(condition, i);
+		if (!json_is_string(value))
+			return false;
+
+		index = find_name(names, n_names, json_string_value(value));
+		if (!index)
+			return false;
+
+		*mask |= 1u << index;
+	}
+
+	return true;
+}
+
+/*
+ * Tells whether hour and minute are a time of day, "24:00" being midnight
+ */
+static bool is_valid_time(unsigned int hour, unsigned int minute)
+{
+	if (hour == 24)
+		return minute == 0;
+
+	return hour < 24 && minute < 60;
+}
+
+/*
+ * Parses a time window like "08:00-18:00"
+ */
+static bool compile_window(json_t *condition, struct rule *rule)
+{
+	unsigned int from_hour, from_minute, to_hour, to_minute;
+	int end = 0;
+
+	if (!json_is_string(condition))
+		return false;
+
+	if (sscanf(json_string_value(condition), "%2u:%2u-%2u:%2u%n",
+			&from_hour, &from_minute, &to_hour, &to_minute,
+			&end) != 4 || json_string_value(condition)[end])
+		return false;
+
+	if (!is_valid_time(from_hour, from_minute) ||
+			!is_valid_time(to_hour, to_minute))
+		return false;
+
+	rule->from = (from_hour * 60 + from_minute) % MINUTES_PER_DAY;
+	rule->to = (to_hour * 60 + to_minute) % MINUTES_PER_DAY;
+
+	/* An empty window would never hold, a full one always */
+	return rule->from != rule->to;
+}
+
+static bool compile_rule(json_t *object, struct rule *rule,
+		unsigned int *inputs)
+{
+	json_t *when, *condition, *set;
+
+	rule->states = ANY;
+	rule->bearers = ANY;
+	rule->from = rule->to = -1;
+
+	if (!json_is_object(object))
+		return false;
+
+	set = json_object_get(object, "Set");
+	if (set && !json_is_object(set))
+		return false;
+
+	when = json_object_get(object, "When");
+	if (!when)
+		return true;
+	if (!json_is_object(when))
+		return false;
+
+	condition = json_object_get(when, "State");
+	if (condition) {
+		if (!compile_names(condition, states, G_N_ELEMENTS(states),
+				&rule->states))
+			return false;
+		*inputs |= POLD_RULES_STATE;
+	}
+
+	condition = json_object_get(when, "Bearer");
+	if (condition) {
+		if (!compile_names(condition, bearers, G_N_ELEMENTS(bearers),
+				&rule->bearers))
+			return false;
+		*inputs |= POLD_RULES_BEARER;
+	}
+
+	condition = json_object_get(when, "Time");
+	if (condition) {
+		if (!compile_window(condition, rule))
+			return false;
+		*inputs |= POLD_RULES_TIME;
+	}
+
+	return true;
+}
+
+struct pold_rules *pold_rules_compile(json_t *array)
+{
+	struct pold_rules *rules;
+	unsigned int i, n_rules;
+
+	if (!json_is_array(array))
+		return NULL;
+
+	n_rules = json_array_size(array);
+	rules = g_malloc0(sizeof(*rules) + n_rules * sizeof(struct rule));
+	rules->n_rules = n_rules;
+
+	for (i = 0; i < n_rules; i++) {
+		if (!compile_rule(json_array_get(array, i), &rules->rules[i],
+				&rules->inputs)) {
+			g_free(rules);
+			return NULL;
+		}
+	}
+
+	return rules;
+}
+
+void pold_rules_free(struct pold_rules *rules)
+{
+	g_free(rules);
+}
+
+unsigned int pold_rules_size(const struct pold_rules *rules)
+{
+	return rules->n_rules;
+}
+
+unsigned int pold_rules_inputs(const struct pold_rules *rules)
+{
+	return rules->inputs;
+}
+
+static inline bool in_window(const struct rule *rule, unsigned int minute)
+{
+	if (rule->from < rule->to)
+		return minute >= (unsigned int) rule->from &&
+				minute < (unsigned int) rule->to;
+
+	return minute >= (unsigned int) rule->from ||
+			minute < (unsigned int) rule->to;
+}
+
+unsigned int pold_rules_evaluate(const struct pold_rules *rules,
+		guint32 context)
+{
+	const struct rule *rule;
+	guint32 state, bearer;
+	unsigned int i, minute;
+
+	state = 1u << ((context >> STATE_SHIFT) & STATE_MASK);
+	bearer = 1u << ((context >> BEARER_SHIFT) & BEARER_MASK);
+	minute = context & MINUTE_MASK;
+
+	for (i = 0; i < rules->n_rules; i++) {
+		rule = &rules->rules[i];
+
+		if (!(rule->states & state) || !(rule->bearers & bearer))
+			continue;
+
+		if (rule->from >= 0 && !in_window(rule, minute))
+			continue;
+
+		return i;
+	}
+
+	return rules->n_rules;
+}
+
+static unsigned int minutes_until(unsigned int minute, int boundary)
+{
+	unsigned int minutes;
+
+	minutes = (boundary + MINUTES_PER_DAY - minute) % MINUTES_PER_DAY;
+
+	return minutes ? minutes : MINUTES_PER_DAY;
+}
+
+unsigned int pold_rules_next_change(const struct pold_rules *rules,
+		unsigned int minute)
+{
+	const struct rule *rule;
+	unsigned int i, next = 0, minutes;
+
+	for (i = 0; i < rules->n_rules; i++) {
+		rule = &rules->rules[i];
+		if (rule->from < 0)
+			continue;
+
+		minutes = MIN(minutes_until(minute, rule->from),
+				minutes_until(minute, rule->to));
+		if (!next || minutes < next)
+			next = minutes;
+	}
+
+	return next;
+}
@@ -0,0 +1,102 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef RULES_H
+#define RULES_H
+
+#include <glib.h>
+#include <jansson.h>
+
+/*
+ * Rules make a policy depend on the runtime context. The "Rules" member of
+ * a policy is an array of rules like
+ *
+ *   { "When": { "State": "online", "Bearer": [ "ethernet", "wifi" ],
+ *               "Time": "08:00-18:00" },
+ *     "Set": { ... } }
+ *
+ * All conditions of "When" have to hold, a missing one always holds. The
+ * first rule whose conditions hold applies its "Set" to the policy.
+ *
+ * Rules are compiled into a list of bit masks, so evaluating them takes a
+ * few instructions per rule and no allocation. Compiled rules are never
+ * modified and may be evaluated from any thread.
+ */
+struct pold_rules;
+
+/*
+ * The inputs of the context, used as bit mask
+ */
+enum pold_rules_input {
+	/* The State of the ConnMan session */
+	POLD_RULES_STATE = 1 << 0,
+
+	/* The type of the service the ConnMan session uses */
+	POLD_RULES_BEARER = 1 << 1,
+
+	/* The local time of day in minutes */
+	POLD_RULES_TIME = 1 << 2,
+};
+
+/*
+ * The context is packed into 32 bits, so that it can be read and replaced
+ * atomically. Unknown states and bearers match no condition.
+ */
+guint32 pold_rules_context_set_state(guint32 context, const char *state);
+
+guint32 pold_rules_context_set_bearer(guint32 context, const char *bearer);
+
+guint32 pold_rules_context_set_minute(guint32 context, unsigned int minute);
+
+/*
+ * Returns the inputs which differ between the contexts
+ */
+unsigned int pold_rules_context_diff(guint32 a, guint32 b);
+
+/*
+ * Compiles a "Rules" array, returns NULL if it is invalid
+ */
+struct pold_rules *pold_rules_compile(json_t *rules);
+
+void pold_rules_free(struct pold_rules *rules);
+
+unsigned int pold_rules_size(const struct pold_rules *rules);
+
+/*
+ * Returns the inputs the rules depend on
+ */
+unsigned int pold_rules_inputs(const struct pold_rules *rules);
+
+/*
+ * Returns the index of the first rule which holds in the context, the
+ * number of rules if none holds
+ */
+unsigned int pold_rules_evaluate(const struct pold_rules *rules,
+		guint32 context);
+
+/*
+ * Returns the minutes from the given minute of the day until a time window
+ * of the rules opens or closes, 0 if the rules have no time windows
+ */
+unsigned int pold_rules_next_change(const struct pold_rules *rules,
+		unsigned int minute);
+
+#endif
@@ -19,12 +19,20 @@
  *
  */
 
+#include <stdbool.h>
 #include <glib.h>
 #include <dbus/dbus.h>
 #include "gdbus.h"
 #include "connman-manager.h"
 #include "dbus.h"
 #include "session.h"
+#include "policy.h"
+#include "http-client.h"
+
+/*
+ * ConnMan is local and answers immediately unless it hangs
+ */
+#define CREATE_SESSION_TIMEOUT_IN_MILLISECONDS 5000
 
 static DBusConnection *connection;
 
@@ -34,13 +42,15 @@ static char *session_path;
 
 struct session_settings {
 	char *state;
+	char *bearer;
 };
 
 static struct session_settings settings;
 
 static void connman_appeared(DBusConnection *conn, void *user_data)
 {
-	pold_connman_manager_create_session();
+	pold_connman_manager_create_session(
+			CREATE_SESSION_TIMEOUT_IN_MILLISECONDS);
 }
 
 static void connman_disappeared(DBusConnection *conn,
@@ -54,10 +64,41 @@ void pold_session_set_path(const char *path)
 	session_path = g_strdup(path);
 }
 
+static bool is_connected(const char *state)
+{
+	return g_strcmp0(state, "connected") == 0 ||
+			g_strcmp0(state, "online") == 0;
+}
+
 void pold_session_set_state(const char *state)
 {
+	bool came_up;
+
+	came_up = is_connected(state) && !is_connected(settings.state);
+
 	g_free(settings.state);
 	settings.state = g_strdup(state);
+
+	pold_policy_set_session_state(state);
+
+	if (came_up)
+		pold_http_client_network_changed();
+}
+
+void pold_session_set_bearer(const char *bearer)
+{
+	bool changed;
+
+	changed = g_strcmp0(bearer, settings.bearer) != 0;
+
+	g_free(settings.bearer);
+	settings.bearer = g_strdup(bearer);
+
+	pold_policy_set_session_bearer(bearer);
+
+	/* The connections of the previous bearer are likely gone */
+	if (changed && is_connected(settings.state))
+		pold_http_client_network_changed();
 }
 
 void pold_session_init(DBusConnection *conn)
@@ -66,10 +107,12 @@ void pold_session_init(DBusConnection *conn)
 	watch_id = g_dbus_add_service_watch(conn, CONNMAN_BUS_NAME,
 			connman_appeared, connman_disappeared, NULL, NULL);
 	settings.state = NULL;
+	settings.bearer = NULL;
 }
 
 void pold_session_final(void)
 {
 	g_free(settings.state);
+	g_free(settings.bearer);
 	g_dbus_remove_watch(connection, watch_id);
 }
@@ -26,6 +26,8 @@ void pold_session_set_path(const char *path);
 
 void pold_session_set_state(const char *state);
 
+void pold_session_set_bearer(const char *bearer);
+
 void pold_session_init(DBusConnection *conn);
 
 void pold_session_final(void);
@@ -0,0 +1,93 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include "stats.h"
+
+struct pold_stats pold_stats;
+
+/*
+ * The statistics at the time of the last snapshot
+ */
+static struct pold_stats last_snapshot;
+
+static const char *counter_names[POLD_STATS_COUNTERS] = {
+	[POLD_STATS_REQUESTS] = "Requests",
+	[POLD_STATS_CACHE_HITS] = "CacheHits",
+	[POLD_STATS_CACHE_MISSES] = "CacheMisses",
+	[POLD_STATS_REFRESHES] = "Refreshes",
+	[POLD_STATS_REFRESHES_FAILED] = "RefreshesFailed",
+	[POLD_STATS_AGENT_UPDATES_SENT] = "AgentUpdatesSent",
+	[POLD_STATS_AGENT_UPDATES_FAILED] = "AgentUpdatesFailed",
+	[POLD_STATS_COALESCED_REQUESTS] = "CoalescedRequests",
+	[POLD_STATS_PREFETCHES] = "Prefetches",
+	[POLD_STATS_CREDENTIAL_CACHE_HITS] = "CredentialCacheHits",
+	[POLD_STATS_CREDENTIAL_CACHE_MISSES] = "CredentialCacheMisses",
+	[POLD_STATS_BREAKERS_OPENED] = "BreakersOpened",
+	[POLD_STATS_BREAKERS_CLOSED] = "BreakersClosed",
+	[POLD_STATS_REFRESHES_SKIPPED] = "RefreshesSkipped",
+	[POLD_STATS_CHANGE_EVENTS] = "ChangeEvents",
+};
+
+static const char *gauge_names[POLD_STATS_GAUGES] = {
+	[POLD_STATS_WATCHED_APPS] = "WatchedApps",
+	[POLD_STATS_AGENTS] = "Agents",
+	[POLD_STATS_POLICIES] = "Policies",
+	[POLD_STATS_CREDENTIALS] = "PrefetchedCredentials",
+	[POLD_STATS_OPEN_BREAKERS] = "OpenBreakers",
+};
+
+static const char *histogram_names[POLD_STATS_HISTOGRAMS] = {
+	[POLD_STATS_REFRESH_DURATION] = "RefreshDuration",
+	[POLD_STATS_REFRESH_BYTES] = "RefreshBytes",
+	[POLD_STATS_REFRESH_WIRE_BYTES] = "RefreshWireBytes",
+};
+
+const char *pold_stats_counter_name(enum pold_stats_counter counter)
+{
+	return counter_names[counter];
+}
+
+const char *pold_stats_gauge_name(enum pold_stats_gauge gauge)
+{
+	return gauge_names[gauge];
+}
+
+const char *pold_stats_histogram_name(enum pold_stats_histogram histogram)
+{
+	return histogram_names[histogram];
+}
+
+bool pold_stats_snapshot(struct pold_stats *snapshot)
+{
+	bool changed;
+
+	changed = memcmp(&last_snapshot, &pold_stats, sizeof(pold_stats)) != 0;
+	if (changed)
+		memcpy(&last_snapshot, &pold_stats, sizeof(pold_stats));
+
+	memcpy(snapshot, &last_snapshot, sizeof(last_snapshot));
+
+	return changed;
+}
@@ -0,0 +1,111 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <glib.h>
+#include "histogram.h"
+
+/*
+ * Runtime statistics of pold. All updates happen in the main loop, so they
+ * are plain increments and stores. Readers take a snapshot via
+ * pold_stats_snapshot().
+ */
+
+enum pold_stats_counter {
+	POLD_STATS_REQUESTS,
+	POLD_STATS_CACHE_HITS,
+	POLD_STATS_CACHE_MISSES,
+	POLD_STATS_REFRESHES,
+	POLD_STATS_REFRESHES_FAILED,
+	POLD_STATS_AGENT_UPDATES_SENT,
+	POLD_STATS_AGENT_UPDATES_FAILED,
+	POLD_STATS_COALESCED_REQUESTS,
+	POLD_STATS_PREFETCHES,
+	POLD_STATS_CREDENTIAL_CACHE_HITS,
+	POLD_STATS_CREDENTIAL_CACHE_MISSES,
+	POLD_STATS_BREAKERS_OPENED,
+	POLD_STATS_BREAKERS_CLOSED,
+	POLD_STATS_REFRESHES_SKIPPED,
+	POLD_STATS_CHANGE_EVENTS,
+	POLD_STATS_COUNTERS
+};
+
+enum pold_stats_gauge {
+	POLD_STATS_WATCHED_APPS,
+	POLD_STATS_AGENTS,
+	POLD_STATS_POLICIES,
+	POLD_STATS_CREDENTIALS,
+	POLD_STATS_OPEN_BREAKERS,
+	POLD_STATS_GAUGES
+};
+
+enum pold_stats_histogram {
+	/* Duration of a policy update from the server in microseconds */
+	POLD_STATS_REFRESH_DURATION,
+	/* Size of the policies received from the server in bytes */
+	POLD_STATS_REFRESH_BYTES,
+	/* The same before decoding, as transferred */
+	POLD_STATS_REFRESH_WIRE_BYTES,
+	POLD_STATS_HISTOGRAMS
+};
+
+struct pold_stats {
+	guint64 counters[POLD_STATS_COUNTERS];
+	guint64 gauges[POLD_STATS_GAUGES];
+	struct pold_histogram histograms[POLD_STATS_HISTOGRAMS];
+};
+
+extern struct pold_stats pold_stats;
+
+static inline void pold_stats_inc(enum pold_stats_counter counter)
+{
+	pold_stats.counters[counter]++;
+}
+
+static inline void pold_stats_set(enum pold_stats_gauge gauge, guint64 value)
+{
+	pold_stats.gauges[gauge] = value;
+}
+
+static inline void pold_stats_add(enum pold_stats_histogram histogram,
+		guint64 value)
+{
+	pold_histogram_add(&pold_stats.histograms[histogram], value);
+}
+
+const char *pold_stats_counter_name(enum pold_stats_counter counter);
+
+const char *pold_stats_gauge_name(enum pold_stats_gauge gauge);
+
+const char *pold_stats_histogram_name(enum pold_stats_histogram histogram);
+
+/*
+ * Copies the current statistics. Returns true if the snapshot differs from
+ * the previous one taken, so that callers can keep derived data, e.g. a
+ * marshalled reply, as long as nothing changed.
+ */
+bool pold_stats_snapshot(struct pold_stats *snapshot);
+
+#endif
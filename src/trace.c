@@ -0,0 +1,124 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include "log.h"
+#include "trace.h"
+
+#define RECORDS_MASK (POLD_TRACE_RECORDS - 1)
+
+static struct pold_trace_record records[POLD_TRACE_RECORDS];
+
+/*
+ * Position of the next record. Incremented atomically, so that events may
+ * be recorded from any thread. A record which is overwritten while being
+ * dumped may appear torn in the dump.
+ */
+static gint next_record;
+
+static const char *event_names[POLD_TRACE_EVENTS] = {
+	[POLD_TRACE_REQUEST_RECEIVED] = "request-received",
+	[POLD_TRACE_CREDENTIALS_RESOLVED] = "credentials-resolved",
+	[POLD_TRACE_POLICY_CHOSEN] = "policy-chosen",
+	[POLD_TRACE_REPLY_SENT] = "reply-sent",
+	[POLD_TRACE_AGENT_UPDATE_SENT] = "agent-update-sent",
+	[POLD_TRACE_REFRESH_STARTED] = "refresh-started",
+	[POLD_TRACE_REFRESH_FINISHED] = "refresh-finished",
+};
+
+void pold_trace(enum pold_trace_event event, guint32 id, guint64 arg,
+		const char *name)
+{
+	struct pold_trace_record *record;
+	guint index;
+
+	index = (guint) g_atomic_int_add(&next_record, 1) & RECORDS_MASK;
+	record = &records[index];
+
+	record->timestamp = g_get_monotonic_time();
+	record->event = event;
+	record->id = id;
+	record->arg = arg;
+
+	if (name)
+		strncpy(record->name, name, POLD_TRACE_NAME_SIZE);
+	else
+		record->name[0] = '\0';
+}
+
+bool pold_trace_dump(const char *path)
+{
+	struct pold_trace_header header;
+	struct pold_trace_record *record;
+	GByteArray *dump;
+	GError *error = NULL;
+	guint next, i;
+	bool ret;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, POLD_TRACE_MAGIC, sizeof(header.magic));
+	header.record_size = sizeof(struct pold_trace_record);
+	header.monotonic_time = g_get_monotonic_time();
+	header.real_time = g_get_real_time();
+
+	dump = g_byte_array_sized_new(sizeof(header) + sizeof(records));
+	g_byte_array_append(dump, (guint8 *) &header, sizeof(header));
+
+	next = g_atomic_int_get(&next_record);
+
+	for (i = 0; i < POLD_TRACE_RECORDS; i++) {
+		record = &records[(next + i) & RECORDS_MASK];
+
+		/* Not yet used since startup */
+		if (!record->timestamp)
+			continue;
+
+		g_byte_array_append(dump, (guint8 *) record, sizeof(*record));
+		header.records++;
+	}
+
+	memcpy(dump->data, &header, sizeof(header));
+
+	ret = g_file_set_contents(path, (char *) dump->data, dump->len,
+			&error);
+	if (!ret) {
+		pold_log_error("Writing trace to %s failed: %s", path,
+				error->message);
+		g_error_free(error);
+	} else {
+		pold_log_info("Wrote %u trace records to %s", header.records,
+				path);
+	}
+
+	g_byte_array_free(dump, TRUE);
+
+	return ret;
+}
+
+const char *pold_trace_event_name(guint32 event)
+{
+	if (event >= POLD_TRACE_EVENTS)
+		return "unknown";
+
+	return event_names[event];
+}
@@ -0,0 +1,92 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+/*
+ * The flight recorder keeps the last POLD_TRACE_RECORDS events in a ring of
+ * fixed size binary records. Recording an event takes a timestamp and a few
+ * stores, so it is always enabled. The ring is written to a file on SIGUSR1
+ * or Manager1.DumpTrace and decoded offline by pold-trace.
+ */
+#define POLD_TRACE_RECORDS 4096
+
+#define POLD_TRACE_FILE STORAGEDIR "/pold.trace"
+
+#define POLD_TRACE_MAGIC "POLDTRC1"
+
+/*
+ * Owner names and policy ids are truncated to this size and not
+ * necessarily NUL-terminated
+ */
+#define POLD_TRACE_NAME_SIZE 24
+
+enum pold_trace_event {
+	/* id: request, name: app owner */
+	POLD_TRACE_REQUEST_RECEIVED,
+	/* id: request, arg: uid, name: SELinux type if any */
+	POLD_TRACE_CREDENTIALS_RESOLVED,
+	/* id: request, name: policy id */
+	POLD_TRACE_POLICY_CHOSEN,
+	/* id: request, arg: microseconds since received, name: agent owner */
+	POLD_TRACE_REPLY_SENT,
+	/* arg: retries, name: app owner */
+	POLD_TRACE_AGENT_UPDATE_SENT,
+	POLD_TRACE_REFRESH_STARTED,
+	/* id: HTTP status, arg: response size in bytes */
+	POLD_TRACE_REFRESH_FINISHED,
+	POLD_TRACE_EVENTS
+};
+
+struct pold_trace_record {
+	/* Monotonic time in microseconds */
+	guint64 timestamp;
+	guint32 event;
+	guint32 id;
+	guint64 arg;
+	char name[POLD_TRACE_NAME_SIZE];
+};
+
+/*
+ * A dump consists of this header followed by the recorded events, oldest
+ * first, in host byte order
+ */
+struct pold_trace_header {
+	char magic[8];
+	guint32 record_size;
+	guint32 records;
+	/* Monotonic and wall clock time of the dump in microseconds */
+	guint64 monotonic_time;
+	guint64 real_time;
+};
+
+void pold_trace(enum pold_trace_event event, guint32 id, guint64 arg,
+		const char *name);
+
+bool pold_trace_dump(const char *path);
+
+const char *pold_trace_event_name(guint32 event);
+
+#endif
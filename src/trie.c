@@ -0,0 +1,231 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include "trie.h"
+
+struct trie_pattern {
+	char *suffix;
+	size_t suffix_length;
+
+	gpointer value;
+};
+
+/*
+ * Nodes refer to each other by their index in the node array, 0 is the
+ * root and therefore never a child or sibling
+ */
+struct trie_node {
+	unsigned int child;
+	unsigned int sibling;
+
+	char c;
+
+	/* The trie_patterns whose part before the '*' ends here */
+	GPtrArray *patterns;
+};
+
+struct pold_trie {
+	GArray *nodes;
+
+	unsigned int size;
+};
+
+static inline struct trie_node *get_node(const struct pold_trie *trie,
+		unsigned int index)
+{
+	return &g_array_index(trie->nodes, struct trie_node, index);
+}
+
+static void free_pattern(gpointer pointer)
+{
+	struct trie_pattern *pattern = pointer;
+
+	g_free(pattern->suffix);
+	g_free(pattern);
+}
+
+struct pold_trie *pold_trie_new(void)
+{
+	struct pold_trie *trie;
+	struct trie_node root = { 0 };
+
+	trie = g_new0(struct pold_trie, 1);
+	trie->nodes = g_array_new(FALSE, TRUE, sizeof(struct trie_node));
+	g_array_append_val(trie->nodes, root);
+
+	return trie;
+}
+
+void pold_trie_free(struct pold_trie *trie)
+{
+	struct trie_node *node;
+	unsigned int i;
+
+	if (!trie)
+		return;
+
+	for (i = 0; i < trie->nodes->len; i++) {
+		node = get_node(trie, i);
+		if (node->patterns)
+			g_ptr_array_free(node->patterns, TRUE);
+	}
+
+	g_array_free(trie->nodes, TRUE);
+	g_free(trie);
+}
+
+bool pold_trie_is_pattern(const char *pattern)
+{
+	const char *star;
+
+	star = strchr(pattern, '*');
+
+	return star && !strchr(star + 1, '*');
+}
+
+static unsigned int find_child(const struct pold_trie *trie,
+		unsigned int index, char c)
+{
+	unsigned int child;
+
+	for (child = get_node(trie, index)->child; child;
+			child = get_node(trie, child)->sibling) {
+		if (get_node(trie, child)->c == c)
+			return child;
+	}
+
+	return 0;
+}
+
+static unsigned int add_child(struct pold_trie *trie, unsigned int index,
+		char c)
+{
+	struct trie_node child = { 0 };
+	unsigned int child_index;
+
+	child.c = c;
+	child.sibling = get_node(trie, index)->child;
+
+	child_index = trie->nodes->len;
+	g_array_append_val(trie->nodes, child);
+
+	/* Appending may have moved the array, look up the parent again */
+	get_node(trie, index)->child = child_index;
+
+	return child_index;
+}
+
+bool pold_trie_insert(struct pold_trie *trie, const char *pattern,
+		gpointer value)
+{
+	struct trie_pattern *new, *old;
+	struct trie_node *node;
+	unsigned int index = 0, child, i;
+	const char *c;
+
+	if (!pold_trie_is_pattern(pattern))
+		return false;
+
+	for (c = pattern; *c != '*'; c++) {
+		child = find_child(trie, index, *c);
+		if (!child)
+			child = add_child(trie, index, *c);
+
+		index = child;
+	}
+
+	node = get_node(trie, index);
+	if (!node->patterns)
+		node->patterns = g_ptr_array_new_with_free_func(free_pattern);
+
+	for (i = 0; i < node->patterns->len; i++) {
+		old = g_ptr_array_index(node->patterns, i);
+
+		if (g_strcmp0(old->suffix, c + 1) == 0) {
+			old->value = value;
+			return true;
+		}
+	}
+
+	new = g_new0(struct trie_pattern, 1);
+	new->suffix = g_strdup(c + 1);
+	new->suffix_length = strlen(new->suffix);
+	new->value = value;
+
+	g_ptr_array_add(node->patterns, new);
+	trie->size++;
+
+	return true;
+}
+
+gpointer pold_trie_match(const struct pold_trie *trie, const char *name)
+{
+	struct trie_pattern *pattern;
+	struct trie_node *node;
+	gpointer best = NULL;
+	size_t length, depth, literal, best_literal = 0;
+	unsigned int index = 0, i;
+
+	if (!trie->size)
+		return NULL;
+
+	length = strlen(name);
+
+	for (depth = 0; ; depth++) {
+		node = get_node(trie, index);
+
+		for (i = 0; node->patterns && i < node->patterns->len; i++) {
+			pattern = g_ptr_array_index(node->patterns, i);
+
+			if (length - depth < pattern->suffix_length)
+				continue;
+
+			if (memcmp(name + length - pattern->suffix_length,
+					pattern->suffix,
+					pattern->suffix_length) != 0)
+				continue;
+
+			/* Deeper nodes win ties, they have more before '*' */
+			literal = depth + pattern->suffix_length;
+			if (!best || literal >= best_literal) {
+				best = pattern->value;
+				best_literal = literal;
+			}
+		}
+
+		if (depth == length)
+			break;
+
+		index = find_child(trie, index, name[depth]);
+		if (!index)
+			break;
+	}
+
+	return best;
+}
+
+unsigned int pold_trie_size(const struct pold_trie *trie)
+{
+	return trie->size;
+}
@@ -0,0 +1,62 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef TRIE_H
+#define TRIE_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+/*
+ * A trie of glob patterns with exactly one '*', which matches any sequence
+ * of characters, e.g. "selinux:*_app_t" or "user:svc-*". The patterns are
+ * stored by the literal part before the '*', so matching a name takes one
+ * walk along it plus a suffix comparison per pattern on the way.
+ *
+ * If several patterns match, the one with the most literal characters
+ * wins, among those the one with the longest part before the '*'.
+ *
+ * A trie is not modified by matching, so it may be matched from several
+ * threads once it is filled.
+ */
+struct pold_trie;
+
+struct pold_trie *pold_trie_new(void);
+
+void pold_trie_free(struct pold_trie *trie);
+
+bool pold_trie_is_pattern(const char *pattern);
+
+/*
+ * Adds a pattern, replacing the value of an equal pattern. Returns false if
+ * the pattern does not contain exactly one '*'.
+ */
+bool pold_trie_insert(struct pold_trie *trie, const char *pattern,
+		gpointer value);
+
+/*
+ * Returns the value of the best matching pattern, NULL if none matches
+ */
+gpointer pold_trie_match(const struct pold_trie *trie, const char *name);
+
+unsigned int pold_trie_size(const struct pold_trie *trie);
+
+#endif
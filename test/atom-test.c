@@ -0,0 +1,89 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <glib.h>
+#include "../src/atom.h"
+
+static void test_intern(void)
+{
+	const char *a, *b;
+	char buffer[] = "user:foo";
+
+	a = pold_atom_intern("user:foo");
+	b = pold_atom_intern(buffer);
+
+	g_assert(a == b);
+	g_assert(a != buffer);
+	g_assert(g_strcmp0(a, "user:foo") == 0);
+	g_assert(pold_atom_lookup("user:foo") == a);
+	g_assert(pold_atom_intern(NULL) == NULL);
+
+	pold_atom_unref(a);
+	pold_atom_unref(b);
+}
+
+static void test_printf(void)
+{
+	const char *a, *b;
+
+	a = pold_atom_intern("group:bar");
+	b = pold_atom_printf("group:%s", "bar");
+
+	g_assert(a == b);
+
+	pold_atom_unref(a);
+	pold_atom_unref(b);
+}
+
+/*
+ * An atom lives as long as it is referenced and is freed afterwards
+ */
+static void test_refcount(void)
+{
+	const char *a;
+	unsigned int count;
+
+	count = pold_atom_count();
+
+	a = pold_atom_intern("selinux:baz");
+	g_assert(pold_atom_count() == count + 1);
+
+	pold_atom_ref(a);
+	pold_atom_unref(a);
+	g_assert(pold_atom_lookup("selinux:baz") == a);
+
+	pold_atom_unref(a);
+	g_assert(pold_atom_lookup("selinux:baz") == NULL);
+	g_assert(pold_atom_count() == count);
+
+	pold_atom_unref(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/atom/intern", test_intern);
+	g_test_add_func("/atom/printf", test_printf);
+	g_test_add_func("/atom/refcount", test_refcount);
+
+	return g_test_run();
+}
@@ -0,0 +1,96 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <glib.h>
+#include "../src/histogram.h"
+
+static void test_empty(void)
+{
+	struct pold_histogram histogram;
+
+	pold_histogram_reset(&histogram);
+
+	g_assert(histogram.count == 0);
+	g_assert(pold_histogram_percentile(&histogram, 0.5) == 0);
+}
+
+static void test_small_values(void)
+{
+	struct pold_histogram histogram;
+	guint64 i;
+
+	pold_histogram_reset(&histogram);
+
+	for (i = 0; i < 4; i++)
+		pold_histogram_add(&histogram, i);
+
+	g_assert(histogram.count == 4);
+	g_assert(histogram.sum == 6);
+	g_assert(histogram.max == 3);
+	g_assert(pold_histogram_percentile(&histogram, 0.25) == 0);
+	g_assert(pold_histogram_percentile(&histogram, 0.5) == 1);
+	g_assert(pold_histogram_percentile(&histogram, 1.0) == 3);
+}
+
+/*
+ * The percentile must never be below the exact value and at most 25% above.
+ */
+static void test_percentile_error(void)
+{
+	struct pold_histogram histogram;
+	guint64 value, p50, p99;
+
+	pold_histogram_reset(&histogram);
+
+	for (value = 1; value <= 100000; value++)
+		pold_histogram_add(&histogram, value);
+
+	p50 = pold_histogram_percentile(&histogram, 0.5);
+	p99 = pold_histogram_percentile(&histogram, 0.99);
+
+	g_assert(p50 >= 50000);
+	g_assert(p50 <= 62500);
+	g_assert(p99 >= 99000);
+	g_assert(p99 <= 100000);
+}
+
+static void test_large_values(void)
+{
+	struct pold_histogram histogram;
+
+	pold_histogram_reset(&histogram);
+
+	pold_histogram_add(&histogram, G_MAXUINT64);
+
+	g_assert(pold_histogram_percentile(&histogram, 0.5) == G_MAXUINT64);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/histogram/empty", test_empty);
+	g_test_add_func("/histogram/small_values", test_small_values);
+	g_test_add_func("/histogram/percentile_error", test_percentile_error);
+	g_test_add_func("/histogram/large_values", test_large_values);
+
+	return g_test_run();
+}
@@ -20,49 +20,481 @@
  */
 
 #include <stdbool.h>
+#include <unistd.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include "../src/http-client.c"
 
-static void test_join_list(void)
+static void test_load_sources(void)
 {
-	GSList *list = NULL;
-	char *foo;
-	char *bar;
-	char *joined;
+	const char config[] =
+		"[central]\n"
+		"Url=http://127.0.0.1:9000/update_policies\n"
+		"Username=someuser\n"
+		"Password=password\n"
+		"\n"
+		"[local]\n"
+		"Directory=/etc/pold/policies.d\n"
+		"Precedence=20\n"
+		"Interval=60\n"
+		"\n"
+		"[backup]\n"
+		"Url=http://127.0.0.1:9001/update_policies\n";
+	struct policy_source *source;
+	char *filename;
+	int fd;
 
-	foo = g_strdup("foo");
-	bar = g_strdup("bar");
+	fd = g_file_open_tmp("pold_sources_XXXXXX", &filename, NULL);
+	g_assert(fd >= 0);
+	close(fd);
 
-	list = g_slist_append(list, foo);
-	list = g_slist_append(list, bar);
-	list = g_slist_append(list, bar);
-	list = g_slist_append(list, foo);
+	g_assert(g_file_set_contents(filename, config, -1, NULL));
+	g_assert(load_sources(filename));
+	g_assert(g_slist_length(sources) == 3);
 
-	joined = join_list(list);
+	/* Highest precedence first, ties in the order of the file */
+	source = g_slist_nth_data(sources, 0);
+	g_assert(g_strcmp0(source->name, "local") == 0);
+	g_assert(g_strcmp0(source->directory, "/etc/pold/policies.d") == 0);
+	g_assert(source->interval == 60);
+	source = g_slist_nth_data(sources, 1);
+	g_assert(g_strcmp0(source->name, "central") == 0);
+	g_assert(g_strcmp0(source->username, "someuser") == 0);
+	g_assert(source->interval == DEFAULT_INTERVAL_IN_SECONDS);
+	source = g_slist_nth_data(sources, 2);
+	g_assert(g_strcmp0(source->name, "backup") == 0);
+	g_assert(!source->username);
 
-	g_assert(g_strcmp0(joined, "foobarbarfoo") == 0);
+	pold_http_client_final();
 
-	g_free(bar);
-	g_free(foo);
-	g_slist_free(list);
-	g_free(joined);
+	g_assert(g_file_set_contents(filename, "[broken]\nPrecedence=1\n",
+			-1, NULL));
+	g_assert(!load_sources(filename));
+	pold_http_client_final();
+
+	g_assert(g_file_set_contents(filename, "", -1, NULL));
+	g_assert(!load_sources(filename));
+	pold_http_client_final();
+
+	g_unlink(filename);
+	g_free(filename);
+}
+
+static struct policy_source *add_source(const char *name, int precedence,
+		const char *policies)
+{
+	struct policy_source *source;
+
+	source = g_new0(struct policy_source, 1);
+	source->name = g_strdup(name);
+	source->precedence = precedence;
+	if (policies)
+		source->policies = json_loads(policies, 0, NULL);
+
+	sources = g_slist_sort(g_slist_append(sources, source),
+			compare_precedence);
+
+	return source;
 }
 
-static void test_soup_buffer_to_string(void)
+static void test_merge_sources(void)
+{
+	json_t *root, *policy;
+	char *json;
+
+	add_source("low", 0, "[{\"Id\": \"user:a\", \"From\": \"low\"}, "
+			"{\"Id\": \"user:b\"}]");
+	add_source("high", 10, "[{\"Id\": \"user:a\", \"From\": \"high\"}, "
+			"{\"Foo\": 1}]");
+	add_source("dead", 20, NULL);
+
+	json = merge_sources();
+	root = json_loads(json, 0, NULL);
+
+	g_assert(json_array_size(root) == 2);
+	policy = json_array_get(root, 0);
+	g_assert(g_strcmp0(json_string_value(json_object_get(policy, "Id")),
+			"user:a") == 0);
+	g_assert(g_strcmp0(json_string_value(json_object_get(policy, "From")),
+			"high") == 0);
+
+	json_decref(root);
+	g_free(json);
+	pold_http_client_final();
+}
+
+static int deliveries;
+static bool delivered_policies;
+static bool delivered_done;
+
+static void round_cb(const char *policies_json, bool done, void *data)
+{
+	deliveries++;
+	delivered_policies = policies_json != NULL;
+	delivered_done = done;
+}
+
+static struct update_round *new_round(void)
+{
+	struct update_round *round;
+
+	round = g_new0(struct update_round, 1);
+	round->cb = round_cb;
+	round->pending = g_slist_length(sources);
+	deliveries = 0;
+
+	return round;
+}
+
+static void finish(struct update_round *round, struct policy_source *source,
+		const char *policies)
+{
+	struct fetch_data *fetch;
+
+	fetch = g_new0(struct fetch_data, 1);
+	fetch->round = round;
+	fetch->source = source;
+
+	finish_fetch(fetch, policies ? json_loads(policies, 0, NULL) : NULL);
+}
+
+/*
+ * Policies are handed out as soon as a source brings new ones
+ */
+static void test_deliver_policies(void)
 {
+	struct policy_source *fast, *slow;
+	struct update_round *round;
+
+	fast = add_source("fast", 0, NULL);
+	slow = add_source("slow", 0, NULL);
+
+	round = new_round();
+	finish(round, fast, "[{\"Id\": \"user:a\"}]");
+	g_assert(deliveries == 1 && delivered_policies && !delivered_done);
+	g_assert(fast->refreshed > 0 && fast->failures == 0);
+
+	finish(round, slow, NULL);
+	g_assert(deliveries == 2 && !delivered_policies && delivered_done);
+	g_assert(slow->failures == 1);
+
+	/* Unchanged policies are handed out once to conclude the round */
+	round = new_round();
+	finish(round, fast, "[{\"Id\": \"user:a\"}]");
+	g_assert(deliveries == 0);
+	finish(round, slow, "[]");
+	g_assert(deliveries == 1 && delivered_policies && delivered_done);
+
+	/* A failed source keeps its policies */
+	round = new_round();
+	finish(round, fast, NULL);
+	finish(round, slow, NULL);
+	g_assert(deliveries == 1 && !delivered_policies && delivered_done);
+	g_assert(json_array_size(fast->policies) == 1);
+
+	pold_http_client_final();
+}
+
+static void test_backoff(void)
+{
+	unsigned int i, backoff;
+
+	for (i = 0; i < 100; i++) {
+		backoff = get_backoff(1);
+		g_assert(backoff >= BACKOFF_MIN_IN_MILLISECONDS / 2);
+		g_assert(backoff <= BACKOFF_MIN_IN_MILLISECONDS);
+
+		backoff = get_backoff(4);
+		g_assert(backoff >= BACKOFF_MIN_IN_MILLISECONDS * 4);
+		g_assert(backoff <= BACKOFF_MIN_IN_MILLISECONDS * 8);
+
+		backoff = get_backoff(1000);
+		g_assert(backoff >= BACKOFF_MAX_IN_MILLISECONDS / 2);
+		g_assert(backoff <= BACKOFF_MAX_IN_MILLISECONDS);
+	}
+}
+
+/*
+ * A failed source is left alone until its backoff ran out, then a single
+ * trial fetch decides whether the breaker closes
+ */
+static void test_breaker(void)
+{
+	struct policy_source *source;
+	struct update_round *round;
+	gint64 now;
+
+	source = add_source("flaky", 0, "[]");
+	g_assert(source->breaker == POLD_BREAKER_CLOSED);
+	g_assert(pold_http_client_available());
+
+	round = new_round();
+	finish(round, source, NULL);
+	g_assert(source->breaker == POLD_BREAKER_OPEN);
+	g_assert(source->failures == 1 && source->transitions == 1);
+	g_assert(pold_stats.gauges[POLD_STATS_OPEN_BREAKERS] == 1);
+	g_assert(!pold_http_client_available());
+
+	now = g_get_monotonic_time();
+	g_assert(!may_fetch(source, now));
+
+	/* Once the backoff ran out, only one fetch goes through */
+	g_assert(may_fetch(source, source->retry_at));
+	g_assert(source->breaker == POLD_BREAKER_HALF_OPEN);
+	g_assert(!may_fetch(source, source->retry_at));
+	g_assert(pold_stats.gauges[POLD_STATS_OPEN_BREAKERS] == 0);
+
+	/* A failed trial opens the breaker again with a longer backoff */
+	round = new_round();
+	finish(round, source, NULL);
+	g_assert(source->breaker == POLD_BREAKER_OPEN);
+	g_assert(source->failures == 2);
+	g_assert(source->backoff >= BACKOFF_MIN_IN_MILLISECONDS);
+
+	g_assert(may_fetch(source, source->retry_at));
+	round = new_round();
+	finish(round, source, "[]");
+	g_assert(source->breaker == POLD_BREAKER_CLOSED);
+	g_assert(source->failures == 0 && source->transitions == 5);
+	g_assert(pold_http_client_available());
+
+	pold_http_client_final();
+}
+
+/*
+ * A network change ends the backoffs of open breakers
+ */
+static void test_cut_backoffs(void)
+{
+	struct policy_source *source;
+	struct update_round *round;
+	gint64 now;
+
+	source = add_source("flaky", 0, "[]");
+
+	round = new_round();
+	finish(round, source, NULL);
+	g_assert(source->breaker == POLD_BREAKER_OPEN);
+
+	now = g_get_monotonic_time();
+	g_assert(!may_fetch(source, now));
+
+	cut_backoffs(now);
+	g_assert(source->retry_at == now);
+	g_assert(pold_http_client_available());
+	g_assert(may_fetch(source, now));
+	g_assert(source->breaker == POLD_BREAKER_HALF_OPEN);
+
+	pold_http_client_final();
+}
+
+/*
+ * Only sources whose policies grew older than their interval are due
+ */
+static void test_due(void)
+{
+	struct policy_source *fresh, *stale;
+	struct update_round *round;
+	gint64 now;
+
+	fresh = add_source("fresh", 0, "[]");
+	fresh->interval = 60;
+	stale = add_source("stale", 0, "[]");
+	stale->interval = 60;
+	g_assert(pold_http_client_due());
+
+	round = new_round();
+	finish(round, fresh, "[]");
+	finish(round, stale, "[]");
+	g_assert(!pold_http_client_due());
+	g_assert(!pold_http_client_available());
+
+	/* Nothing is fetched while all policies are fresh */
+	deliveries = 0;
+	pold_http_client_update_policies(round_cb, NULL);
+	g_assert(deliveries == 1 && !delivered_policies && delivered_done);
+
+	now = g_get_monotonic_time();
+	stale->refreshed = now - 60 * G_USEC_PER_SEC;
+	g_assert(!is_due(fresh, now));
+	g_assert(is_due(stale, now));
+	g_assert(pold_http_client_due());
+	g_assert(pold_http_client_available());
+
+	/* Failing sources are still due but may not be fetched */
+	pold_http_client_expire();
+	g_assert(is_due(fresh, now));
+	round = new_round();
+	finish(round, fresh, NULL);
+	finish(round, stale, NULL);
+	g_assert(pold_http_client_due());
+	g_assert(!pold_http_client_available());
+
+	pold_http_client_final();
+}
+
+/*
+ * A source with a fetch on its way is not fetched again, so a failing
+ * burst of updates counts as a single failure
+ */
+static void test_fetching(void)
+{
+	struct policy_source *source;
+	struct update_round *round;
+
+	source = add_source("busy", 0, "[]");
+	source->fetching = true;
+	g_assert(pold_http_client_due());
+	g_assert(!pold_http_client_available());
+
+	deliveries = 0;
+	pold_http_client_update_policies(round_cb, NULL);
+	g_assert(deliveries == 1 && !delivered_policies && delivered_done);
+
+	round = new_round();
+	finish(round, source, NULL);
+	g_assert(!source->fetching);
+	g_assert(source->failures == 1);
+	g_assert(source->breaker == POLD_BREAKER_OPEN);
+
+	pold_http_client_final();
+}
+
+static void test_parse_events(void)
+{
+	GString *buffer = g_string_new(NULL);
+	unsigned int changes = 0;
+	const char *text;
+
+	/* Comments keep the stream alive, other events are ignored */
+	text = ": keep-alive\n\nevent: other\ndata: x\n\n";
+	g_assert(parse_events(buffer, text, strlen(text), &changes) == 2);
+	g_assert(changes == 0);
+	g_assert(buffer->len == 0);
+
+	/* An event split over chunks counts once it is complete */
+	text = "event: policies\r\ndata: someuser";
+	g_assert(parse_events(buffer, text, strlen(text), &changes) == 0);
+	text = ".policies\r\n\r\nevent:policies\n\nevent: pol";
+	g_assert(parse_events(buffer, text, strlen(text), &changes) == 2);
+	g_assert(changes == 2);
+	g_assert(g_strcmp0(buffer->str, "event: pol") == 0);
+
+	text = "icies\n";
+	g_assert(parse_events(buffer, text, strlen(text), &changes) == 0);
+	text = "\n";
+	g_assert(parse_events(buffer, text, strlen(text), &changes) == 1);
+	g_assert(changes == 3);
+	g_assert(buffer->len == 0);
+
+	g_string_free(buffer, TRUE);
+}
+
+static int catch_ups;
+
+static void count_catch_up(void *data)
+{
+	catch_ups++;
+}
+
+/*
+ * A stream which came back only counts as working once something arrives
+ * on it, and it catches up on missed changes at most once per interval
+ */
+static void test_events_established(void)
+{
+	struct policy_source *source;
+	SoupMessage msg;
+	SoupBuffer buf;
+
+	source = add_source("events", 0, NULL);
+	source->events_buffer = g_string_new(NULL);
+	changed_cb = count_catch_up;
+	catch_ups = 0;
+
+	msg.status_code = SOUP_STATUS_OK;
+	buf.data = ": keep-alive\n\n";
+	buf.length = strlen(buf.data);
+
+	/* A lost stream which was not accepted as event stream */
+	source->events_lost = true;
+	source->events_failures = 3;
+	got_events_chunk(&msg, &buf, source);
+	g_assert(source->events_failures == 3 && catch_ups == 0);
+
+	source->events_accepted = true;
+	got_events_chunk(&msg, &buf, source);
+	g_assert(source->events_failures == 0 && catch_ups == 1);
+	g_assert(!source->events_lost);
+
+	/* Lost again right away, so it does not catch up once more */
+	source->events_lost = true;
+	source->events_failures = 1;
+	got_events_chunk(&msg, &buf, source);
+	g_assert(source->events_failures == 0 && catch_ups == 1);
+
+	changed_cb = NULL;
+	pold_http_client_final();
+}
+
+static void feed(struct fetch_data *fetch, const char *data, gsize length,
+		gsize chunk_size)
+{
+	SoupMessage msg;
 	SoupBuffer buf;
-	char *input;
-	char *string;
+	gsize offset;
+
+	msg.status_code = SOUP_STATUS_OK;
+
+	for (offset = 0; offset < length; offset += chunk_size) {
+		buf.data = data + offset;
+		buf.length = MIN(chunk_size, length - offset);
+		got_fetch_chunk(&msg, &buf, fetch);
+	}
+}
+
+/*
+ * Chunks are decoded as they come in, into the body of the fetch
+ */
+static void test_decode_chunks(void)
+{
+	const char policies[] = "[{\"Id\": \"user:a\"}, {\"Id\": \"user:b\"}]";
+	struct policy_source source = { .name = "test" };
+	struct fetch_data fetch = { .source = &source };
+#if (HAVE_ZSTD > 0)
+	char compressed[256];
+	size_t length;
+#endif
+
+	fetch.body = g_string_new(NULL);
+	feed(&fetch, policies, strlen(policies), 5);
+	g_assert(!fetch.broken);
+	g_assert(g_strcmp0(fetch.body->str, policies) == 0);
+	g_assert(fetch.received == strlen(policies));
+	g_string_free(fetch.body, TRUE);
+
+#if (HAVE_ZSTD > 0)
+	length = ZSTD_compress(compressed, sizeof(compressed), policies,
+			strlen(policies), 1);
+	g_assert(!ZSTD_isError(length));
+
+	fetch.body = g_string_new(NULL);
+	fetch.received = 0;
+	fetch.zstd = ZSTD_createDStream();
+	ZSTD_initDStream(fetch.zstd);
 
-	input = g_strdup("abcdefghijklmn");
-	buf.data = input;
-	buf.length = 5;
+	feed(&fetch, compressed, length, 3);
+	g_assert(!fetch.broken);
+	g_assert(g_strcmp0(fetch.body->str, policies) == 0);
+	g_assert(fetch.received == length);
 
-	string = soup_buffer_to_string(&buf);
-	g_assert(g_strcmp0(string, "abcde") == 0);
+	/* Garbage is no zstd frame */
+	feed(&fetch, "garbage", 7, 7);
+	g_assert(fetch.broken);
 
-	g_free(string);
-	g_free(input);
+	ZSTD_freeDStream(fetch.zstd);
+	g_string_free(fetch.body, TRUE);
+#endif
 }
 
 int main(int argc, char *argv[])
@@ -70,9 +502,19 @@ int main(int argc, char *argv[])
 	int error;
 
 	g_test_init(&argc, &argv, NULL);
-	g_test_add_func("/http-client/join_list", test_join_list);
-	g_test_add_func("/http-client/soup_buffer_to_string",
-			test_soup_buffer_to_string);
+	g_test_add_func("/http-client/load_sources", test_load_sources);
+	g_test_add_func("/http-client/merge_sources", test_merge_sources);
+	g_test_add_func("/http-client/deliver_policies",
+			test_deliver_policies);
+	g_test_add_func("/http-client/backoff", test_backoff);
+	g_test_add_func("/http-client/breaker", test_breaker);
+	g_test_add_func("/http-client/cut_backoffs", test_cut_backoffs);
+	g_test_add_func("/http-client/due", test_due);
+	g_test_add_func("/http-client/fetching", test_fetching);
+	g_test_add_func("/http-client/parse_events", test_parse_events);
+	g_test_add_func("/http-client/events_established",
+			test_events_established);
+	g_test_add_func("/http-client/decode_chunks", test_decode_chunks);
 
 	error = g_test_run();
 
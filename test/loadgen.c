@@ -0,0 +1,463 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Load generator for pold. It connects K agents and N apps to the bus given
+ * by DBUS_SYSTEM_BUS_ADDRESS, registers the agents and lets them issue
+ * GetPolicyConfig requests about random apps at a fixed rate. Agents are
+ * unregistered and registered again and apps disconnect and reconnect at
+ * configurable rates. At the end throughput and latency percentiles of the
+ * GetPolicyConfig calls are printed as one JSON object.
+ *
+ * test/loadtest.sh runs it against a private dbus-daemon.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <dbus/dbus.h>
+#include <glib.h>
+#include <gdbus.h>
+#include "../src/dbus.h"
+
+#define AGENT_PATH "/de/bmw/pold/loadgen/agent"
+#define REQUEST_TIMEOUT_IN_MILLISECONDS 60000
+#define TICK_IN_MILLISECONDS 1
+
+struct agent {
+	DBusConnection *conn;
+	bool registered;
+};
+
+struct request {
+	gint64 started;
+};
+
+static int n_agents = 4;
+static int n_apps = 100;
+static int rate = 1000;
+static int duration = 10;
+static int churn_rate;
+static int disconnect_rate;
+static int max_outstanding = 1000;
+
+static GOptionEntry entries[] =
+{
+	{ "agents", 'k', 0, G_OPTION_ARG_INT, &n_agents,
+		"Number of agents", "K" },
+	{ "apps", 'n', 0, G_OPTION_ARG_INT, &n_apps,
+		"Number of apps", "N" },
+	{ "rate", 'r', 0, G_OPTION_ARG_INT, &rate,
+		"GetPolicyConfig requests per second", "R" },
+	{ "duration", 't', 0, G_OPTION_ARG_INT, &duration,
+		"Duration of the test in seconds", "S" },
+	{ "churn", 'c', 0, G_OPTION_ARG_INT, &churn_rate,
+		"Agent unregistrations and registrations per second", "C" },
+	{ "disconnects", 'd', 0, G_OPTION_ARG_INT, &disconnect_rate,
+		"App disconnects per second", "D" },
+	{ "max-outstanding", 'o', 0, G_OPTION_ARG_INT, &max_outstanding,
+		"Maximum number of unanswered requests", "O" },
+	{ NULL }
+};
+
+static GMainLoop *loop;
+
+static struct agent *agents;
+
+static DBusConnection **apps;
+
+/*
+ * Latencies of all answered requests in microseconds
+ */
+static GArray *latencies;
+
+static unsigned int outstanding, errors, updates, churns, disconnects;
+
+static gint64 started, stopped;
+
+/*
+ * Fractional number of operations which are due but not issued yet
+ */
+static double requests_due, churns_due, disconnects_due;
+
+static gint64 last_tick;
+
+static DBusConnection *connect_bus(void)
+{
+	DBusConnection *conn;
+	DBusError error;
+
+	dbus_error_init(&error);
+
+	conn = g_dbus_setup_private(DBUS_BUS_SYSTEM, NULL, &error);
+	if (!conn) {
+		fprintf(stderr, "Failed to connect to the bus: %s\n",
+				error.message);
+		dbus_error_free(&error);
+		return NULL;
+	}
+
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+
+	return conn;
+}
+
+static void disconnect_bus(DBusConnection *conn)
+{
+	dbus_connection_close(conn);
+	dbus_connection_unref(conn);
+}
+
+static DBusMessage *agent_update(DBusConnection *conn, DBusMessage *message,
+		void *user_data)
+{
+	updates++;
+
+	return dbus_message_new_method_return(message);
+}
+
+static const GDBusMethodTable agent_methods[] = {
+	{ GDBUS_METHOD("Update", GDBUS_ARGS({"app", "s"}, {"policy", "a{sv}"}),
+			NULL, agent_update)
+	},
+	{ }
+};
+
+/*
+ * Returns false if the call could not be sent, data is freed then
+ */
+static bool call_manager(DBusConnection *conn, const char *method,
+		DBusPendingCallNotifyFunction notify, void *data,
+		DBusFreeFunction free_data, int first_type, ...)
+{
+	DBusMessage *msg;
+	DBusPendingCall *call;
+	va_list args;
+
+	msg = dbus_message_new_method_call(POLD_BUS_NAME, POLD_MANAGER_PATH,
+			POLD_MANAGER_INTERFACE, method);
+	if (!msg)
+		goto error;
+
+	va_start(args, first_type);
+	dbus_message_append_args_valist(msg, first_type, args);
+	va_end(args);
+
+	if (!dbus_connection_send_with_reply(conn, msg, &call,
+			REQUEST_TIMEOUT_IN_MILLISECONDS) || !call) {
+		dbus_message_unref(msg);
+		goto error;
+	}
+
+	dbus_pending_call_set_notify(call, notify, data, free_data);
+	dbus_pending_call_unref(call);
+	dbus_message_unref(msg);
+
+	return true;
+
+error:
+	errors++;
+	if (free_data)
+		free_data(data);
+
+	return false;
+}
+
+static void registration_reply(DBusPendingCall *call, void *user_data)
+{
+	DBusMessage *reply;
+
+	reply = dbus_pending_call_steal_reply(call);
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+		errors++;
+	dbus_message_unref(reply);
+}
+
+static void register_agent(struct agent *agent)
+{
+	const char *path = AGENT_PATH;
+
+	call_manager(agent->conn, "RegisterAgent", registration_reply, NULL,
+			NULL, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID);
+	agent->registered = true;
+}
+
+static void unregister_agent(struct agent *agent)
+{
+	const char *path = AGENT_PATH;
+
+	call_manager(agent->conn, "UnregisterAgent", registration_reply, NULL,
+			NULL, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID);
+	agent->registered = false;
+}
+
+static void request_reply(DBusPendingCall *call, void *user_data)
+{
+	struct request *request = user_data;
+	DBusMessage *reply;
+	guint64 latency;
+
+	outstanding--;
+
+	reply = dbus_pending_call_steal_reply(call);
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		errors++;
+	} else {
+		latency = g_get_monotonic_time() - request->started;
+		g_array_append_val(latencies, latency);
+	}
+	dbus_message_unref(reply);
+}
+
+static void send_request(void)
+{
+	struct agent *agent;
+	struct request *request;
+	const char *app_owner;
+
+	agent = &agents[g_random_int_range(0, n_agents)];
+	if (!agent->registered)
+		return;
+
+	app_owner = dbus_bus_get_unique_name(
+			apps[g_random_int_range(0, n_apps)]);
+
+	request = g_new0(struct request, 1);
+	request->started = g_get_monotonic_time();
+
+	if (call_manager(agent->conn, "GetPolicyConfig", request_reply,
+			request, g_free, DBUS_TYPE_STRING, &app_owner,
+			DBUS_TYPE_INVALID))
+		outstanding++;
+}
+
+static void churn_agent(void)
+{
+	struct agent *agent = &agents[g_random_int_range(0, n_agents)];
+
+	if (agent->registered)
+		unregister_agent(agent);
+	else
+		register_agent(agent);
+
+	churns++;
+}
+
+static void disconnect_app(void)
+{
+	int i = g_random_int_range(0, n_apps);
+	DBusConnection *conn;
+
+	conn = connect_bus();
+	if (!conn) {
+		errors++;
+		return;
+	}
+
+	disconnect_bus(apps[i]);
+	apps[i] = conn;
+	disconnects++;
+}
+
+static gboolean tick(gpointer user_data)
+{
+	gint64 now = g_get_monotonic_time();
+	double elapsed = (now - last_tick) / (double) G_USEC_PER_SEC;
+
+	last_tick = now;
+
+	if (now - started >= (gint64) duration * G_USEC_PER_SEC) {
+		stopped = now;
+		g_main_loop_quit(loop);
+		return FALSE;
+	}
+
+	requests_due += elapsed * rate;
+	churns_due += elapsed * churn_rate;
+	disconnects_due += elapsed * disconnect_rate;
+
+	for (; requests_due >= 1; requests_due--) {
+		if ((int) outstanding >= max_outstanding)
+			break;
+		send_request();
+	}
+
+	for (; churns_due >= 1; churns_due--)
+		churn_agent();
+
+	for (; disconnects_due >= 1; disconnects_due--)
+		disconnect_app();
+
+	return TRUE;
+}
+
+static int compare_latency(gconstpointer a, gconstpointer b)
+{
+	const guint64 *latency_a = a, *latency_b = b;
+
+	if (*latency_a < *latency_b)
+		return -1;
+
+	return *latency_a > *latency_b;
+}
+
+static guint64 percentile(double p)
+{
+	unsigned int index;
+
+	if (latencies->len == 0)
+		return 0;
+
+	index = (unsigned int) (p * (latencies->len - 1));
+
+	return g_array_index(latencies, guint64, index);
+}
+
+static void report(void)
+{
+	double seconds = (stopped - started) / (double) G_USEC_PER_SEC;
+
+	g_array_sort(latencies, compare_latency);
+
+	printf("{\"agents\": %d, \"apps\": %d, \"rate\": %d, "
+			"\"duration_sec\": %.3f, \"requests\": %u, "
+			"\"errors\": %u, \"outstanding\": %u, "
+			"\"updates\": %u, \"churns\": %u, \"disconnects\": %u, "
+			"\"throughput_per_sec\": %.1f, "
+			"\"p50_usec\": %" G_GUINT64_FORMAT ", "
+			"\"p99_usec\": %" G_GUINT64_FORMAT ", "
+			"\"p999_usec\": %" G_GUINT64_FORMAT "}\n",
+			n_agents, n_apps, rate, seconds, latencies->len,
+			errors, outstanding, updates, churns, disconnects,
+			latencies->len / seconds,
+			percentile(0.5), percentile(0.99), percentile(0.999));
+}
+
+static bool setup(void)
+{
+	int i;
+
+	agents = g_new0(struct agent, n_agents);
+	apps = g_new0(DBusConnection *, n_apps);
+
+	for (i = 0; i < n_apps; i++) {
+		apps[i] = connect_bus();
+		if (!apps[i])
+			return false;
+	}
+
+	for (i = 0; i < n_agents; i++) {
+		agents[i].conn = connect_bus();
+		if (!agents[i].conn)
+			return false;
+
+		if (!g_dbus_register_interface(agents[i].conn, AGENT_PATH,
+				POLD_AGENT_NOTIFICATION_INTERFACE,
+				agent_methods, NULL, NULL, NULL, NULL)) {
+			fprintf(stderr, "Failed to register agent\n");
+			return false;
+		}
+
+		register_agent(&agents[i]);
+	}
+
+	return true;
+}
+
+static void cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < n_agents; i++) {
+		if (!agents[i].conn)
+			continue;
+
+		g_dbus_unregister_interface(agents[i].conn, AGENT_PATH,
+				POLD_AGENT_NOTIFICATION_INTERFACE);
+		disconnect_bus(agents[i].conn);
+	}
+
+	for (i = 0; i < n_apps; i++) {
+		if (apps[i])
+			disconnect_bus(apps[i]);
+	}
+
+	g_free(apps);
+	g_free(agents);
+}
+
+static bool parse_options(int argc, char *argv[])
+{
+	GError *error = NULL;
+	GOptionContext *context;
+
+	context = g_option_context_new("- generate load on pold");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "Option parsing failed: %s\n", error->message);
+		g_error_free(error);
+		g_option_context_free(context);
+		return false;
+	}
+
+	g_option_context_free(context);
+
+	if (n_agents < 1 || n_apps < 1 || rate < 0 || duration < 1 ||
+			churn_rate < 0 || disconnect_rate < 0 ||
+			max_outstanding < 1) {
+		fprintf(stderr, "Invalid options\n");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = EXIT_SUCCESS;
+
+	if (!parse_options(argc, argv))
+		return EXIT_FAILURE;
+
+	loop = g_main_loop_new(NULL, FALSE);
+	latencies = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+	if (!setup()) {
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	started = last_tick = g_get_monotonic_time();
+	g_timeout_add(TICK_IN_MILLISECONDS, tick, NULL);
+	g_main_loop_run(loop);
+
+	report();
+
+out:
+	cleanup();
+	g_array_free(latencies, TRUE);
+	g_main_loop_unref(loop);
+
+	return ret;
+}
@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Policy Daemon - pold
+#
+# Copyright (C) 2014  BWM Car IT GmbH.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+#
+# Runs test/loadgen against pold on a private dbus-daemon, with
+# policyserver/policyserver.py as policy server. All arguments are passed
+# to test/loadgen, see test/loadgen --help.
+#
+# test/pold-loadtest keeps its storage in its working directory, which is
+# a temporary directory set up with the policies configure generated. Its
+# only policy source is the policy server, whatever sources.conf is
+# installed.
+#
+
+set -e
+
+srcdir=${srcdir:-$(dirname "$0")/..}
+builddir=${builddir:-.}
+POLD=${POLD:-$builddir/test/pold-loadtest}
+LOADGEN=${LOADGEN:-$builddir/test/loadgen}
+PYTHON=${PYTHON:-python2}
+
+workdir=$(mktemp -d -t pold-loadtest.XXXXXX)
+pids=
+
+cleanup() {
+	for pid in $pids; do
+		kill $pid 2>/dev/null || true
+	done
+	wait 2>/dev/null || true
+	rm -rf "$workdir"
+}
+trap cleanup EXIT INT TERM
+
+sed "s|@WORKDIR@|$workdir|" "$srcdir/test/loadtest-bus.conf" \
+	> "$workdir/bus.conf"
+
+dbus-daemon --config-file="$workdir/bus.conf" --fork \
+	--print-address=3 --print-pid=4 \
+	3> "$workdir/address" 4> "$workdir/dbus.pid"
+pids="$pids $(cat "$workdir/dbus.pid")"
+
+DBUS_SYSTEM_BUS_ADDRESS=$(cat "$workdir/address")
+export DBUS_SYSTEM_BUS_ADDRESS
+
+(cd "$srcdir/policyserver" && exec $PYTHON policyserver.py) \
+	> "$workdir/policyserver.log" 2>&1 &
+pids="$pids $!"
+
+mkdir "$workdir/policies"
+cp "$builddir/src/default.policy" "$builddir/src/pold.policy" "$workdir"
+
+cat > "$workdir/sources.conf" <<EOF
+[policyserver]
+Url=http://127.0.0.1:9000/update_policies
+Username=someuser
+Password=password
+EOF
+
+POLD=$(cd "$(dirname "$POLD")" && pwd)/$(basename "$POLD")
+(cd "$workdir" && exec "$POLD" --debug --sources="$workdir/sources.conf") \
+	> "$workdir/pold.log" 2>&1 &
+pids="$pids $!"
+
+# Wait up to 10 seconds for pold to appear on the bus
+i=0
+until dbus-send --system --print-reply --dest=org.freedesktop.DBus / \
+		org.freedesktop.DBus.NameHasOwner string:de.bmw.pold1 \
+		2>/dev/null | grep -q "boolean true"; do
+	i=$((i + 1))
+	if [ $i -gt 100 ]; then
+		echo "pold did not start, log:" >&2
+		cat "$workdir/pold.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+"$LOADGEN" "$@"
@@ -0,0 +1,350 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Benchmark for the policy store. It includes src/policy.c like
+ * policy-test.c does and times the hot paths with a configurable number of
+ * policies and watched apps. Every result is printed as one JSON object per
+ * line, e.g.
+ *
+ * {"benchmark": "load_policies", "policies": 1000, "apps": 1000,
+ *  "operations": 1000, "total_usec": 5234, "per_operation_nsec": 5234}
+ */
+
+#define STORAGEDIR "pold-bench"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gdbus.h>
+#include "../src/policy.c"
+
+#define AGENTS 16
+
+static int n_policies = 1000;
+static int n_apps = 1000;
+
+static unsigned int agent_updates;
+
+static GOptionEntry entries[] =
+{
+	{ "policies", 'p', 0, G_OPTION_ARG_INT, &n_policies,
+		"Number of policies", "N" },
+	{ "apps", 'a', 0, G_OPTION_ARG_INT, &n_apps,
+		"Number of watched apps", "M" },
+	{ NULL }
+};
+
+/*
+ * The agent update is replaced by a counter, there is no D-Bus here.
+ */
+int pold_manager_update_agent(DBusConnection *dbus_connection,
+		const char *agent_owner, const char *app_owner,
+		struct pold_policy *policy)
+{
+	agent_updates++;
+	return 0;
+}
+
+void pold_http_client_update_policies(void (*cb)(const char *policies_json,
+		bool done, void *data), void *data)
+{
+}
+
+static void report(const char *benchmark, unsigned int operations,
+		gint64 start)
+{
+	gint64 total = g_get_monotonic_time() - start;
+
+	printf("{\"benchmark\": \"%s\", \"policies\": %d, \"apps\": %d, "
+			"\"operations\": %u, \"total_usec\": %" G_GINT64_FORMAT
+			", \"per_operation_nsec\": %" G_GINT64_FORMAT "}\n",
+			benchmark, n_policies, n_apps, operations, total,
+			operations ? total * 1000 / operations : 0);
+	fflush(stdout);
+}
+
+/*
+ * Policy ids may only contain letters, so numbers are encoded in base 26.
+ */
+static char *encode(unsigned int number)
+{
+	GString *string = g_string_new(NULL);
+
+	do {
+		g_string_append_c(string, 'a' + number % 26);
+		number /= 26;
+	} while (number);
+
+	return g_string_free(string, FALSE);
+}
+
+/*
+ * A quarter of the policies are SELinux policies, half are user and a
+ * quarter are group policies.
+ */
+static char *policy_id(unsigned int i)
+{
+	unsigned int n_selinux = n_policies / 4;
+	unsigned int n_user = n_policies / 2;
+	const char *type;
+	char *name, *id;
+
+	if (i < n_selinux) {
+		type = "selinux";
+	} else if (i < n_selinux + n_user) {
+		type = "user";
+		i -= n_selinux;
+	} else {
+		type = "group";
+		i -= n_selinux + n_user;
+	}
+
+	name = encode(i);
+	id = g_strdup_printf("%s:%s", type, name);
+	g_free(name);
+
+	return id;
+}
+
+static char *policy_json(unsigned int i, unsigned int generation)
+{
+	char *id, *json;
+
+	id = policy_id(i);
+	json = g_strdup_printf("{\"Id\": \"%s\", \"Generation\": %u, "
+			"\"RoamingPolicy\": \"forbidden\", "
+			"\"ConnectionType\": \"internet\", "
+			"\"AllowedBearers\": [\"wifi\", \"cellular\"]}",
+			id, generation);
+	g_free(id);
+
+	return json;
+}
+
+static char *policies_json(unsigned int generation)
+{
+	GString *string = g_string_new("[");
+	char *json;
+	int i;
+
+	for (i = 0; i < n_policies; i++) {
+		json = policy_json(i, generation);
+		if (i > 0)
+			g_string_append(string, ", ");
+		g_string_append(string, json);
+		g_free(json);
+	}
+
+	g_string_append(string, "]");
+
+	return g_string_free(string, FALSE);
+}
+
+static void write_policies(void)
+{
+	char *full_path, *json;
+	int i;
+
+	for (i = 0; i < n_policies; i++) {
+		full_path = g_strdup_printf("%s/%d.policy", POLICYDIR, i);
+		json = policy_json(i, 0);
+		g_file_set_contents(full_path, json, -1, NULL);
+		g_free(json);
+		g_free(full_path);
+	}
+}
+
+/*
+ * Every app is identified by a SELinux type, a user and a group. Only
+ * every second SELinux type has a policy, so that user and group policies
+ * are active for a part of the apps as well.
+ */
+static void watch_app(unsigned int i)
+{
+	char *agent_owner, *app_owner, *name;
+	char *selinux, *user, *group;
+	unsigned int n_selinux = MAX(n_policies / 4, 1);
+	unsigned int n_user = MAX(n_policies / 2, 1);
+	unsigned int n_group = MAX(n_policies / 4, 1);
+
+	agent_owner = g_strdup_printf(":1.%u", i % AGENTS);
+	app_owner = g_strdup_printf(":2.%u", i);
+
+	name = encode(i % (2 * n_selinux));
+	selinux = g_strdup_printf("selinux:%s", name);
+	g_free(name);
+
+	name = encode(i % n_user);
+	user = g_strdup_printf("user:%s", name);
+	g_free(name);
+
+	name = encode(i % n_group);
+	group = g_strdup_printf("group:%s", name);
+	g_free(name);
+
+	pold_policy_watch_app(agent_owner, app_owner, NULL, 3, selinux, user,
+			group);
+
+	g_free(group);
+	g_free(user);
+	g_free(selinux);
+	g_free(app_owner);
+	g_free(agent_owner);
+}
+
+static void bench_load_policies(void)
+{
+	gint64 start;
+
+	write_policies();
+
+	start = g_get_monotonic_time();
+	load_policies(POLICYDIR);
+	report("load_policies", n_policies, start);
+}
+
+static void bench_watch_app(void)
+{
+	gint64 start;
+	int i;
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < n_apps; i++)
+		watch_app(i);
+	report("pold_policy_watch_app", n_apps, start);
+}
+
+static void bench_get_active_policy(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	unsigned int found = 0;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+	g_hash_table_iter_init(&iter, app_id_to_app);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (get_active_policy(value) != default_policy)
+			found++;
+	}
+	report("get_active_policy", g_hash_table_size(app_id_to_app), start);
+
+	if (found == 0)
+		fprintf(stderr, "No app has a policy other than the default "
+				"policy\n");
+}
+
+static void bench_mark_update_apps(void)
+{
+	gint64 start;
+
+	start = g_get_monotonic_time();
+	mark_update_apps();
+	report("mark_update_apps", g_hash_table_size(app_id_to_app), start);
+}
+
+/*
+ * A full update from the server where every policy changed.
+ */
+static void bench_update_policies_cb(void)
+{
+	struct update_policies_cb_data *data;
+	char *json;
+	gint64 start;
+
+	json = policies_json(1);
+	data = g_new0(struct update_policies_cb_data, 1);
+	agent_updates = 0;
+
+	start = g_get_monotonic_time();
+	update_policies_cb(json, true, data);
+	report("update_policies_cb", n_policies, start);
+
+	if (agent_updates == 0 && n_apps > 0)
+		fprintf(stderr, "No agent was updated\n");
+
+	g_free(json);
+}
+
+static void bench_remove_agent_apps(void)
+{
+	unsigned int before;
+	gint64 start;
+
+	before = g_hash_table_size(app_id_to_app);
+
+	start = g_get_monotonic_time();
+	pold_remove_agent_apps(":1.0");
+	report("pold_remove_agent_apps",
+			before - g_hash_table_size(app_id_to_app), start);
+}
+
+static bool parse_options(int argc, char *argv[])
+{
+	GError *error = NULL;
+	GOptionContext *context;
+
+	context = g_option_context_new("- benchmark the policy store");
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "Option parsing failed: %s\n", error->message);
+		g_error_free(error);
+		g_option_context_free(context);
+		return false;
+	}
+
+	g_option_context_free(context);
+
+	return n_policies >= 0 && n_apps >= 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char default_json[] = "{\"Id\": \"default:default\"}";
+
+	if (!parse_options(argc, argv))
+		return EXIT_FAILURE;
+
+	g_mkdir_with_parents(POLICYDIR, 0700);
+	g_file_set_contents(DEFAULT_POLICY, default_json, -1, NULL);
+
+	hashtables_init();
+	valid_policy_ids_init();
+	default_policy = load_policy(DEFAULT_POLICY);
+
+	bench_load_policies();
+	bench_watch_app();
+	bench_get_active_policy();
+	bench_mark_update_apps();
+	bench_update_policies_cb();
+	bench_remove_agent_apps();
+
+	delete_all_policies(POLICYDIR);
+	g_unlink(DEFAULT_POLICY);
+	g_rmdir(POLICYDIR);
+	g_rmdir(STORAGEDIR);
+
+	return EXIT_SUCCESS;
+}
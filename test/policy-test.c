@@ -42,6 +42,19 @@ char test_policy3[] = "{\"Id\" : \"user:foouser\"}";
 char test_policy4[] = "{\"Id\" : \"group:bargroup\"}";
 char test_default_policy[] = "{\"Id\" : \"default:default\"}";
 
+static int agent_updates;
+
+/*
+ * The agent update is replaced by a counter, there is no D-Bus here.
+ */
+int pold_manager_update_agent(DBusConnection *dbus_connection,
+		const char *agent_owner, const char *app_owner,
+		struct pold_policy *policy)
+{
+	agent_updates++;
+	return 0;
+}
+
 static struct pold_policy *load_file(const char *filename)
 {
 	struct pold_policy *policy;
@@ -93,6 +106,17 @@ static void test_is_valid_policy_id(void)
 	g_assert(!is_valid_policy_id("foo:"));
 
 	g_assert(!is_valid_policy_id("foo:bar"));
+
+	g_assert(is_valid_policy_id("selinux:haifux_t"));
+	g_assert(is_valid_policy_id("user:svc-1.2"));
+	g_assert(!is_valid_policy_id("xselinux:foo"));
+	g_assert(!is_valid_policy_id("user:foo bar"));
+	g_assert(!is_valid_policy_id("user:svc-*"));
+
+	g_assert(g_regex_match(valid_policy_patterns, "user:svc-*", 0, NULL));
+	g_assert(g_regex_match(valid_policy_patterns, "selinux:*", 0, NULL));
+	g_assert(!g_regex_match(valid_policy_patterns, "user:*a*", 0, NULL));
+	g_assert(!g_regex_match(valid_policy_patterns, "foo:*", 0, NULL));
 }
 
 static void test_load_policy(void)
@@ -116,36 +140,45 @@ static void test_pold_watch_app(void)
 
 	hashtables_init();
 
-	pold_policy_watch_app("", ":1", 3, "selinux:bazselinux", "user:foouser",
+	pold_policy_watch_app("", ":1", NULL, 3, "selinux:bazselinux",
+			"user:foouser", "group:bargroup");
+	pold_policy_watch_app("", ":2", NULL, 2, "user:foouser",
 			"group:bargroup");
-	pold_policy_watch_app("", ":2", 2, "user:foouser", "group:bargroup");
-	pold_policy_watch_app("", ":3", 1, "group:bargroup");
-	pold_policy_watch_app("", ":4", 1, "user:baruser");
+	pold_policy_watch_app("", ":3", NULL, 1, "group:bargroup");
+	pold_policy_watch_app("", ":4", NULL, 1, "user:baruser");
 
 	g_assert(g_hash_table_size(app_id_to_app) == 4);
-	g_assert(g_hash_table_contains(app_id_to_app, "/:1"));
-	g_assert(g_hash_table_contains(app_id_to_app, "/:2"));
-	g_assert(g_hash_table_contains(app_id_to_app, "/:3"));
-	g_assert(g_hash_table_contains(app_id_to_app, "/:4"));
-
-	apps = g_hash_table_lookup(id_to_apps, "selinux:bazselinux");
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("/:1")));
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("/:2")));
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("/:3")));
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("/:4")));
+
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("selinux:bazselinux"));
 	g_assert(g_slist_length(apps->next) == 1);
 	app1 = apps->next->data;
 	g_assert(g_strcmp0(app1->id, "/:1") == 0);
 
-	apps = g_hash_table_lookup(id_to_apps, "user:foouser");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("user:foouser"));
 	g_assert(g_slist_length(apps->next) == 2);
 	app1 = apps->next->data;
 	app2 = apps->next->next->data;
 	g_assert(g_strcmp0(app1->id, "/:1") == 0);
 	g_assert(g_strcmp0(app2->id, "/:2") == 0);
 
-	apps = g_hash_table_lookup(id_to_apps, "user:baruser");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("user:baruser"));
 	g_assert(g_slist_length(apps->next) == 1);
 	app1 = apps->next->data;
 	g_assert(g_strcmp0(app1->id, "/:4") == 0);
 
-	apps = g_hash_table_lookup(id_to_apps, "group:bargroup");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("group:bargroup"));
 	g_assert(g_slist_length(apps->next) == 3);
 	app1 = apps->next->data;
 	app2 = apps->next->next->data;
@@ -162,13 +195,15 @@ static void test_pold_watch_app_twice(void)
 
 	hashtables_init();
 
-	pold_policy_watch_app("", ":1", 1, "user:foouser");
-	pold_policy_watch_app("", ":1", 1, "user:foouser");
+	pold_policy_watch_app("", ":1", NULL, 1, "user:foouser");
+	pold_policy_watch_app("", ":1", NULL, 1, "user:foouser");
 
 	g_assert(g_hash_table_size(app_id_to_app) == 1);
-	g_assert(g_hash_table_contains(app_id_to_app, "/:1"));
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("/:1")));
 
-	apps = g_hash_table_lookup(id_to_apps, "user:foouser");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("user:foouser"));
 	g_assert(g_slist_length(apps->next) == 1);
 	app1 = apps->next->data;
 	g_assert(g_strcmp0(app1->id, "/:1") == 0);
@@ -182,12 +217,15 @@ static void test_pold_watch_app_invalid_id(void)
 	hashtables_init();
 	valid_policy_ids_init();
 
-	pold_policy_watch_app("", ":1", 3, "user:foouser",
-		"foo:bar", "bar:foo");
+	pold_policy_watch_app("", ":1", NULL, 3, "user:foouser", "foo:bar",
+			"bar:foo");
 
-	g_assert(g_hash_table_contains(id_to_apps, "user:foouser"));
-	g_assert(!g_hash_table_contains(id_to_apps, "foo:bar"));
-	g_assert(!g_hash_table_contains(id_to_apps, "bar:foo"));
+	g_assert(g_hash_table_contains(id_to_apps,
+			pold_atom_lookup("user:foouser")));
+	g_assert(!g_hash_table_contains(id_to_apps,
+			pold_atom_lookup("foo:bar")));
+	g_assert(!g_hash_table_contains(id_to_apps,
+			pold_atom_lookup("bar:foo")));
 }
 
 static void test_pold_stop_watching_app(void)
@@ -197,33 +235,39 @@ static void test_pold_stop_watching_app(void)
 
 	hashtables_init();
 
-	pold_policy_watch_app("", ":1", 3, "selinux:bazselinux", "user:foouser",
+	pold_policy_watch_app("", ":1", NULL, 3, "selinux:bazselinux",
+			"user:foouser", "group:bargroup");
+	pold_policy_watch_app("", ":2", NULL, 2, "user:foouser",
 			"group:bargroup");
-	pold_policy_watch_app("", ":2", 2, "user:foouser", "group:bargroup");
-	pold_policy_watch_app("", ":3", 1, "group:bargroup");
-	pold_policy_watch_app("", ":4", 1, "user:baruser");
+	pold_policy_watch_app("", ":3", NULL, 1, "group:bargroup");
+	pold_policy_watch_app("", ":4", NULL, 1, "user:baruser");
 
-	apps = g_hash_table_lookup(id_to_apps, "selinux:bazselinux");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("selinux:bazselinux"));
 	g_assert(g_slist_length(apps->next) == 1);
 	app1 = apps->next->data;
 	g_assert(g_strcmp0("/:1", app1->id) == 0);
 
 	stop_watching_app(NULL, app1);
 
-	apps = g_hash_table_lookup(id_to_apps, "selinux:bazselinux");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("selinux:bazselinux"));
 	g_assert(g_slist_length(apps->next) == 0);
 
-	apps = g_hash_table_lookup(id_to_apps, "user:foouser");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("user:foouser"));
 	g_assert(g_slist_length(apps->next) == 1);
 	app1 = apps->next->data;
 	g_assert(g_strcmp0(app1->id, "/:2") == 0);
 
-	apps = g_hash_table_lookup(id_to_apps, "user:baruser");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("user:baruser"));
 	g_assert(g_slist_length(apps->next) == 1);
 	app1 = apps->next->data;
 	g_assert(g_strcmp0(app1->id, "/:4") == 0);
 
-	apps = g_hash_table_lookup(id_to_apps, "group:bargroup");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("group:bargroup"));
 	g_assert(g_slist_length(apps->next) == 2);
 	app1 = apps->next->data;
 	app2 = apps->next->next->data;
@@ -232,8 +276,9 @@ static void test_pold_stop_watching_app(void)
 }
 
 /*
- * Check that a user type policy wins over a group type policy, and
- * that if there are two user type policies, the first one wins.
+ * Check that a user type policy wins over a group type policy, that the
+ * default policy is used if none matches and that the active policy is
+ * looked up again after a reload.
  */
 static void test_get_active_policy(void)
 {
@@ -244,16 +289,370 @@ static void test_get_active_policy(void)
 	load_policies(testdir);
 
 	app = g_new0(struct pold_agent_app, 1);
-	app->policy_ids = g_slist_append(app->policy_ids,
-			g_strdup("group:bargroup"));
-	app->policy_ids = g_slist_append(app->policy_ids,
-			g_strdup("user:foouser2"));
-	app->policy_ids = g_slist_append(app->policy_ids,
-			g_strdup("user:foouser"));
+	app->ids[POLICY_TYPE_GROUP] = pold_atom_intern("group:bargroup");
+	app->ids[POLICY_TYPE_USER] = pold_atom_intern("user:foouser2");
 
 	policy = get_active_policy(app);
 
 	g_assert(g_strcmp0(policy->id, "user:foouser2") == 0);
+	g_assert(app->policies[POLICY_TYPE_GROUP] ==
+			pold_policy_get("group:bargroup"));
+	g_assert(!app->policies[POLICY_TYPE_SELINUX]);
+
+	app->ids[POLICY_TYPE_SELINUX] = pold_atom_intern("selinux:nobody");
+	app->ids[POLICY_TYPE_USER] = pold_atom_intern("user:nobody");
+	app->ids[POLICY_TYPE_GROUP] = pold_atom_intern("group:nobody");
+
+	/* Still the memoized policy */
+	g_assert(get_active_policy(app) == policy);
+
+	load_policies(testdir);
+	g_assert(get_active_policy(app) == default_policy);
+}
+
+/*
+ * Check that only the first id of each type is used
+ */
+static void test_pold_watch_app_same_type(void)
+{
+	struct pold_agent_app *app;
+
+	hashtables_init();
+	load_policies(testdir);
+
+	pold_policy_watch_app("", ":1", NULL, 3, "user:foouser2",
+			"user:foouser", "group:bargroup");
+
+	app = g_hash_table_lookup(app_id_to_app, pold_atom_lookup("/:1"));
+	g_assert(g_strcmp0(app->ids[POLICY_TYPE_USER], "user:foouser2") == 0);
+	g_assert(g_strcmp0(app->ids[POLICY_TYPE_GROUP], "group:bargroup") == 0);
+	g_assert(!app->ids[POLICY_TYPE_SELINUX]);
+	g_assert(!g_hash_table_contains(id_to_apps,
+			pold_atom_lookup("user:foouser")));
+	g_assert(g_strcmp0(get_active_policy(app)->id, "user:foouser2") == 0);
+
+	hashtables_final();
+}
+
+/*
+ * Check that a referenced generation keeps its policies after a reload
+ */
+static void test_generation_lookup(void)
+{
+	struct pold_policy_generation *generation;
+	struct pold_policy *policy;
+	const char *selinux, *user, *group, *nobody;
+
+	hashtables_init();
+	load_policies(testdir);
+
+	selinux = pold_atom_intern("selinux:abcde");
+	user = pold_atom_intern("user:foouser");
+	group = pold_atom_intern("group:bargroup");
+	nobody = pold_atom_intern("user:nobody");
+
+	generation = pold_policy_generation_ref();
+	g_assert(pold_policy_generation_is_current(generation));
+
+	policy = pold_policy_generation_lookup(generation, NULL, 3, selinux,
+			user, group);
+	g_assert(g_strcmp0(policy->id, "selinux:abcde") == 0);
+
+	policy = pold_policy_generation_lookup(generation, NULL, 2, nobody,
+			group);
+	g_assert(g_strcmp0(policy->id, "group:bargroup") == 0);
+
+	policy = pold_policy_generation_lookup(generation, NULL, 2, NULL,
+			nobody);
+	g_assert(policy == default_policy);
+
+	load_policies(testdir);
+	g_assert(!pold_policy_generation_is_current(generation));
+
+	policy = pold_policy_generation_lookup(generation, NULL, 1, user);
+	g_assert(g_strcmp0(policy->id, "user:foouser") == 0);
+	g_assert(policy != pold_policy_get("user:foouser"));
+
+	pold_policy_generation_unref(generation);
+	hashtables_final();
+
+	pold_atom_unref(selinux);
+	pold_atom_unref(user);
+	pold_atom_unref(group);
+	pold_atom_unref(nobody);
+}
+
+/*
+ * A new app takes the policy resolved in the current generation over, one
+ * of an outdated generation is resolved again
+ */
+static void test_watch_resolved_app(void)
+{
+	struct pold_policy_generation *generation;
+	struct pold_policy *resolved, *policy;
+
+	hashtables_init();
+	load_policies(testdir);
+
+	generation = pold_policy_generation_ref();
+	resolved = pold_policy_get("group:bargroup");
+
+	/* Not what the ids resolve to, so the lookup was skipped */
+	policy = pold_policy_watch_resolved_app("", ":1", NULL, generation,
+			resolved, 1, "user:foouser");
+	g_assert(policy == resolved);
+
+	load_policies(testdir);
+
+	policy = pold_policy_watch_resolved_app("", ":2", NULL, generation,
+			resolved, 1, "user:foouser");
+	g_assert(policy == pold_policy_get("user:foouser"));
+
+	pold_policy_generation_unref(generation);
+	hashtables_final();
+}
+
+static struct pold_policy *add_test_policy(
+		struct pold_policy_generation *generation, const char *id)
+{
+	struct pold_policy *policy;
+
+	policy = g_new0(struct pold_policy, 1);
+	policy->id = pold_atom_intern(id);
+	policy->json = g_strdup_printf("{\"Id\": \"%s\"}", id);
+
+	g_hash_table_replace(generation->id_to_policy, (gpointer) policy->id,
+			policy);
+
+	return policy;
+}
+
+/*
+ * Check that exact ids win over patterns and that among patterns the one
+ * with the most literal characters wins
+ */
+static void test_policy_patterns(void)
+{
+	struct pold_policy_generation *generation;
+	struct pold_policy *exact, *app_t, *foo, *foo_app_t, *svc;
+	const char *selinux, *user;
+
+	valid_policy_ids_init();
+
+	generation = new_generation();
+	exact = add_test_policy(generation, "selinux:foo_app_t");
+	app_t = add_test_policy(generation, "selinux:*_app_t");
+	foo = add_test_policy(generation, "selinux:foo_*");
+	foo_app_t = add_test_policy(generation, "selinux:foo_*_app_t");
+	svc = add_test_policy(generation, "user:svc-*");
+	add_test_policy(generation, "user:*a*");
+	index_policies(generation);
+
+	g_assert(pold_trie_size(generation->patterns) == 4);
+
+	g_assert(lookup_policy(generation,
+			pold_atom_lookup("selinux:foo_app_t")) == exact);
+	g_assert(lookup_policy(generation, "selinux:bar_app_t") == app_t);
+	g_assert(lookup_policy(generation, "selinux:foo_bar") == foo);
+	g_assert(lookup_policy(generation, "selinux:foo_bar_app_t") ==
+			foo_app_t);
+	g_assert(lookup_policy(generation, "user:svc-") == svc);
+	g_assert(lookup_policy(generation, "user:svc") == NULL);
+	g_assert(lookup_policy(generation, "user:bar") == NULL);
+
+	selinux = pold_atom_intern("selinux:bar_t");
+	user = pold_atom_intern("user:svc-42");
+	g_assert(pold_policy_generation_lookup(generation, NULL, 2, selinux,
+			user) == svc);
+	pold_atom_unref(selinux);
+	pold_atom_unref(user);
+
+	pold_policy_generation_unref(generation);
+}
+
+static void test_policy_groups(void)
+{
+	struct pold_policy_generation *generation;
+	struct pold_policy *wheel, *audio;
+	struct pold_policy_groups *groups;
+	gid_t gids[] = { 1000, 1064, 10, 29 };
+	const char *user;
+
+	valid_policy_ids_init();
+
+	generation = new_generation();
+	wheel = add_test_policy(generation, "group:wheel");
+	audio = add_test_policy(generation, "group:audio");
+
+	/* Index by hand, the test must not depend on the system's groups */
+	g_hash_table_insert(generation->gid_to_policy, GUINT_TO_POINTER(10),
+			wheel);
+	g_hash_table_insert(generation->gid_to_policy, GUINT_TO_POINTER(29),
+			audio);
+	generation->gid_mask = GROUP_BIT(10) | GROUP_BIT(29);
+
+	/* The first group in list order wins */
+	groups = pold_policy_groups_new(gids, 4);
+	g_assert(lookup_groups(generation, groups) == wheel);
+	pold_policy_groups_unref(groups);
+
+	groups = pold_policy_groups_new(gids + 3, 1);
+	g_assert(lookup_groups(generation, groups) == audio);
+	pold_policy_groups_unref(groups);
+
+	/* 1064 shares its mask bit with 1000, neither has a policy */
+	groups = pold_policy_groups_new(gids, 2);
+	g_assert(lookup_groups(generation, groups) == NULL);
+	g_assert(lookup_groups(generation, NULL) == NULL);
+
+	user = pold_atom_intern("user:nobody");
+	g_assert(pold_policy_generation_lookup(generation, groups, 1,
+			user) == default_policy);
+	pold_policy_groups_unref(groups);
+
+	/* Ids of the app take precedence over its supplementary groups */
+	groups = pold_policy_groups_new(gids, 4);
+	g_assert(pold_policy_generation_lookup(generation, groups, 1,
+			user) == wheel);
+	g_assert(pold_policy_generation_lookup(generation, groups, 1,
+			pold_atom_lookup("group:audio")) == audio);
+	pold_policy_groups_unref(groups);
+	pold_atom_unref(user);
+
+	pold_policy_generation_unref(generation);
+}
+
+static struct pold_policy *add_json_policy(
+		struct pold_policy_generation *generation, const char *json)
+{
+	struct pold_policy *policy;
+	json_t *root;
+
+	root = json_loads(json, 0, NULL);
+	policy = g_new0(struct pold_policy, 1);
+	policy->id = pold_atom_intern(json_string_value(json_object_get(root,
+			"Id")));
+	policy->json = json_dumps(root, 0);
+	json_decref(root);
+
+	g_hash_table_replace(generation->id_to_policy, (gpointer) policy->id,
+			policy);
+
+	return policy;
+}
+
+static void test_merge_policies(void)
+{
+	struct pold_policy_generation *generation, *reloaded;
+	struct pold_policy *group, *user, *merged;
+	const char *selinux_id, *user_id, *group_id;
+	json_t *root, *limits;
+
+	valid_policy_ids_init();
+	merge_policies = true;
+
+	generation = new_generation();
+	group = add_json_policy(generation, "{\"Id\": \"group:staff\", "
+			"\"Priority\": 1, \"Limits\": {\"Rx\": 10, "
+			"\"Tx\": 10}, \"Bearers\": [\"wifi\"]}");
+	user = add_json_policy(generation, "{\"Id\": \"user:alice\", "
+			"\"Limits\": {\"Tx\": 20}, \"Bearers\": []}");
+	index_policies(generation);
+
+	selinux_id = pold_atom_intern("selinux:foo_t");
+	user_id = pold_atom_intern("user:alice");
+	group_id = pold_atom_intern("group:staff");
+
+	/* A single layer is not merged */
+	g_assert(pold_policy_generation_lookup(generation, NULL, 2,
+			selinux_id, group_id) == group);
+	g_assert(g_hash_table_size(generation->merged) == 0);
+
+	merged = pold_policy_generation_lookup(generation, NULL, 3,
+			selinux_id, user_id, group_id);
+	g_assert(merged != group && merged != user);
+	g_assert(merged->id == user->id);
+	g_assert(merged->reply);
+
+	root = json_loads(merged->json, 0, NULL);
+	limits = json_object_get(root, "Limits");
+	g_assert(json_integer_value(json_object_get(limits, "Rx")) == 10);
+	g_assert(json_integer_value(json_object_get(limits, "Tx")) == 20);
+	g_assert(json_integer_value(json_object_get(root, "Priority")) == 1);
+	g_assert(json_array_size(json_object_get(root, "Bearers")) == 0);
+	json_decref(root);
+
+	/* Each combination of layers is merged only once */
+	g_assert(pold_policy_generation_lookup(generation, NULL, 2,
+			group_id, user_id) == merged);
+	g_assert(g_hash_table_size(generation->merged) == 1);
+
+	/* Combinations in use are merged again when reloading */
+	reloaded = new_generation();
+	add_json_policy(reloaded, group->json);
+	add_json_policy(reloaded, user->json);
+	index_policies(reloaded);
+	remerge_policies(generation, reloaded);
+	g_assert(g_hash_table_size(reloaded->merged) == 1);
+
+	pold_atom_unref(selinux_id);
+	pold_atom_unref(user_id);
+	pold_atom_unref(group_id);
+	pold_policy_generation_unref(reloaded);
+	pold_policy_generation_unref(generation);
+	merge_policies = false;
+}
+
+static void test_policy_rules(void)
+{
+	struct pold_policy *policy, *active;
+	struct pold_agent_app *app;
+
+	hashtables_init();
+	valid_policy_ids_init();
+
+	save_file("{\"Id\": \"user:rules\", \"Bearers\": [\"wifi\"], "
+			"\"Rules\": [{\"When\": {\"State\": \"online\"}, "
+			"\"Set\": {\"Bearers\": [\"ethernet\"]}}]}",
+			"rules.policy");
+	policy = load_file("rules.policy");
+	delete_file("rules.policy");
+
+	g_assert(policy);
+	g_assert(pold_rules_size(policy->rules) == 1);
+	g_hash_table_replace(current_generation->id_to_policy,
+			(gpointer) policy->id, policy);
+	index_policies(current_generation);
+	g_assert(current_generation->inputs == POLD_RULES_STATE);
+
+	/* Agents only ever get a variant, without the rules */
+	active = pold_policy_watch_app("agent", ":5", NULL, 1, "user:rules");
+	g_assert(active == policy->variants[1]);
+	g_assert(!strstr(active->json, "Rules"));
+	g_assert(strstr(active->json, "wifi"));
+
+	app = g_hash_table_lookup(app_id_to_app,
+			pold_atom_lookup("agent/:5"));
+	g_assert(g_hash_table_contains(contextual_apps, app));
+
+	agent_updates = 0;
+	pold_policy_set_session_state("online");
+	g_assert(agent_updates == 1);
+	g_assert(get_active_policy(app) == policy->variants[0]);
+	g_assert(strstr(app->agent_policy_json, "ethernet"));
+
+	/* Inputs no rule depends on do not cause updates */
+	pold_policy_set_session_state("online");
+	pold_policy_set_session_bearer("wifi");
+	g_assert(agent_updates == 1);
+
+	pold_policy_set_session_state(NULL);
+	pold_policy_set_session_bearer(NULL);
+	g_assert(agent_updates == 2);
+	g_assert(get_active_policy(app) == policy->variants[1]);
+
+	stop_watching_app(NULL, app);
+	g_assert(g_hash_table_size(contextual_apps) == 0);
 }
 
 static void test_mark_update_apps(void)
@@ -266,11 +665,13 @@ static void test_mark_update_apps(void)
 
 	/* Load policy 4 */
 	policy4 = load_file("test4.policy");
-	g_hash_table_replace(id_to_policy, g_strdup(policy4->id), policy4);
+	g_hash_table_replace(current_generation->id_to_policy,
+			(gpointer) policy4->id, policy4);
 
-	pold_policy_watch_app("agent foo", ":1", 3, "selinux:fooselinux",
+	pold_policy_watch_app("agent foo", ":1", NULL, 3, "selinux:fooselinux",
 			"user:foouser", "group:bargroup");
-	apps = g_hash_table_lookup(id_to_apps, "user:foouser");
+	apps = g_hash_table_lookup(id_to_apps,
+			pold_atom_lookup("user:foouser"));
 	app = (struct pold_agent_app *) g_slist_last(apps)->data;
 
 	g_assert(get_active_policy(app) == policy4);
@@ -282,8 +683,11 @@ static void test_mark_update_apps(void)
 
 	/* Load policy 3 */
 	policy3 = load_file("test3.policy");
-	g_hash_table_replace(id_to_policy, g_strdup(policy3->id), policy3);
+	g_hash_table_replace(current_generation->id_to_policy,
+			(gpointer) policy3->id, policy3);
 
+	/* The policies changed without a new generation */
+	resolve_app(app);
 	g_assert(get_active_policy(app) == policy3);
 
 	/* Now the app has to be updated */
@@ -299,22 +703,26 @@ static void test_pold_remove_agent_apps(void)
 {
 	hashtables_init();
 
-	pold_policy_watch_app("agent foo", ":1", 3, "selinux:selinux1",
+	pold_policy_watch_app("agent foo", ":1", NULL, 3, "selinux:selinux1",
 			"user:foouser", "bar:bargroup");
-	pold_policy_watch_app("agent bar", ":2", 3, "selinux:selinux2",
+	pold_policy_watch_app("agent bar", ":2", NULL, 3, "selinux:selinux2",
 			"user:foouser", "group:bargroup");
-	pold_policy_watch_app("agent foo", ":3", 3, "selinux:selinux3",
+	pold_policy_watch_app("agent foo", ":3", NULL, 3, "selinux:selinux3",
 			"user:baruser", "group:bargroup");
 
 	g_assert(g_hash_table_size(app_id_to_app) == 3);
-	g_assert(g_hash_table_contains(app_id_to_app, "agent foo/:1"));
-	g_assert(g_hash_table_contains(app_id_to_app, "agent bar/:2"));
-	g_assert(g_hash_table_contains(app_id_to_app, "agent foo/:3"));
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("agent foo/:1")));
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("agent bar/:2")));
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("agent foo/:3")));
 
 	pold_remove_agent_apps("agent foo");
 
 	g_assert(g_hash_table_size(app_id_to_app) == 1);
-	g_assert(g_hash_table_contains(app_id_to_app, "agent bar/:2"));
+	g_assert(g_hash_table_contains(app_id_to_app,
+			pold_atom_lookup("agent bar/:2")));
 }
 
 int main(int argc, char *argv[])
@@ -336,10 +744,20 @@ int main(int argc, char *argv[])
 	g_test_add_func("/policy/pold_policy_watch_app_twice", test_pold_watch_app_twice);
 	g_test_add_func("/policy/pold_policy_watch_app_invalid_id",
 			test_pold_watch_app_invalid_id);
+	g_test_add_func("/policy/pold_policy_watch_app_same_type",
+			test_pold_watch_app_same_type);
 	g_test_add_func("/policy/pold_stop_watching_app",
 			test_pold_stop_watching_app);
 	g_test_add_func("/policy/pold_get_active_policy",
 			test_get_active_policy);
+	g_test_add_func("/policy/generation_lookup",
+			test_generation_lookup);
+	g_test_add_func("/policy/watch_resolved_app",
+			test_watch_resolved_app);
+	g_test_add_func("/policy/policy_patterns", test_policy_patterns);
+	g_test_add_func("/policy/policy_groups", test_policy_groups);
+	g_test_add_func("/policy/merge_policies", test_merge_policies);
+	g_test_add_func("/policy/policy_rules", test_policy_rules);
 	g_test_add_func("/policy/mark_udpate_apps",
 			test_mark_update_apps);
 	g_test_add_func("/policy/pold_remove_agent_apps",
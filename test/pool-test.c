@@ -0,0 +1,124 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <glib.h>
+#include "../src/pool.h"
+
+struct record {
+	char name[20];
+	int value;
+};
+
+static void test_alloc(void)
+{
+	struct pold_pool pool = POLD_POOL_INIT(struct record, 4);
+	struct record *records[10];
+	unsigned int i, j;
+
+	g_assert(pool.object_size >= sizeof(struct record));
+	g_assert(pool.object_size % POLD_POOL_ALIGNMENT == 0);
+
+	for (i = 0; i < G_N_ELEMENTS(records); i++) {
+		records[i] = pold_pool_alloc0(&pool);
+		g_assert(records[i]->value == 0);
+		records[i]->value = i;
+	}
+
+	g_assert(pool.allocated == G_N_ELEMENTS(records));
+	g_assert(g_slist_length(pool.slabs) == 3);
+
+	for (i = 0; i < G_N_ELEMENTS(records); i++) {
+		g_assert(records[i]->value == (int) i);
+
+		for (j = 0; j < i; j++)
+			g_assert(records[i] != records[j]);
+	}
+
+	/* Slabs stay as long as objects are in use */
+	g_assert(!pold_pool_clear(&pool));
+	g_assert(g_slist_length(pool.slabs) == 3);
+	g_assert(records[0]->value == 0);
+
+	for (i = 0; i < G_N_ELEMENTS(records); i++)
+		pold_pool_free(&pool, records[i]);
+
+	g_assert(pold_pool_clear(&pool));
+	g_assert(pool.allocated == 0);
+	g_assert(!pool.slabs);
+}
+
+/*
+ * Freed objects are reused before another slab is allocated
+ */
+static void test_reuse(void)
+{
+	struct pold_pool pool = POLD_POOL_INIT(struct record, 2);
+	struct record *a, *b, *c;
+
+	a = pold_pool_alloc0(&pool);
+	b = pold_pool_alloc0(&pool);
+	a->value = 42;
+
+	pold_pool_free(&pool, a);
+	g_assert(pool.allocated == 1);
+
+	c = pold_pool_alloc0(&pool);
+	g_assert(c == a);
+	g_assert(c->value == 0);
+	g_assert(g_slist_length(pool.slabs) == 1);
+
+	pold_pool_free(&pool, b);
+	pold_pool_free(&pool, c);
+	pold_pool_free(&pool, NULL);
+	g_assert(pool.allocated == 0);
+
+	pold_pool_clear(&pool);
+}
+
+/*
+ * Objects smaller than a pointer still fit the free list link
+ */
+static void test_small_objects(void)
+{
+	struct pold_pool pool = POLD_POOL_INIT(char, 8);
+	char *a, *b;
+
+	a = pold_pool_alloc0(&pool);
+	b = pold_pool_alloc0(&pool);
+
+	g_assert(pool.object_size >= sizeof(void *));
+	g_assert(b - a == (ptrdiff_t) pool.object_size);
+
+	pold_pool_free(&pool, a);
+	pold_pool_free(&pool, b);
+	pold_pool_clear(&pool);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/pool/alloc", test_alloc);
+	g_test_add_func("/pool/reuse", test_reuse);
+	g_test_add_func("/pool/small_objects", test_small_objects);
+
+	return g_test_run();
+}
@@ -0,0 +1,164 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <glib.h>
+#include <jansson.h>
+#include "../src/rules.h"
+
+static struct pold_rules *compile(const char *json)
+{
+	struct pold_rules *rules;
+	json_t *root;
+
+	root = json_loads(json, 0, NULL);
+	g_assert(root);
+
+	rules = pold_rules_compile(root);
+	json_decref(root);
+
+	return rules;
+}
+
+static void test_compile(void)
+{
+	struct pold_rules *rules;
+
+	rules = compile("[]");
+	g_assert(rules);
+	g_assert(pold_rules_size(rules) == 0);
+	g_assert(pold_rules_inputs(rules) == 0);
+	pold_rules_free(rules);
+
+	rules = compile("[{\"When\": {\"State\": \"online\"}}, "
+			"{\"When\": {\"Time\": \"22:00-06:00\"}, \"Set\": {}}, "
+			"{\"Set\": {\"Foo\": 1}}]");
+	g_assert(rules);
+	g_assert(pold_rules_size(rules) == 3);
+	g_assert(pold_rules_inputs(rules) ==
+			(POLD_RULES_STATE | POLD_RULES_TIME));
+	pold_rules_free(rules);
+
+	g_assert(!compile("{}"));
+	g_assert(!compile("[1]"));
+	g_assert(!compile("[{\"When\": []}]"));
+	g_assert(!compile("[{\"Set\": 1}]"));
+	g_assert(!compile("[{\"When\": {\"State\": \"onlin\"}}]"));
+	g_assert(!compile("[{\"When\": {\"Bearer\": [\"wifi\", 1]}}]"));
+	g_assert(!compile("[{\"When\": {\"Time\": \"8-18\"}}]"));
+	g_assert(!compile("[{\"When\": {\"Time\": \"08:00-08:00\"}}]"));
+	g_assert(!compile("[{\"When\": {\"Time\": \"08:00-18:60\"}}]"));
+	g_assert(!compile("[{\"When\": {\"Time\": \"08:00-18:00x\"}}]"));
+	g_assert(!compile("[{\"When\": {\"Time\": \"22:00-24:30\"}}]"));
+	g_assert(!compile("[{\"When\": {\"Time\": \"25:00-06:00\"}}]"));
+
+	rules = compile("[{\"When\": {\"Time\": \"22:00-24:00\"}}]");
+	g_assert(rules);
+	pold_rules_free(rules);
+}
+
+static void test_context(void)
+{
+	guint32 context = 0, changed;
+
+	changed = pold_rules_context_set_state(context, "online");
+	g_assert(pold_rules_context_diff(context, changed) ==
+			POLD_RULES_STATE);
+
+	context = pold_rules_context_set_bearer(changed, "wifi");
+	g_assert(pold_rules_context_diff(context, changed) ==
+			POLD_RULES_BEARER);
+
+	changed = pold_rules_context_set_minute(context, 61);
+	g_assert(pold_rules_context_diff(context, changed) ==
+			POLD_RULES_TIME);
+
+	/* Unknown values replace known ones */
+	context = pold_rules_context_set_state(changed, "bogus");
+	g_assert(pold_rules_context_diff(context, changed) ==
+			POLD_RULES_STATE);
+	g_assert(pold_rules_context_diff(context, context) == 0);
+}
+
+static void test_evaluate(void)
+{
+	struct pold_rules *rules;
+	guint32 context;
+
+	rules = compile("["
+			"{\"When\": {\"State\": [\"connected\", \"online\"], "
+			"\"Bearer\": \"cellular\"}}, "
+			"{\"When\": {\"Time\": \"22:00-06:00\"}}, "
+			"{\"When\": {\"Bearer\": \"wifi\", "
+			"\"Time\": \"08:00-18:00\"}}]");
+	g_assert(rules);
+
+	context = pold_rules_context_set_minute(0, 12 * 60);
+	g_assert(pold_rules_evaluate(rules, context) == 3);
+
+	context = pold_rules_context_set_bearer(context, "wifi");
+	g_assert(pold_rules_evaluate(rules, context) == 2);
+
+	context = pold_rules_context_set_minute(context, 18 * 60);
+	g_assert(pold_rules_evaluate(rules, context) == 3);
+
+	/* The window spans midnight */
+	context = pold_rules_context_set_minute(context, 23 * 60);
+	g_assert(pold_rules_evaluate(rules, context) == 1);
+	context = pold_rules_context_set_minute(context, 5 * 60);
+	g_assert(pold_rules_evaluate(rules, context) == 1);
+
+	/* The first rule which holds wins */
+	context = pold_rules_context_set_bearer(context, "cellular");
+	g_assert(pold_rules_evaluate(rules, context) == 1);
+	context = pold_rules_context_set_state(context, "online");
+	g_assert(pold_rules_evaluate(rules, context) == 0);
+
+	pold_rules_free(rules);
+}
+
+static void test_next_change(void)
+{
+	struct pold_rules *rules;
+
+	rules = compile("[{\"When\": {\"State\": \"online\"}}]");
+	g_assert(pold_rules_next_change(rules, 0) == 0);
+	pold_rules_free(rules);
+
+	rules = compile("[{\"When\": {\"Time\": \"22:00-06:00\"}}, "
+			"{\"When\": {\"Time\": \"08:00-18:30\"}}]");
+	g_assert(pold_rules_next_change(rules, 0) == 6 * 60);
+	g_assert(pold_rules_next_change(rules, 6 * 60) == 2 * 60);
+	g_assert(pold_rules_next_change(rules, 18 * 60) == 30);
+	g_assert(pold_rules_next_change(rules, 23 * 60) == 7 * 60);
+	pold_rules_free(rules);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/rules/compile", test_compile);
+	g_test_add_func("/rules/context", test_context);
+	g_test_add_func("/rules/evaluate", test_evaluate);
+	g_test_add_func("/rules/next_change", test_next_change);
+
+	return g_test_run();
+}
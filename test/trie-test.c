@@ -0,0 +1,96 @@
+/*
+ *
+ *  Policy Daemon - pold
+ *
+ *  Copyright (C) 2014  BWM Car IT GmbH.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <glib.h>
+#include "../src/trie.h"
+
+static void test_is_pattern(void)
+{
+	g_assert(pold_trie_is_pattern("user:*"));
+	g_assert(pold_trie_is_pattern("*"));
+	g_assert(pold_trie_is_pattern("a*b"));
+	g_assert(!pold_trie_is_pattern("user:foo"));
+	g_assert(!pold_trie_is_pattern("a*b*"));
+}
+
+static void test_match(void)
+{
+	struct pold_trie *trie;
+	int prefix, suffix, both, all;
+
+	trie = pold_trie_new();
+
+	g_assert(pold_trie_match(trie, "foo") == NULL);
+
+	g_assert(pold_trie_insert(trie, "foo*", &prefix));
+	g_assert(pold_trie_insert(trie, "*bar", &suffix));
+	g_assert(pold_trie_insert(trie, "foo*bar", &both));
+	g_assert(!pold_trie_insert(trie, "foo", &all));
+	g_assert(pold_trie_size(trie) == 3);
+
+	g_assert(pold_trie_match(trie, "foo") == &prefix);
+	g_assert(pold_trie_match(trie, "foox") == &prefix);
+	g_assert(pold_trie_match(trie, "bar") == &suffix);
+	g_assert(pold_trie_match(trie, "xbar") == &suffix);
+	g_assert(pold_trie_match(trie, "foobar") == &both);
+	g_assert(pold_trie_match(trie, "fooxbar") == &both);
+	g_assert(pold_trie_match(trie, "fo") == NULL);
+	g_assert(pold_trie_match(trie, "") == NULL);
+
+	g_assert(pold_trie_insert(trie, "*", &all));
+	g_assert(pold_trie_match(trie, "") == &all);
+	g_assert(pold_trie_match(trie, "fo") == &all);
+
+	pold_trie_free(trie);
+}
+
+/*
+ * With equally many literal characters, the longer prefix wins
+ */
+static void test_ties(void)
+{
+	struct pold_trie *trie;
+	int a, b, c;
+
+	trie = pold_trie_new();
+
+	g_assert(pold_trie_insert(trie, "ab*", &a));
+	g_assert(pold_trie_insert(trie, "a*b", &b));
+	g_assert(pold_trie_match(trie, "abb") == &a);
+
+	/* Inserting an equal pattern replaces its value */
+	g_assert(pold_trie_insert(trie, "ab*", &c));
+	g_assert(pold_trie_size(trie) == 2);
+	g_assert(pold_trie_match(trie, "abb") == &c);
+
+	pold_trie_free(trie);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+	g_test_add_func("/trie/is_pattern", test_is_pattern);
+	g_test_add_func("/trie/match", test_match);
+	g_test_add_func("/trie/ties", test_ties);
+
+	return g_test_run();
+}